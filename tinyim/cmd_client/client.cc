@@ -1,12 +1,18 @@
 #include "access/access.pb.h"
 
+#include <algorithm>
+#include <atomic>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 
 #include <gflags/gflags.h>
 #include <brpc/channel.h>
 #include <bthread/bthread.h>
 #include <bthread/unstable.h>
 #include <brpc/stream.h>
+#include <butil/iobuf.h>
 #include <butil/time.h>
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -22,6 +28,8 @@ DEFINE_int32(max_retry, 3, "Max retries(not including the first RPC)");
 DEFINE_int32(internal_send_heartbeat_s, 300, "Internal time that send heartbeat");
 DEFINE_int32(user_id, 123, "Internal time that send heartbeat");
 DEFINE_string(password, "xxxxxx", "user password");
+DEFINE_bool(use_stream, true, "Receive pushes over a stream from access, long-poll with "
+            "PullData if false or the stream can not be created");
 
 namespace tinyim {
 
@@ -56,11 +64,125 @@ static int cli_getc(FILE *stream) {
   // return NULL;
 // }
 
+// last group_seq received of each read diffusion group, acked with GetMsgs
+std::mutex g_group_seqs_mutex;
+std::map<group_id_t, int64_t> g_group_seqs;
+
+void UpdateGroupSeq(const Msg& msg){
+  if (msg.group_seq() == 0){
+    return;
+  }
+  std::unique_lock<std::mutex> lck(g_group_seqs_mutex);
+  int64_t& seq = g_group_seqs[msg.group_id()];
+  seq = std::max(seq, msg.group_seq());
+}
+
 struct PullDataArgs {
   tinyim::user_id_t user_id;
   brpc::Channel* channel;
 };
 
+void PrintMsgs(const Msgs& msgs){
+  const size_t msg_size = msgs.msg_size();
+  if (msg_size > 0){
+    std::cout << std::endl;
+    std::cout << "  Received msg:" << std::endl;
+  }
+  if (msgs.dropped_num() > 0){
+    std::cout << "  " << msgs.dropped_num() << " msgs dropped by access, fetch them with GetMsgs"
+              << std::endl;
+  }
+  for (size_t i = 0; i < msg_size; ++i){
+    const Msg& msg = msgs.msg(i);
+    UpdateGroupSeq(msg);
+    std::cout << "    userid=" << msg.user_id()
+              << " sender=" << msg.sender()
+              << " receiver=" << msg.receiver()
+              << " msgid=" << msg.msg_id()
+              << " group_seq=" << msg.group_seq()
+              << " message=" << msg.message()
+              << " client_time=" << msg.client_time()
+              << " msg_time=" << msg.msg_time() << std::endl;
+  }
+}
+
+// Each message of the stream is a batch of pushes. Deleted when the stream is
+// closed, the owner watches `closed'.
+class StreamReceiveHandler: public brpc::StreamInputHandler{
+ public:
+  explicit StreamReceiveHandler(std::shared_ptr<std::atomic<bool>> closed): closed_(closed) {}
+
+  int on_received_messages(brpc::StreamId id,
+                           butil::IOBuf *const messages[],
+                           size_t size) override {
+    for (size_t i = 0; i < size; ++i) {
+      Msgs msgs;
+      butil::IOBufAsZeroCopyInputStream wrapper(*messages[i]);
+      if (!msgs.ParseFromZeroCopyStream(&wrapper)){
+        std::cout << "Fail to parse msgs from stream=" << id << std::endl;
+        continue;
+      }
+      PrintMsgs(msgs);
+    }
+    return 0;
+  }
+
+  void on_idle_timeout(brpc::StreamId id) override {
+  }
+
+  void on_closed(brpc::StreamId id) override {
+    std::cout << "Stream=" << id << " is closed" << std::endl;
+    closed_->store(true);
+    delete this;
+  }
+
+ private:
+  std::shared_ptr<std::atomic<bool>> closed_;
+};
+
+// Receive pushes over a stream until it is closed, false if it can not be
+// created.
+bool RunStream(brpc::Channel* pchannel, tinyim::user_id_t user_id){
+  auto closed = std::make_shared<std::atomic<bool>>(false);
+  brpc::StreamOptions stream_options;
+  stream_options.handler = new StreamReceiveHandler(closed);
+
+  brpc::Controller cntl;
+  brpc::StreamId stream;
+  if (brpc::StreamCreate(&stream, cntl, &stream_options) != 0) {
+    std::cout << "Fail to create stream" << std::endl;
+    delete stream_options.handler;
+    return false;
+  }
+  tinyim::Ping ping;
+  ping.set_user_id(user_id);
+  tinyim::Pong pong;
+  tinyim::AccessService_Stub stub(pchannel);
+  stub.CreateStream(&cntl, &ping, &pong, nullptr);
+  if (cntl.Failed()) {
+    std::cout << "Fail to call CreateStream. " << cntl.ErrorText() << std::endl;
+    brpc::StreamClose(stream);
+    return false;
+  }
+  std::cout << "Created Stream=" << stream << std::endl;
+
+  // access takes any data on the stream as a heartbeat and closes it when idle
+  static const int64_t keepalive_interval_us = FLAGS_internal_send_heartbeat_s * 1000000L;
+  int64_t last_write_us = butil::gettimeofday_us();
+  while (!closed->load() && !brpc::IsAskedToQuit()){
+    bthread_usleep(100000L);
+    const int64_t now_us = butil::gettimeofday_us();
+    if (now_us - last_write_us >= keepalive_interval_us){
+      butil::IOBuf keepalive;
+      keepalive.append("h");
+      brpc::StreamWrite(stream, keepalive);
+      last_write_us = now_us;
+    }
+  }
+  brpc::StreamClose(stream);
+  return true;
+}
+
 // run in bthread
 void* PullData(void *arg){
   std::cout << "PullData bthread running" << std::endl;
@@ -70,6 +192,10 @@ void* PullData(void *arg){
   delete args;
 
   while (!brpc::IsAskedToQuit()) {
+    if (FLAGS_use_stream && RunStream(pchannel, user_id)){
+      continue;
+    }
+    // long-poll until the stream can be created again
     brpc::Controller cntl;
     tinyim::Ping ping;
     ping.set_user_id(user_id);
@@ -84,23 +210,8 @@ void* PullData(void *arg){
       bthread_usleep(1000000L);
       continue;
     }
-    // bthread_usleep(1000000L);
-    const size_t msg_size = msgs.msg_size();
-    if (msg_size > 0){
-      std::cout << std::endl;
-      std::cout << "  Received msg:" << std::endl;
-    }
-    for (size_t i = 0; i < msg_size; ++i){
-      const Msg& msg = msgs.msg(i);
-      std::cout << "    userid=" << msg.user_id()
-                << " sender=" << msg.sender()
-                << " receiver=" << msg.receiver()
-                << " msgid=" << msg.msg_id()
-                << " message=" << msg.message()
-                << " client_time=" << msg.client_time()
-                << " msg_time=" << msg.msg_time() << std::endl;
-      }
-    }
+    PrintMsgs(msgs);
+  }
   return nullptr;
 }
 
@@ -124,27 +235,6 @@ void* PullData(void *arg){
   // }
 // }
 
-// class StreamReceiveHandler: public brpc::StreamInputHandler{
-  // virtual int on_received_messages(brpc::StreamId id,
-                                   // butil::IOBuf *const messages[],
-                                   // size_t size) {
-    // std::ostringstream os;
-    // for (size_t i = 0; i < size; ++i) {
-        // os << "msg[" << i << "]=" << *messages[i];
-    // }
-    // LOG(INFO) << "Received from Stream=" << id << ": " << os.str();
-    // return 0;
-  // }
-  // virtual void on_idle_timeout(brpc::StreamId id) {
-    // LOG(INFO) << "Stream=" << id << " has no data transmission for a while";
-  // }
-
-  // virtual void on_closed(brpc::StreamId id) {
-    // LOG(INFO) << "Stream=" << id << " is closed";
-    // // brpc::StreamClose(id);
-  // }
-// };
-
 // FIXME maybe need lock
 struct HeartBeatArg{
   brpc::Channel* channel;
@@ -297,6 +387,15 @@ int main(int argc, char* argv[]) {
     msg_range.set_user_id(user_id);
     msg_range.set_start_msg_id(0);
     msg_range.set_end_msg_id(100000);
+    msg_range.set_read_timelines(true);
+    {
+      std::unique_lock<std::mutex> lck(g_group_seqs_mutex);
+      for (const auto& group_and_seq : g_group_seqs){
+        auto read_group_seq = msg_range.add_read_group_seqs();
+        read_group_seq->set_group_id(group_and_seq.first);
+        read_group_seq->set_seq(group_and_seq.second);
+      }
+    }
     tinyim::Msgs msgs;
 
     std::cout << "Calling GetMsgs" << std::endl;
@@ -308,7 +407,12 @@ int main(int argc, char* argv[]) {
       return 0;
     }
     std::cout << "  total msg=" << msgs.msg_size() << std::endl;
+    for (int i = 0; i < msgs.empty_ranges_size(); ++i){
+      std::cout << "    empty msg_id=[" << msgs.empty_ranges(i).start_msg_id()
+                << ", " << msgs.empty_ranges(i).end_msg_id() << "]" << std::endl;
+    }
     for (int i = 0; i < msgs.msg_size(); ++i){
+      UpdateGroupSeq(msgs.msg(i));
       if (i == 0 || i == msgs.msg_size() - 1){
         std::cout << "    msg_id=" << msgs.msg(i).msg_id()
                   << " user_id=" << msgs.msg(i).user_id()
@@ -324,17 +428,6 @@ int main(int argc, char* argv[]) {
   }
 
 
-  // brpc::Controller stream_cntl;
-  // brpc::StreamId stream;
-
-  // tinyim::StreamReceiveHandler stream_receive_handler;
-  // brpc::StreamOptions stream_options;
-  // stream_options.handler = &stream_receive_handler;
-
-  // if (brpc::StreamCreate(&stream, stream_cntl, &stream_options) != 0) {
-      // LOG(ERROR) << "Fail to create stream";
-      // return -1;
-  // }
   // tinyim::AccessService_Stub stub(&channel);
 
   auto pull_data_args = new tinyim::PullDataArgs{user_id, &channel};
@@ -345,11 +438,6 @@ int main(int argc, char* argv[]) {
   // tinyim::Pong tmp_pong;
   // tinyim::Ping ping;
   // ping.set_user_id(user_id);
-  // stub.CreateStream(&stream_cntl, &ping, &tmp_pong, NULL);
-  // if (stream_cntl.Failed()) {
-      // LOG(ERROR) << "Fail to CreateStream, " << stream_cntl.ErrorText();
-      // return -1;
-  // }
   tinyim::msg_id_t cur_msg_id = 0;
 
   tinyim::HeartBeatArg heartbeatarg = {&channel, user_id, cur_msg_id, 0};
@@ -359,7 +447,6 @@ int main(int argc, char* argv[]) {
                     tinyim::HeartBeatTimeOutHeadler,
                     &heartbeatarg);
 
-  // LOG(INFO) << "Created Stream=" << stream;
   // const tinyim::MsgId tmp_msg_id = 12345;
 
   size_t str_len = strlen("sendmsgto ");
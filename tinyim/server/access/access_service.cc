@@ -4,48 +4,133 @@
 #include "logic/logic.pb.h"
 
 #include <errno.h>
+#include <atomic>
 #include <memory>
-
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <brpc/callback.h>
 #include <brpc/channel.h>
 #include <bthread/bthread.h>
 #include <butil/crc32c.h>
+#include <butil/strings/string_split.h>
 #include <butil/time.h>
+#include <bvar/bvar.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
 DEFINE_int32(recv_heartbeat_timeout_s, 400, "Receive heartbeat timeout");
+DEFINE_int32(heartbeat_tick_ms, 1000, "Idle users are expired in batches once a tick, "
+             "so up to a tick after their heartbeat timeout");
+DEFINE_int32(access_mailbox_capacity, 64, "Pushes kept for a user between two PullData, "
+             "the oldest are dropped beyond it, 0 to drop every push without a PullData");
+DEFINE_int32(access_mailbox_max_mb, 256, "Memory of all mailboxes, pushes are dropped beyond it");
+DEFINE_int32(access_stream_batch_capacity, 1024, "Pushes batched for a stream while it is "
+             "being written, the oldest are dropped beyond it");
+DEFINE_string(logic_session_servers, "", "Every logic as ip:port,ip:port told of SignIn and "
+              "SignOut to drop cached sessions, empty for the one -logic_server picks");
+DEFINE_int32(access_conn_shard_num, 0, "Shards of the connection table, rounded up to a "
+             "power of 2, 0 for 4 times the cores");
+DEFINE_bool(logic_route_by_sender, true, "Send all SendMsg of a sender to the same logic, "
+            "which keeps its last send, false to pick the logic by the peer");
 
-namespace tinyim {
-struct HeartBeatTimeoutArg{
-  user_id_t user_id;
-  AccessServiceImpl *access_service_impl;
-};
+namespace {
 
-}  // namespace tinyim
+bvar::Adder<int64_t> g_heartbeat_expired_count("access_heartbeat_expired_count");
+bvar::Adder<int64_t> g_mailbox_msg_count("access_mailbox_msg_count");
+bvar::Adder<int64_t> g_mailbox_dropped_count("access_mailbox_dropped_count");
+bvar::IntRecorder g_mailbox_drain_size("access_mailbox_drain_size");
 
-namespace {
-static void UserHeartBeatTimeoutHeadler(void* arg){
-  std::unique_ptr<tinyim::HeartBeatTimeoutArg>
-    parg(static_cast<tinyim::HeartBeatTimeoutArg*>(arg));
+std::atomic<int64_t> g_mailbox_bytes(0);
 
-  tinyim::user_id_t user_id = parg->user_id;
-  auto access_service_impl = parg->access_service_impl;
-  access_service_impl->ClearUserData(user_id);
+int64_t GetMailboxBytes(void*){
+  return g_mailbox_bytes.load(std::memory_order_relaxed);
+}
+
+bvar::PassiveStatus<int64_t> g_mailbox_bytes_bvar("access_mailbox_bytes", GetMailboxBytes, nullptr);
+
+int64_t TickOf(int64_t ms){
+  // round up so that users never expire early
+  return (ms + FLAGS_heartbeat_tick_ms - 1) / FLAGS_heartbeat_tick_ms;
 }
 
 uint32_t Hash(int64_t id){
   return butil::crc32c::Value(reinterpret_cast<const char*>(&id), sizeof(id));
 }
+
+size_t ConnShardNum(){
+  if (FLAGS_access_conn_shard_num > 0){
+    return FLAGS_access_conn_shard_num;
+  }
+  const size_t core_num = std::thread::hardware_concurrency();
+  return core_num == 0 ? 64 : core_num * 4;
+}
+
+// Held for a few pointer swaps of a user's pending PullData, so that pushes
+// and long-polls only take the shard lock shared.
+class PullLockGuard {
+ public:
+  explicit PullLockGuard(int32_t* lock): lock_(*lock) {
+    while (lock_.exchange(1, std::memory_order_acquire) != 0){
+      std::this_thread::yield();
+    }
+  }
+
+  ~PullLockGuard(){
+    lock_.store(0, std::memory_order_release);
+  }
+
+ private:
+  std::atomic_ref<int32_t> lock_;
+};
+
+void StoreActive(int64_t* last_active_ms, int64_t now_ms){
+  std::atomic_ref<int64_t>(*last_active_ms).store(now_ms, std::memory_order_relaxed);
+}
+
+void OnSessionChangedDone(brpc::Controller* cntl, tinyim::Pong* pong){
+  std::unique_ptr<brpc::Controller> cntl_guard(cntl);
+  std::unique_ptr<tinyim::Pong> pong_guard(pong);
+  LOG_IF(WARNING, cntl->Failed()) << "Fail to call SessionChanged. " << cntl->ErrorText();
+}
 }
 
 namespace tinyim {
 
 AccessServiceImpl::AccessServiceImpl(brpc::Channel* logic_channel,
-                                     brpc::Channel* db_channel): logic_channel_(logic_channel),
-                                                                 db_channel_(db_channel) {}
+                                     brpc::Channel* db_channel): conn_table_(ConnShardNum()),
+                                                                 logic_channel_(logic_channel),
+                                                                 db_channel_(db_channel) {
+  const int64_t now_tick = TickOf(butil::gettimeofday_ms());
+  for (size_t i = 0; i < conn_table_.shard_num(); ++i){
+    wheels_.emplace_back(new TimingWheel(now_tick));
+  }
+  if (bthread_start_background(&sweeper_, nullptr, SweepIdleUsers, this) != 0){
+    LOG(ERROR) << "Fail to start heartbeat sweeper";
+    exit(-1);
+  }
+  std::vector<std::string> servers;
+  butil::SplitString(FLAGS_logic_session_servers, ',', &servers);
+  for (const auto& server : servers){
+    brpc::ChannelOptions options;
+    options.protocol = brpc::PROTOCOL_BAIDU_STD;
+    session_channels_.emplace_back(new brpc::Channel);
+    if (session_channels_.back()->Init(server.c_str(), &options) != 0){
+      LOG(ERROR) << "Fail to initialize channel to logic " << server;
+      exit(-1);
+    }
+  }
+}
 
 AccessServiceImpl::~AccessServiceImpl() {
   DLOG(INFO) << "Calling AccessServiceImpl dtor";
+  if (!stopped_.exchange(true)){
+    bthread_join(sweeper_, nullptr);
+  }
 }
 
 void AccessServiceImpl::Test(google::protobuf::RpcController* controller,
@@ -59,10 +144,16 @@ void AccessServiceImpl::Test(google::protobuf::RpcController* controller,
 void AccessServiceImpl::SignIn(google::protobuf::RpcController* controller,
                                const SigninData* signin_data,
                                Pong* reply,
-                               google::protobuf::Closure* done){
+                               google::protobuf::Closure* done) {
+  SignInAsync(static_cast<brpc::Controller*>(controller), signin_data, reply, done);
+}
+
+RpcTask AccessServiceImpl::SignInAsync(brpc::Controller* cntl,
+                                       const SigninData* signin_data,
+                                       Pong* reply,
+                                       google::protobuf::Closure* done) {
 
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   const user_id_t user_id = signin_data->user_id();
   const std::string password = signin_data->password();
@@ -84,13 +175,16 @@ void AccessServiceImpl::SignIn(google::protobuf::RpcController* controller,
   Pong pong;
   brpc::Controller db_cntl;
   db_cntl.set_log_id(cntl->log_id());
-  db_stub.AuthAndSaveSession(&db_cntl, &cur_signin_data, &pong, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    db_stub.AuthAndSaveSession(&db_cntl, &cur_signin_data, &pong, resume);
+  });
   if (db_cntl.Failed()){
       DLOG(ERROR) << "Fail to call GetGroupMember. " << db_cntl.ErrorText();
       cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
   }
   else {
     reply->set_last_msg_id(pong.last_msg_id());
+    NotifySessionChanged(user_id, cur_signin_data.access_addr());
   }
 }
 
@@ -98,9 +192,15 @@ void AccessServiceImpl::SignOut(google::protobuf::RpcController* controller,
                                 const UserId* userid,
                                 Pong* reply,
                                 google::protobuf::Closure* done){
+  SignOutAsync(static_cast<brpc::Controller*>(controller), userid, reply, done);
+}
+
+RpcTask AccessServiceImpl::SignOutAsync(brpc::Controller* cntl,
+                                        const UserId* userid,
+                                        Pong* reply,
+                                        google::protobuf::Closure* done){
 
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   const user_id_t user_id = userid->user_id();
   DLOG(INFO) << "Received request[log_id=" << cntl->log_id()
@@ -111,14 +211,51 @@ void AccessServiceImpl::SignOut(google::protobuf::RpcController* controller,
   DbproxyService_Stub db_stub(db_channel_);
   Pong pong;
   brpc::Controller db_cntl;
+  db_cntl.set_log_id(cntl->log_id());
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    db_stub.ClearSession(&db_cntl, userid, &pong, resume);
+  });
+  if (db_cntl.Failed()){
+    DLOG(ERROR) << "Fail to call ClearSession. " << db_cntl.ErrorText();
+    cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
+    co_return;
+  }
+  NotifySessionChanged(user_id, std::string());
+}
+
+void AccessServiceImpl::NotifySessionChanged(user_id_t user_id, const std::string& addr){
+  Session session;
+  session.set_user_id(user_id);
+  session.set_has_session(!addr.empty());
+  session.set_addr(addr);
+  std::vector<brpc::Channel*> channels;
+  for (const auto& channel : session_channels_){
+    channels.push_back(channel.get());
+  }
+  if (channels.empty() && logic_channel_ != nullptr){
+    channels.push_back(logic_channel_);
+  }
+  for (brpc::Channel* channel : channels){
+    LogicService_Stub logic_stub(channel);
+    auto logic_cntl = new brpc::Controller;
+    auto pong = new Pong;
+    logic_stub.SessionChanged(logic_cntl, &session, pong,
+                              brpc::NewCallback(OnSessionChangedDone, logic_cntl, pong));
+  }
 }
 
 void AccessServiceImpl::SendMsg(google::protobuf::RpcController* controller,
                                 const NewMsg* new_msg,
                                 MsgReply* reply,
                                 google::protobuf::Closure* done) {
+  SendMsgAsync(static_cast<brpc::Controller*>(controller), new_msg, reply, done);
+}
+
+RpcTask AccessServiceImpl::SendMsgAsync(brpc::Controller* cntl,
+                                        const NewMsg* new_msg,
+                                        MsgReply* reply,
+                                        google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
   const user_id_t user_id = new_msg->user_id();
   DLOG(INFO) << "Received request[log_id=" << cntl->log_id()
              << "] from " << cntl->remote_side()
@@ -135,17 +272,18 @@ void AccessServiceImpl::SendMsg(google::protobuf::RpcController* controller,
   brpc::Controller logic_cntl;
   logic_cntl.set_log_id(cntl->log_id());
   MsgReply logic_reply;
-  // XXX consistent hash use peer_id
-  // logic_cntl.set_request_code(new_msg->peer_id());
-  uint32_t code = Hash(new_msg->peer_id());
+  // the logic of a sender tells its retries without reading redis
+  uint32_t code = Hash(FLAGS_logic_route_by_sender ? user_id : new_msg->peer_id());
   DLOG(INFO) << "peer_id=" << new_msg->peer_id() <<  " code=" << code;
   logic_cntl.set_request_code(code);
 
-  logic_stub.SendMsg(&logic_cntl, new_msg, &logic_reply, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    logic_stub.SendMsg(&logic_cntl, new_msg, &logic_reply, resume);
+  });
   if (logic_cntl.Failed()) {
       DLOG(ERROR) << "Fail to call SendMsg. " << logic_cntl.ErrorText();
       cntl->SetFailed(logic_cntl.ErrorCode(), logic_cntl.ErrorText().c_str());
-      return;
+      co_return;
   }
   else {
     *reply = logic_reply;
@@ -169,6 +307,27 @@ void AccessServiceImpl::PullData(google::protobuf::RpcController* controller,
   done_guard.release();
 }
 
+void AccessServiceImpl::CreateStream(google::protobuf::RpcController* controller,
+                                     const Ping* ping,
+                                     Pong* pong,
+                                     google::protobuf::Closure* done) {
+  brpc::ClosureGuard done_guard(done);
+  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
+  const user_id_t user_id = ping->user_id();
+  DLOG(INFO) << "Received request[log_id=" << cntl->log_id()
+            << "] from " << cntl->remote_side()
+            << " to " << cntl->local_side()
+            << " user_id=" << user_id;
+
+  auto pusher = std::make_shared<StreamPusher>(FLAGS_access_stream_batch_capacity,
+                                               [this, user_id]{ ResetHeartBeatTimer(user_id); });
+  if (!pusher->Accept(cntl)){
+    cntl->SetFailed("Fail to accept stream");
+    return;
+  }
+  AttachStream(user_id, pusher);
+}
+
 void AccessServiceImpl::HeartBeat(google::protobuf::RpcController* controller,
                                   const Ping* ping,
                                   Pong* pong,
@@ -194,72 +353,130 @@ void AccessServiceImpl::SendtoAccess(google::protobuf::RpcController* controller
             << "] from " << cntl->remote_side()
             << " to " << cntl->local_side();
   auto user_id = msg->user_id();
-  ::google::protobuf::Closure* client_done = nullptr;
-  Msgs* msgs = nullptr;
-  brpc::Controller* client_cntl = nullptr;
-  PopClosureAndReply(user_id, &client_done, &msgs, &client_cntl);
-  if (client_done != nullptr) {
-    brpc::ClosureGuard done_guard(client_done);
-    *msgs->add_msg() = *msg;
+  if (!DeliverMsg(user_id, *msg).ok()){
+    DLOG(INFO) << "user_id=" << user_id << " is not connected";
   }
-  else {
-    DLOG(INFO) << "user_id=" << user_id << " client_done = nullptr";
+}
+
+void AccessServiceImpl::SendtoAccessBatch(google::protobuf::RpcController* controller,
+                                          const MsgBatch* batch,
+                                          Pong* pong,
+                                          google::protobuf::Closure* done){
+  brpc::ClosureGuard done_guard(done);
+  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
+  DLOG(INFO) << "Received request[log_id=" << cntl->log_id()
+            << "] from " << cntl->remote_side()
+            << " to " << cntl->local_side()
+            << " user num=" << batch->user_and_msgids_size();
+
+  std::unordered_map<user_id_t, std::vector<const MsgIdRange*>> skipped_ranges;
+  for (const MsgIdRange& range : batch->skipped_ranges()){
+    skipped_ranges[range.user_id()].push_back(&range);
+  }
+  Msg msg = batch->msg();
+  for (const UserAndMsgId& user_and_msgid : batch->user_and_msgids()){
+    const user_id_t user_id = user_and_msgid.user_id();
+    msg.set_user_id(user_id);
+    msg.set_receiver(user_id);
+    msg.set_msg_id(user_and_msgid.msg_id());
+    msg.clear_skipped_ranges();
+    auto iter = skipped_ranges.find(user_id);
+    if (iter != skipped_ranges.end()){
+      for (const MsgIdRange* range : iter->second){
+        *msg.add_skipped_ranges() = *range;
+      }
+    }
+    if (!DeliverMsg(user_id, msg).ok()){
+      DLOG(INFO) << "user_id=" << user_id << " is not connected";
+    }
   }
 }
 
 butil::Status AccessServiceImpl::ResetHeartBeatTimer(user_id_t user_id){
-  static const int64_t heartbeat_timeout_us = FLAGS_recv_heartbeat_timeout_s * 1000000;
-  const int bucket = user_id % kBucketNum;
-  auto& id_map = id_map_[bucket];
-  // allocate it before lock
-  auto hbarg = new HeartBeatTimeoutArg{user_id, this};
-  std::unique_ptr<HeartBeatTimeoutArg> lazy_delete;
-
-  const int64_t cur_time_us = butil::gettimeofday_us();
-  std::unique_lock<std::mutex> lck(mutex_[bucket]);
-  if (id_map.count(user_id) != 0){
-    auto& data = id_map[user_id];
-    if (data.heartbeat_timeout_id != 0 /*TimerThread::INVALID_TASK_ID */ ){
-      if (bthread_timer_del(data.heartbeat_timeout_id) == 0){
-        lazy_delete.reset(data.hbarg);
-      }
+  const size_t shard_index = conn_table_.ShardIndex(user_id);
+  auto& shard = conn_table_.shard(shard_index);
+  const int64_t now_ms = butil::gettimeofday_ms();
+
+  {
+    std::shared_lock<std::shared_mutex> lck(shard.mutex());
+    Data* data = shard.Find(user_id);
+    if (data != nullptr){
+      // the sweeper re-arms the timer from it when it fires
+      StoreActive(&data->last_active_ms, now_ms);
+      return butil::Status::OK();
     }
-    bthread_timer_add(&data.heartbeat_timeout_id,
-                      butil::microseconds_to_timespec(cur_time_us + heartbeat_timeout_us),
-                      UserHeartBeatTimeoutHeadler,
-                      hbarg);
-    data.hbarg = hbarg;
   }
-  else{
-    bthread_timer_t heartbeat_timeout_id;
-    bthread_timer_add(&heartbeat_timeout_id,
-                      butil::microseconds_to_timespec(cur_time_us + heartbeat_timeout_us),
-                      UserHeartBeatTimeoutHeadler,
-                      hbarg);
-    id_map[user_id] = { nullptr, nullptr, nullptr,
-                        heartbeat_timeout_id, hbarg };
+
+  std::unique_lock<std::shared_mutex> lck(shard.mutex());
+  bool inserted = false;
+  Data* data = shard.FindOrInsert(user_id, &inserted);
+  data->last_active_ms = now_ms;
+  if (inserted){
+    ArmLocked(shard_index, user_id, data);
   }
   lck.unlock();
   return butil::Status::OK();
 }
 
-butil::Status AccessServiceImpl::ClearUserData(user_id_t user_id){
-  const int bucket = user_id % kBucketNum;
-  auto& id_map = id_map_[bucket];
-  std::unique_ptr<HeartBeatTimeoutArg> lazy_delete;
+void AccessServiceImpl::ArmLocked(size_t shard, user_id_t user_id, Data* data){
+  data->expire_tick = TickOf(data->last_active_ms + FLAGS_recv_heartbeat_timeout_s * 1000L);
+  wheels_[shard]->Add(user_id, data->expire_tick);
+}
+
+void* AccessServiceImpl::SweepIdleUsers(void* arg){
+  auto this_ = static_cast<AccessServiceImpl*>(arg);
+  std::vector<user_id_t> idle_users;
+  while (!this_->stopped_.load()){
+    bthread_usleep(FLAGS_heartbeat_tick_ms * 1000L);
+    const int64_t now_ms = butil::gettimeofday_ms();
+    const int64_t idle_since_ms = now_ms - FLAGS_recv_heartbeat_timeout_s * 1000L;
+    for (size_t shard_index = 0; shard_index < this_->conn_table_.shard_num(); ++shard_index){
+      auto& shard = this_->conn_table_.shard(shard_index);
+      std::unique_lock<std::shared_mutex> lck(shard.mutex());
+      this_->wheels_[shard_index]->Advance(TickOf(now_ms), [&](int64_t user_id, int64_t tick){
+        Data* data = shard.Find(user_id);
+        if (data == nullptr || data->expire_tick != tick){
+          // cleared, or a timer armed before it was cleared and added again
+          return;
+        }
+        if (data->last_active_ms <= idle_since_ms){
+          idle_users.push_back(user_id);
+        }
+        else {
+          this_->ArmLocked(shard_index, user_id, data);
+        }
+      });
+      lck.unlock();
 
-  std::unique_lock<std::mutex> lck(mutex_[bucket]);
-  if (id_map.count(user_id) > 0){
-      auto origin_data = id_map[user_id];
-      auto& data = id_map[user_id];
-      if (data.heartbeat_timeout_id != 0){
-        if (bthread_timer_del(data.heartbeat_timeout_id) == 0){
-          lazy_delete.reset(data.hbarg);
+      for (user_id_t user_id : idle_users){
+        if (this_->ClearUserData(user_id, idle_since_ms).ok()){
+          g_heartbeat_expired_count << 1;
         }
       }
-      id_map.erase(user_id);
+      idle_users.clear();
+    }
+  }
+  return nullptr;
+}
+
+butil::Status AccessServiceImpl::ClearUserData(user_id_t user_id, int64_t idle_since_ms){
+  auto& shard = conn_table_.shard(conn_table_.ShardIndex(user_id));
+
+  std::unique_lock<std::shared_mutex> lck(shard.mutex());
+  Data* data = shard.Find(user_id);
+  if (data != nullptr){
+      if (data->last_active_ms > idle_since_ms){
+        // active again after the sweeper saw it idle
+        return butil::Status(EAGAIN, "User is active");
+      }
+      const Data origin_data = *data;
+      shard.Erase(user_id);
       lck.unlock();
 
+      FreeMailbox(origin_data.mailbox);
+      if (origin_data.pusher != nullptr){
+        origin_data.pusher->Close();
+      }
       if (origin_data.msgs != nullptr){
         origin_data.cntl->CloseConnection("Server close");
         origin_data.done->Run();
@@ -276,42 +493,53 @@ butil::Status AccessServiceImpl::PushClosureAndReply(user_id_t user_id,
                                                      google::protobuf::Closure* done,
                                                      Msgs* msgs,
                                                      brpc::Controller* cntl){
-  const int bucket = user_id % kBucketNum;
-  auto& id_map = id_map_[bucket];
-  std::unique_ptr<HeartBeatTimeoutArg> lazy_delete;
-  std::unique_ptr<HeartBeatTimeoutArg> ptr(new HeartBeatTimeoutArg{user_id, this});
+  const size_t shard_index = conn_table_.ShardIndex(user_id);
+  auto& shard = conn_table_.shard(shard_index);
   brpc::ClosureGuard lazy_run;
-
-  std::unique_lock<std::mutex> lck(mutex_[bucket]);
-  if (id_map.count(user_id) == 0){
-    id_map[user_id] = { done, msgs, cntl, 0, nullptr };
-  }
-  else {
-    auto& data = id_map[user_id];
-    if (data.done){
-      // data.msgs->set_data_type(DataType::NONE);
-      lazy_run.reset(data.done);
-    }
-    data.done = done;
-    data.msgs = msgs;
-    data.cntl = cntl;
-    if (data.heartbeat_timeout_id != 0){
-      if (bthread_timer_del(data.heartbeat_timeout_id) == 0){
-        // hbarg no change
-        data.heartbeat_timeout_id = 0;
-        lazy_delete.reset(data.hbarg);
-        data.hbarg = nullptr;
+  brpc::ClosureGuard reply_now;
+  const int64_t now_ms = butil::gettimeofday_ms();
+
+  {
+    std::shared_lock<std::shared_mutex> lck(shard.mutex());
+    Data* data = shard.Find(user_id);
+    if (data != nullptr){
+      PullLockGuard pull_guard(&data->pull_lock);
+      if (data->done){
+        // data->msgs->set_data_type(DataType::NONE);
+        lazy_run.reset(data->done);
+        data->done = nullptr;
+        data->msgs = nullptr;
+        data->cntl = nullptr;
+      }
+      if (data->mailbox != nullptr && data->mailbox->pending()){
+        // pushes arrived since the last PullData, no need to park
+        DrainMailboxLocked(data, msgs);
+        reply_now.reset(done);
+      }
+      else {
+        data->done = done;
+        data->msgs = msgs;
+        data->cntl = cntl;
       }
+      StoreActive(&data->last_active_ms, now_ms);
+      return butil::Status::OK();
     }
   }
-  const int64_t cur_time_us = butil::gettimeofday_us();
-  static const int64_t heartbeat_timeout_us = FLAGS_recv_heartbeat_timeout_s * 1000000;
-  bthread_timer_t heartbeat_timeout_id;
-  bthread_timer_add(&heartbeat_timeout_id,
-                    butil::microseconds_to_timespec(cur_time_us + heartbeat_timeout_us),
-                    UserHeartBeatTimeoutHeadler,
-                    ptr.release());
-  id_map[user_id].heartbeat_timeout_id = heartbeat_timeout_id;
+
+  // a new user has no mailbox
+  std::unique_lock<std::shared_mutex> lck(shard.mutex());
+  bool inserted = false;
+  Data* data = shard.FindOrInsert(user_id, &inserted);
+  if (data->done){
+    lazy_run.reset(data->done);
+  }
+  data->done = done;
+  data->msgs = msgs;
+  data->cntl = cntl;
+  data->last_active_ms = now_ms;
+  if (inserted){
+    ArmLocked(shard_index, user_id, data);
+  }
   lck.unlock();
 
   return butil::Status::OK();
@@ -322,44 +550,31 @@ butil::Status AccessServiceImpl::PopClosureAndReply(user_id_t user_id,
                                                     Msgs** msgs,
                                                     brpc::Controller** cntl) {
   brpc::ClosureGuard lazy_run;
-  const int bucket = user_id % kBucketNum;
-  auto& id_map = id_map_[bucket];
-
-  std::unique_lock<std::mutex> lck(mutex_[bucket]);
-  if (id_map.count(user_id) > 0){
+  auto& shard = conn_table_.shard(conn_table_.ShardIndex(user_id));
+
+  // shared, so pushes to online users do not wait for heartbeats and
+  // long-polls of other users of the shard
+  std::shared_lock<std::shared_mutex> lck(shard.mutex());
+  Data* data = shard.Find(user_id);
+  if (data != nullptr){
+    PullLockGuard pull_guard(&data->pull_lock);
     if (done != nullptr){
-      auto& data = id_map[user_id];
-
-      // *done = id_map[user_id].done;
-      *done = data.done;
-      data.done = nullptr;
-      // *reply = id_map[user_id].reply;
-      *msgs = data.msgs;
-      data.msgs = nullptr;
-      // *cntl = id_map[user_id].cntl;
-      *cntl = data.cntl;
-      data.cntl = nullptr;
-      // id_map.erase(user_id);
-      lck.unlock();
+      *done = data->done;
+      data->done = nullptr;
+      *msgs = data->msgs;
+      data->msgs = nullptr;
+      *cntl = data->cntl;
+      data->cntl = nullptr;
       return butil::Status::OK();
     }
     else{
-      auto& data = id_map[user_id];
-
-      if (data.done){
-        lazy_run.reset(data.done);
-        data.done = nullptr;
-        // data.msgs->set_data_type(DataType::NONE);
-        data.msgs = nullptr;
-        data.cntl = nullptr;
+      if (data->done){
+        lazy_run.reset(data->done);
+        data->done = nullptr;
+        // data->msgs->set_data_type(DataType::NONE);
+        data->msgs = nullptr;
+        data->cntl = nullptr;
       }
-      // if (bthread_timer_del(data.heartbeat_timeout_id) == 0){
-        // data.heartbeat_timeout_id = 0;
-        // delete data.hbarg;
-        // data.hbarg = nullptr;
-      // }
-
-      lck.unlock();
       return butil::Status::OK();
     }
   }
@@ -371,23 +586,139 @@ butil::Status AccessServiceImpl::PopClosureAndReply(user_id_t user_id,
 
 void AccessServiceImpl::ClearClosureAndReply() {
   // FIXME Should lock  when process is stopping?
-  for (int bucket = 0; bucket < kBucketNum; ++bucket){
-    for (auto iter = id_map_[bucket].begin(); iter != id_map_[bucket].end(); ++iter){
-      auto& data = iter->second;
-      if (data.msgs != nullptr){
-        // data.reply->set_data_type(DataType::NONE);
-        data.cntl->CloseConnection("Server close");
-        data.done->Run();
+  for (size_t shard_index = 0; shard_index < conn_table_.shard_num(); ++shard_index){
+    conn_table_.shard(shard_index).ForEach([](user_id_t user_id, Data* data){
+      if (data->msgs != nullptr){
+        // data->reply->set_data_type(DataType::NONE);
+        data->cntl->CloseConnection("Server close");
+        data->done->Run();
       }
-      if (data.heartbeat_timeout_id != 0 /*TimerThread::INVALID_TASK_ID*/){
-        if (bthread_timer_del(data.heartbeat_timeout_id) == 0){
-          delete data.hbarg;
-        }
+      FreeMailbox(data->mailbox);
+      data->mailbox = nullptr;
+      if (data->pusher != nullptr){
+        data->pusher->Close();
+        data->pusher.reset();
       }
+    });
+  }
+}
+void AccessServiceImpl::AttachStream(user_id_t user_id, const std::shared_ptr<StreamPusher>& pusher){
+  const size_t shard_index = conn_table_.ShardIndex(user_id);
+  auto& shard = conn_table_.shard(shard_index);
+  brpc::ClosureGuard lazy_run;
+  std::shared_ptr<StreamPusher> old_pusher;
+  Msgs queued;
+
+  std::unique_lock<std::shared_mutex> lck(shard.mutex());
+  bool inserted = false;
+  Data* data = shard.FindOrInsert(user_id, &inserted);
+  if (inserted){
+    data->last_active_ms = butil::gettimeofday_ms();
+    ArmLocked(shard_index, user_id, data);
+  }
+  if (data->done != nullptr){
+    // the stream takes over, reply the parked PullData empty
+    lazy_run.reset(data->done);
+    data->done = nullptr;
+    data->msgs = nullptr;
+    data->cntl = nullptr;
+  }
+  if (data->mailbox != nullptr && data->mailbox->pending()){
+    DrainMailboxLocked(data, &queued);
+  }
+  old_pusher.swap(data->pusher);
+  data->pusher = pusher;
+  lck.unlock();
+
+  if (old_pusher != nullptr){
+    old_pusher->Close();
+  }
+  pusher->AddDropped(queued.dropped_num());
+  for (const Msg& msg : queued.msg()){
+    pusher->Push(msg);
+  }
+}
+
+butil::Status AccessServiceImpl::DeliverMsg(user_id_t user_id, const Msg& msg){
+  brpc::ClosureGuard client_done_guard;
+  std::shared_ptr<StreamPusher> pusher;
+  auto& shard = conn_table_.shard(conn_table_.ShardIndex(user_id));
+
+  std::shared_lock<std::shared_mutex> lck(shard.mutex());
+  Data* data = shard.Find(user_id);
+  if (data == nullptr){
+    lck.unlock();
+    return butil::Status(EINVAL, "Have no this user");
+  }
+  PullLockGuard pull_guard(&data->pull_lock);
+  if (data->pusher != nullptr){
+    if (!data->pusher->closed()){
+      data->pusher->Push(msg);
+      return butil::Status::OK();
     }
+    // fall back to PullData, released after the locks
+    pusher.swap(data->pusher);
+  }
+  if (data->done != nullptr){
+    *data->msgs->add_msg() = msg;
+    client_done_guard.reset(data->done);
+    data->done = nullptr;
+    data->msgs = nullptr;
+    data->cntl = nullptr;
+  }
+  else {
+    QueueMsgLocked(data, msg);
+  }
+  return butil::Status::OK();
+}
+
+void AccessServiceImpl::QueueMsgLocked(Data* data, const Msg& msg){
+  if (FLAGS_access_mailbox_capacity <= 0){
+    g_mailbox_dropped_count << 1;
+    return;
+  }
+  if (data->mailbox == nullptr){
+    data->mailbox = new Mailbox(FLAGS_access_mailbox_capacity);
+  }
+  if (g_mailbox_bytes.load(std::memory_order_relaxed) + Mailbox::MsgBytes(msg)
+      > FLAGS_access_mailbox_max_mb * (int64_t{1} << 20)){
+    data->mailbox->AddDropped();
+    g_mailbox_dropped_count << 1;
+    return;
+  }
+  const size_t size = data->mailbox->size();
+  g_mailbox_bytes.fetch_add(data->mailbox->Push(msg), std::memory_order_relaxed);
+  if (data->mailbox->size() == size){
+    // the oldest one was dropped
+    g_mailbox_dropped_count << 1;
+  }
+  else {
+    g_mailbox_msg_count << 1;
+  }
+}
+
+void AccessServiceImpl::DrainMailboxLocked(Data* data, Msgs* msgs){
+  const size_t size = data->mailbox->size();
+  g_mailbox_bytes.fetch_sub(data->mailbox->Drain(msgs), std::memory_order_relaxed);
+  g_mailbox_msg_count << -static_cast<int64_t>(size);
+  g_mailbox_drain_size << size;
+  // not kept empty, most users only get a push now and then
+  delete data->mailbox;
+  data->mailbox = nullptr;
+}
+
+void AccessServiceImpl::FreeMailbox(Mailbox* mailbox){
+  if (mailbox != nullptr){
+    g_mailbox_bytes.fetch_sub(mailbox->bytes(), std::memory_order_relaxed);
+    g_mailbox_msg_count << -static_cast<int64_t>(mailbox->size());
+    delete mailbox;
   }
 }
+
 void AccessServiceImpl::Clear(){
+  if (!stopped_.exchange(true)){
+    bthread_join(sweeper_, nullptr);
+  }
   ClearClosureAndReply();
 }
 
@@ -395,8 +726,14 @@ void AccessServiceImpl::GetMsgs(google::protobuf::RpcController* controller,
                                 const MsgIdRange* msg_range,
                                 Msgs* msgs,
                                 google::protobuf::Closure* done) {
+  GetMsgsAsync(static_cast<brpc::Controller*>(controller), msg_range, msgs, done);
+}
+
+RpcTask AccessServiceImpl::GetMsgsAsync(brpc::Controller* cntl,
+                                        const MsgIdRange* msg_range,
+                                        Msgs* msgs,
+                                        google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   LogicService_Stub logic_stub(logic_channel_);
   brpc::Controller logic_cntl;
@@ -404,7 +741,9 @@ void AccessServiceImpl::GetMsgs(google::protobuf::RpcController* controller,
   // XXX consistent hash use id
   logic_cntl.set_request_code(Hash(msg_range->user_id()));
 
-  logic_stub.GetMsgs(&logic_cntl, msg_range, msgs, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    logic_stub.GetMsgs(&logic_cntl, msg_range, msgs, resume);
+  });
   if (logic_cntl.Failed()) {
       DLOG(ERROR) << "Fail to call GetMsgs. " << logic_cntl.ErrorText();
       cntl->SetFailed(logic_cntl.ErrorCode(), logic_cntl.ErrorText().c_str());
@@ -415,8 +754,14 @@ void AccessServiceImpl::GetFriends(google::protobuf::RpcController* controller,
                                    const UserId* user_id,
                                    UserInfos* user_infos,
                                    google::protobuf::Closure* done) {
+  GetFriendsAsync(static_cast<brpc::Controller*>(controller), user_id, user_infos, done);
+}
+
+RpcTask AccessServiceImpl::GetFriendsAsync(brpc::Controller* cntl,
+                                           const UserId* user_id,
+                                           UserInfos* user_infos,
+                                           google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   LogicService_Stub logic_stub(logic_channel_);
   brpc::Controller logic_cntl;
@@ -424,7 +769,9 @@ void AccessServiceImpl::GetFriends(google::protobuf::RpcController* controller,
   // XXX consistent hash use id
   logic_cntl.set_request_code(Hash(user_id->user_id()));
 
-  logic_stub.GetFriends(&logic_cntl, user_id, user_infos, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    logic_stub.GetFriends(&logic_cntl, user_id, user_infos, resume);
+  });
   if (logic_cntl.Failed()) {
       DLOG(ERROR) << "Fail to call GetFriends. " << logic_cntl.ErrorText();
       cntl->SetFailed(logic_cntl.ErrorCode(), logic_cntl.ErrorText().c_str());
@@ -435,8 +782,14 @@ void AccessServiceImpl::GetGroups(google::protobuf::RpcController* controller,
                                   const UserId* user_id,
                                   GroupInfos* group_infos,
                                   google::protobuf::Closure* done) {
+  GetGroupsAsync(static_cast<brpc::Controller*>(controller), user_id, group_infos, done);
+}
+
+RpcTask AccessServiceImpl::GetGroupsAsync(brpc::Controller* cntl,
+                                          const UserId* user_id,
+                                          GroupInfos* group_infos,
+                                          google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   LogicService_Stub logic_stub(logic_channel_);
   brpc::Controller logic_cntl;
@@ -444,7 +797,9 @@ void AccessServiceImpl::GetGroups(google::protobuf::RpcController* controller,
   // XXX consistent hash use id
   logic_cntl.set_request_code(Hash(user_id->user_id()));
 
-  logic_stub.GetGroups(&logic_cntl, user_id, group_infos, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    logic_stub.GetGroups(&logic_cntl, user_id, group_infos, resume);
+  });
   if (logic_cntl.Failed()) {
       DLOG(ERROR) << "Fail to call GetGroups. " << logic_cntl.ErrorText();
       cntl->SetFailed(logic_cntl.ErrorCode(), logic_cntl.ErrorText().c_str());
@@ -455,8 +810,14 @@ void AccessServiceImpl::GetGroupMembers(google::protobuf::RpcController* control
                                         const GroupId* group_id,
                                         UserInfos* user_infos,
                                         google::protobuf::Closure* done) {
+  GetGroupMembersAsync(static_cast<brpc::Controller*>(controller), group_id, user_infos, done);
+}
+
+RpcTask AccessServiceImpl::GetGroupMembersAsync(brpc::Controller* cntl,
+                                                const GroupId* group_id,
+                                                UserInfos* user_infos,
+                                                google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   LogicService_Stub logic_stub(logic_channel_);
   brpc::Controller logic_cntl;
@@ -464,7 +825,9 @@ void AccessServiceImpl::GetGroupMembers(google::protobuf::RpcController* control
   // XXX consistent hash use id
   logic_cntl.set_request_code(Hash(group_id->group_id()));
 
-  logic_stub.GetGroupMembers(&logic_cntl, group_id, user_infos, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    logic_stub.GetGroupMembers(&logic_cntl, group_id, user_infos, resume);
+  });
   if (logic_cntl.Failed()) {
       DLOG(ERROR) << "Fail to call GetGroupMembers. " << logic_cntl.ErrorText();
       cntl->SetFailed(logic_cntl.ErrorCode(), logic_cntl.ErrorText().c_str());
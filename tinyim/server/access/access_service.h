@@ -3,14 +3,22 @@
 
 #include "access.pb.h"
 
-#include <mutex>
-#include <unordered_map>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
 
 // #include <brpc/server.h>
 // #include <butil/status.h>
-#include <bthread/unstable.h>
+#include <bthread/bthread.h>
 
+#include "access/conn_table.h"
+#include "access/mailbox.h"
+#include "access/stream_pusher.h"
 #include "type.h"
+#include "util/rpc_coro.h"
+#include "util/timing_wheel.h"
 
 namespace brpc {
 class Channel;
@@ -23,8 +31,6 @@ class Status;
 
 namespace tinyim {
 
-struct HeartBeatTimeoutArg;
-
 class AccessServiceImpl : public AccessService {
  public:
   AccessServiceImpl(brpc::Channel *logic_channel, brpc::Channel* db_channel);
@@ -55,6 +61,11 @@ class AccessServiceImpl : public AccessService {
                 Msgs* msgs,
                 google::protobuf::Closure* done) override;
 
+  void CreateStream(google::protobuf::RpcController* controller,
+                    const Ping* ping,
+                    Pong* pong,
+                    google::protobuf::Closure* done) override;
+
   void HeartBeat(google::protobuf::RpcController* controller,
                  const Ping* ping,
                  Pong* pong,
@@ -65,6 +76,11 @@ class AccessServiceImpl : public AccessService {
                     Pong* pong,
                     google::protobuf::Closure* done) override;
 
+  void SendtoAccessBatch(google::protobuf::RpcController* controller,
+                         const MsgBatch* batch,
+                         Pong* pong,
+                         google::protobuf::Closure* done) override;
+
   void GetMsgs(google::protobuf::RpcController* controller,
                const MsgIdRange* msg_range,
                Msgs* msgs,
@@ -85,9 +101,11 @@ class AccessServiceImpl : public AccessService {
                        UserInfos* user_infos,
                        google::protobuf::Closure* done) override;
 
+  // Only a timestamp store under the shared shard lock for a connected user.
   butil::Status ResetHeartBeatTimer(user_id_t user_id);
 
-  butil::Status ClearUserData(user_id_t user_id);
+  // Clear the user only if it has been idle since `idle_since_ms'.
+  butil::Status ClearUserData(user_id_t user_id, int64_t idle_since_ms = INT64_MAX);
 
   butil::Status PushClosureAndReply(user_id_t user_id,
                                     google::protobuf::Closure* done,
@@ -98,24 +116,84 @@ class AccessServiceImpl : public AccessService {
                                    google::protobuf::Closure** done,
                                    Msgs** msgs,
                                    brpc::Controller** cntl);
+
+  // Write `msg' to the stream of the user, or reply its parked PullData
+  // with it, or keep it in the user's mailbox until the next PullData.
+  butil::Status DeliverMsg(user_id_t user_id, const Msg& msg);
   void ClearClosureAndReply();
   void Clear();
  private:
+  // Handlers waiting on logic or dbproxy without holding a bthread
+  RpcTask SignInAsync(brpc::Controller* cntl,
+                      const SigninData* signin_data,
+                      Pong* reply,
+                      google::protobuf::Closure* done);
+  RpcTask SignOutAsync(brpc::Controller* cntl,
+                       const UserId* userid,
+                       Pong* reply,
+                       google::protobuf::Closure* done);
+  RpcTask SendMsgAsync(brpc::Controller* cntl,
+                       const NewMsg* new_msg,
+                       MsgReply* reply,
+                       google::protobuf::Closure* done);
+  RpcTask GetMsgsAsync(brpc::Controller* cntl,
+                       const MsgIdRange* msg_range,
+                       Msgs* msgs,
+                       google::protobuf::Closure* done);
+  RpcTask GetFriendsAsync(brpc::Controller* cntl,
+                          const UserId* user_id,
+                          UserInfos* user_infos,
+                          google::protobuf::Closure* done);
+  RpcTask GetGroupsAsync(brpc::Controller* cntl,
+                         const UserId* user_id,
+                         GroupInfos* group_infos,
+                         google::protobuf::Closure* done);
+  RpcTask GetGroupMembersAsync(brpc::Controller* cntl,
+                               const GroupId* group_id,
+                               UserInfos* user_infos,
+                               google::protobuf::Closure* done);
 
   struct Data{
     google::protobuf::Closure* done;
     Msgs* msgs;
     brpc::Controller* cntl;
 
-    bthread_timer_t heartbeat_timeout_id;
-    HeartBeatTimeoutArg* hbarg;
+    int64_t last_active_ms;  // stored atomically under the shared lock
+    int64_t expire_tick;  // tick its heartbeat timer is armed for
+    Mailbox* mailbox;  // pushes waiting for the next PullData, made on the first, freed when drained
+    std::shared_ptr<StreamPusher> pusher;  // preferred over PullData until closed
+    int32_t pull_lock;  // guards done, msgs, cntl, mailbox and pusher under the shared lock
   };
-  enum { kBucketNum = 16 };
-  std::mutex mutex_[kBucketNum];
-  std::unordered_map<user_id_t, Data> id_map_[kBucketNum];
+
+  // Must hold the pull_lock of `data' or its shard lock exclusive.
+  void QueueMsgLocked(Data* data, const Msg& msg);
+  void DrainMailboxLocked(Data* data, Msgs* msgs);
+  void FreeMailbox(Mailbox* mailbox);
+
+  // Make `pusher' the push channel of the user, the mailbox is moved to it.
+  void AttachStream(user_id_t user_id, const std::shared_ptr<StreamPusher>& pusher);
+
+  // Arm the heartbeat timer of a new user. Must hold the lock of `shard'
+  // exclusive.
+  void ArmLocked(size_t shard, user_id_t user_id, Data* data);
+
+  // Tell every logic in -logic_session_servers the user is on access
+  // `addr' now, signed out if empty, so they drop its cached session.
+  void NotifySessionChanged(user_id_t user_id, const std::string& addr);
+
+  // Expire users idle for -recv_heartbeat_timeout_s, once a tick
+  static void* SweepIdleUsers(void* arg);
+
+  ConnTable<Data> conn_table_;
+  // heartbeat timers of each shard, guarded by its mutex held exclusive
+  std::vector<std::unique_ptr<TimingWheel>> wheels_;
+  bthread_t sweeper_;
+  std::atomic<bool> stopped_{false};
 
   brpc::Channel *logic_channel_;
   brpc::Channel *db_channel_;
+  // each logic to notify of session changes, empty for logic_channel_
+  std::vector<std::unique_ptr<brpc::Channel>> session_channels_;
 };
 
 }  // namespace tinyim
@@ -0,0 +1,182 @@
+#ifndef TINYIM_ACCESS_CONN_TABLE_H_
+#define TINYIM_ACCESS_CONN_TABLE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <shared_mutex>
+#include <utility>
+#include <vector>
+
+namespace tinyim {
+
+// Connected users of an access, sharded by a hash of the user id. Each shard
+// is a linear probing table with the values inline and kept at most half
+// full, so a lookup usually touches one cache line and never chases a node
+// pointer. Callers lock the shard themselves: lookups and in-place updates of
+// existing users take it shared, inserts and erases take it exclusive.
+template <typename Value>
+class ConnTable {
+ public:
+  // Can not be stored
+  static constexpr int64_t kEmptyKey = std::numeric_limits<int64_t>::min();
+
+  class alignas(64) Shard {
+   public:
+    std::shared_mutex& mutex() {
+      return mutex_;
+    }
+
+    // nullptr if `key' is absent.
+    Value* Find(int64_t key){
+      if (slots_.empty()){
+        return nullptr;
+      }
+      for (size_t i = SlotOf(key); ; i = (i + 1) & mask_){
+        if (slots_[i].key == key){
+          return &slots_[i].value;
+        }
+        if (slots_[i].key == kEmptyKey){
+          return nullptr;
+        }
+      }
+    }
+
+    // Insert a value initialized Value if `key' is absent. The pointer stays
+    // valid until the next insert or erase of the shard.
+    Value* FindOrInsert(int64_t key, bool* inserted){
+      if ((size_ + 1) * 2 > slots_.size()){
+        Rehash(slots_.empty() ? kMinCapacity : slots_.size() * 2);
+      }
+      size_t i = SlotOf(key);
+      for (; slots_[i].key != kEmptyKey; i = (i + 1) & mask_){
+        if (slots_[i].key == key){
+          *inserted = false;
+          return &slots_[i].value;
+        }
+      }
+      slots_[i].key = key;
+      slots_[i].value = Value();
+      ++size_;
+      *inserted = true;
+      return &slots_[i].value;
+    }
+
+    bool Erase(int64_t key){
+      if (slots_.empty()){
+        return false;
+      }
+      size_t i = SlotOf(key);
+      for (; slots_[i].key != key; i = (i + 1) & mask_){
+        if (slots_[i].key == kEmptyKey){
+          return false;
+        }
+      }
+      // shift back the rest of the cluster instead of leaving a tombstone
+      for (size_t j = (i + 1) & mask_; slots_[j].key != kEmptyKey; j = (j + 1) & mask_){
+        const size_t home = SlotOf(slots_[j].key);
+        // move it into the hole unless its home lies in (i, j]
+        if (i <= j ? (home <= i || home > j) : (home <= i && home > j)){
+          slots_[i] = std::move(slots_[j]);
+          i = j;
+        }
+      }
+      slots_[i].key = kEmptyKey;
+      --size_;
+      return true;
+    }
+
+    // fn(key, Value*) for each user
+    template <typename Fn>
+    void ForEach(Fn fn){
+      for (auto& slot : slots_){
+        if (slot.key != kEmptyKey){
+          fn(slot.key, &slot.value);
+        }
+      }
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    size_t ResidentBytes() const {
+      return slots_.capacity() * sizeof(Slot);
+    }
+
+   private:
+    struct Slot {
+      int64_t key = kEmptyKey;
+      Value value;
+    };
+    enum { kMinCapacity = 16 };
+
+    size_t SlotOf(int64_t key) const {
+      return (Mix(key) >> 32) & mask_;
+    }
+
+    void Rehash(size_t capacity){
+      std::vector<Slot> old_slots(capacity);
+      old_slots.swap(slots_);
+      mask_ = capacity - 1;
+      for (auto& slot : old_slots){
+        if (slot.key != kEmptyKey){
+          size_t i = SlotOf(slot.key);
+          while (slots_[i].key != kEmptyKey){
+            i = (i + 1) & mask_;
+          }
+          slots_[i] = std::move(slot);
+        }
+      }
+    }
+
+    std::shared_mutex mutex_;
+    std::vector<Slot> slots_;
+    size_t mask_ = 0;
+    size_t size_ = 0;
+  };
+
+  // `shard_num' is rounded up to a power of 2.
+  explicit ConnTable(size_t shard_num){
+    shard_num_ = 1;
+    while (shard_num_ < shard_num){
+      shard_num_ *= 2;
+    }
+    shards_.reset(new Shard[shard_num_]);
+  }
+
+  ConnTable(const ConnTable&) = delete;
+  ConnTable& operator=(const ConnTable&) = delete;
+
+  size_t ShardIndex(int64_t key) const {
+    return Mix(key) & (shard_num_ - 1);
+  }
+
+  Shard& shard(size_t index){
+    return shards_[index];
+  }
+
+  size_t shard_num() const {
+    return shard_num_;
+  }
+
+ private:
+  // murmur3 finalizer, the low bits pick the shard and the high bits the slot
+  static uint64_t Mix(int64_t key){
+    uint64_t h = static_cast<uint64_t>(key);
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  size_t shard_num_;
+  std::unique_ptr<Shard[]> shards_;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_ACCESS_CONN_TABLE_H_
@@ -0,0 +1,216 @@
+#include "access/access.pb.h"
+
+#include <gflags/gflags.h>
+#include <brpc/channel.h>
+#include <brpc/closure_guard.h>
+#include <brpc/controller.h>
+#include <brpc/server.h>
+#include <bthread/bthread.h>
+#include <bthread/unstable.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "util/initialize.h"
+#include "util/rpc_coro.h"
+
+// A front service forwarding each request to a downstream that answers after
+// -downstream_latency_ms, with a blocking stub call (-mode=sync) or a
+// coroutine (-mode=coro), like access forwards to logic. Reports throughput
+// and the bthreads and CPU it takes to keep -client_num requests in flight.
+
+DEFINE_string(mode, "coro", "sync: block a bthread per request, coro: co_await the next hop");
+DEFINE_int32(front_port, 5200, "Port of the front service");
+DEFINE_int32(downstream_port, 5201, "Port of the downstream service");
+DEFINE_int32(downstream_latency_ms, 20, "Latency injected by the downstream");
+DEFINE_int32(client_num, 2000, "Requests kept in flight");
+DEFINE_int32(front_max_concurrency, 0, "Max concurrency of the front server, 0 for unlimited");
+DEFINE_int32(duration_s, 10, "Seconds to run");
+
+namespace {
+
+std::atomic<int64_t> g_done_num(0);
+std::atomic<int64_t> g_fail_num(0);
+std::atomic<int64_t> g_latency_us(0);
+std::atomic<bool> g_stop(false);
+
+int64_t CpuUs(){
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L
+         + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+int64_t BthreadCount(){
+  return strtoll(bvar::Variable::describe_exposed("bthread_count").c_str(), nullptr, 10);
+}
+
+void RunDone(void* arg){
+  static_cast<google::protobuf::Closure*>(arg)->Run();
+}
+
+// Answers from a timer so it holds no bthread while waiting
+class DownstreamService : public tinyim::AccessService {
+ public:
+  void Test(google::protobuf::RpcController* controller,
+            const tinyim::Ping* ping,
+            tinyim::Pong* pong,
+            google::protobuf::Closure* done) override {
+    pong->set_last_msg_id(ping->user_id());
+    bthread_timer_t timer;
+    bthread_timer_add(&timer, butil::milliseconds_from_now(FLAGS_downstream_latency_ms),
+                      RunDone, done);
+  }
+};
+
+class FrontService : public tinyim::AccessService {
+ public:
+  explicit FrontService(brpc::Channel* channel): channel_(channel) {}
+
+  void Test(google::protobuf::RpcController* controller,
+            const tinyim::Ping* ping,
+            tinyim::Pong* pong,
+            google::protobuf::Closure* done) override {
+    auto cntl = static_cast<brpc::Controller*>(controller);
+    if (FLAGS_mode == "sync"){
+      brpc::ClosureGuard done_guard(done);
+      tinyim::AccessService_Stub stub(channel_);
+      brpc::Controller next_cntl;
+      stub.Test(&next_cntl, ping, pong, nullptr);
+      if (next_cntl.Failed()){
+        cntl->SetFailed(next_cntl.ErrorCode(), next_cntl.ErrorText().c_str());
+      }
+    }
+    else {
+      TestAsync(cntl, ping, pong, done);
+    }
+  }
+
+ private:
+  tinyim::RpcTask TestAsync(brpc::Controller* cntl,
+                            const tinyim::Ping* ping,
+                            tinyim::Pong* pong,
+                            google::protobuf::Closure* done){
+    brpc::ClosureGuard done_guard(done);
+    tinyim::AccessService_Stub stub(channel_);
+    brpc::Controller next_cntl;
+    co_await tinyim::AsyncCall([&](google::protobuf::Closure* resume){
+      stub.Test(&next_cntl, ping, pong, resume);
+    });
+    if (next_cntl.Failed()){
+      cntl->SetFailed(next_cntl.ErrorCode(), next_cntl.ErrorText().c_str());
+    }
+  }
+
+  brpc::Channel* channel_;
+};
+
+void* Client(void* arg){
+  tinyim::AccessService_Stub stub(static_cast<brpc::Channel*>(arg));
+  tinyim::Ping ping;
+  tinyim::Pong pong;
+  while (!g_stop.load(std::memory_order_relaxed)){
+    brpc::Controller cntl;
+    const int64_t start_us = butil::gettimeofday_us();
+    stub.Test(&cntl, &ping, &pong, nullptr);
+    if (cntl.Failed()){
+      g_fail_num.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    g_latency_us.fetch_add(butil::gettimeofday_us() - start_us, std::memory_order_relaxed);
+    g_done_num.fetch_add(1, std::memory_order_relaxed);
+  }
+  return nullptr;
+}
+
+bool InitChannel(brpc::Channel* channel, int port){
+  brpc::ChannelOptions options;
+  options.protocol = brpc::PROTOCOL_BAIDU_STD;
+  options.timeout_ms = FLAGS_downstream_latency_ms * 10 + 1000;
+  options.max_retry = 0;
+  const std::string addr = "127.0.0.1:" + std::to_string(port);
+  return channel->Init(addr.c_str(), &options) == 0;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  DownstreamService downstream_service;
+  brpc::Server downstream_server;
+  downstream_server.AddService(&downstream_service, brpc::SERVER_DOESNT_OWN_SERVICE);
+  if (downstream_server.Start(FLAGS_downstream_port, nullptr) != 0){
+    LOG(ERROR) << "Fail to start downstream";
+    return -1;
+  }
+
+  brpc::Channel downstream_channel;
+  if (!InitChannel(&downstream_channel, FLAGS_downstream_port)){
+    LOG(ERROR) << "Fail to initialize channel";
+    return -1;
+  }
+  FrontService front_service(&downstream_channel);
+  brpc::Server front_server;
+  front_server.AddService(&front_service, brpc::SERVER_DOESNT_OWN_SERVICE);
+  brpc::ServerOptions front_options;
+  front_options.max_concurrency = FLAGS_front_max_concurrency;
+  if (front_server.Start(FLAGS_front_port, &front_options) != 0){
+    LOG(ERROR) << "Fail to start front";
+    return -1;
+  }
+
+  brpc::Channel front_channel;
+  if (!InitChannel(&front_channel, FLAGS_front_port)){
+    LOG(ERROR) << "Fail to initialize channel";
+    return -1;
+  }
+  const int64_t idle_bthread_num = BthreadCount();
+  std::vector<bthread_t> clients(FLAGS_client_num);
+  for (auto& tid : clients){
+    bthread_start_background(&tid, nullptr, Client, &front_channel);
+  }
+  // warm up
+  bthread_usleep(1000000L);
+
+  const int64_t start_done_num = g_done_num.load();
+  const int64_t start_latency_us = g_latency_us.load();
+  const int64_t start_cpu_us = CpuUs();
+  const int64_t start_us = butil::gettimeofday_us();
+  int64_t max_bthread_num = 0;
+  for (int i = 0; i < FLAGS_duration_s * 10; ++i){
+    bthread_usleep(100000L);
+    max_bthread_num = std::max(max_bthread_num, BthreadCount());
+  }
+  const int64_t done_num = g_done_num.load() - start_done_num;
+  const int64_t latency_us = g_latency_us.load() - start_latency_us;
+  const int64_t cpu_us = CpuUs() - start_cpu_us;
+  const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+
+  g_stop.store(true);
+  for (auto tid : clients){
+    bthread_join(tid, nullptr);
+  }
+
+  // the clients hold one bthread each in both modes
+  LOG(INFO) << FLAGS_mode << ": in_flight=" << FLAGS_client_num
+            << " qps=" << done_num * 1000000 / elapsed_us
+            << " avg_latency_us=" << (done_num == 0 ? 0 : latency_us / done_num)
+            << " failed=" << g_fail_num.load()
+            << " max_bthreads_beyond_clients=" << max_bthread_num - idle_bthread_num - FLAGS_client_num
+            << " cpu_ns_per_request=" << (done_num == 0 ? 0 : cpu_us * 1000 / done_num);
+
+  front_server.Stop(0);
+  front_server.Join();
+  downstream_server.Stop(0);
+  downstream_server.Join();
+  return 0;
+}
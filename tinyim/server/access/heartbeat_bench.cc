@@ -0,0 +1,273 @@
+#include <gflags/gflags.h>
+#include <bthread/unstable.h>
+#include <butil/fast_rand.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "util/initialize.h"
+#include "util/timing_wheel.h"
+
+// Heartbeat timers of -user_num simulated connections, one bthread timer per
+// user re-added on every refresh as access did before, against timestamps
+// refreshed in place and expired by the timing wheel. Run once per -mode,
+// CPU includes brpc's timer thread and memory is the resident set growth.
+
+DEFINE_string(mode, "wheel", "timer: bthread timer per user, wheel: timing wheel");
+DEFINE_int32(user_num, 1000000, "Simulated connections");
+DEFINE_int32(thread_num, 8, "Threads refreshing heartbeats");
+DEFINE_int64(refresh_num, 1000000, "Heartbeat refreshes of each thread");
+DEFINE_int32(timeout_s, 400, "Heartbeat timeout");
+DEFINE_int32(tick_ms, 1000, "Tick of the timing wheel");
+
+namespace {
+
+class Meter {
+ public:
+  Meter(): wall_us_(butil::gettimeofday_us()), cpu_us_(CpuUs()), rss_(RssBytes()) {}
+
+  void Report(const char* phase, int64_t op_num){
+    const int64_t wall_us = butil::gettimeofday_us() - wall_us_;
+    const int64_t cpu_us = CpuUs() - cpu_us_;
+    LOG(INFO) << FLAGS_mode << " " << phase << ": ops=" << op_num
+              << " wall_ms=" << wall_us / 1000
+              << " cpu_ms=" << cpu_us / 1000
+              << " cpu_ns_per_op=" << (op_num == 0 ? 0 : cpu_us * 1000 / op_num)
+              << " rss_growth_mb=" << (RssBytes() - rss_) / (1 << 20);
+  }
+
+ private:
+  static int64_t CpuUs(){
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L
+           + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+  }
+
+  static int64_t RssBytes(){
+    int64_t size = 0;
+    int64_t resident = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if (fp != nullptr){
+      if (fscanf(fp, "%ld %ld", &size, &resident) != 2){
+        resident = 0;
+      }
+      fclose(fp);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+  }
+
+  int64_t wall_us_;
+  int64_t cpu_us_;
+  int64_t rss_;
+};
+
+void NoopTimeout(void* arg){
+  delete static_cast<int64_t*>(arg);
+}
+
+// What access did before: an allocated argument and a bthread timer per user,
+// both replaced on every refresh.
+class TimerTable {
+ public:
+  void Refresh(int64_t user_id){
+    const int bucket = user_id % kBucketNum;
+    auto arg = new int64_t(user_id);
+    std::unique_ptr<int64_t> lazy_delete;
+    const timespec abstime = butil::microseconds_from_now(FLAGS_timeout_s * 1000000L);
+    std::unique_lock<std::mutex> lck(mutex_[bucket]);
+    auto iter = map_[bucket].find(user_id);
+    if (iter != map_[bucket].end()){
+      if (bthread_timer_del(iter->second.timer_id) == 0){
+        lazy_delete.reset(iter->second.arg);
+      }
+      bthread_timer_add(&iter->second.timer_id, abstime, NoopTimeout, arg);
+      iter->second.arg = arg;
+    }
+    else {
+      Data& data = map_[bucket][user_id];
+      bthread_timer_add(&data.timer_id, abstime, NoopTimeout, arg);
+      data.arg = arg;
+    }
+  }
+
+  void Clear(){
+    for (int bucket = 0; bucket < kBucketNum; ++bucket){
+      for (auto& user_and_data : map_[bucket]){
+        if (bthread_timer_del(user_and_data.second.timer_id) == 0){
+          delete user_and_data.second.arg;
+        }
+      }
+      map_[bucket].clear();
+    }
+  }
+
+ private:
+  struct Data {
+    bthread_timer_t timer_id;
+    int64_t* arg;
+  };
+  enum { kBucketNum = 16 };
+  std::mutex mutex_[kBucketNum];
+  std::unordered_map<int64_t, Data> map_[kBucketNum];
+};
+
+// What access does now, the clock is simulated so a whole timeout can be
+// swept at once.
+class WheelTable {
+ public:
+  WheelTable(){
+    for (auto& wheel : wheels_){
+      wheel.reset(new tinyim::TimingWheel(0));
+    }
+  }
+
+  void Refresh(int64_t user_id, int64_t now_ms){
+    const int bucket = user_id % kBucketNum;
+    std::unique_lock<std::mutex> lck(mutex_[bucket]);
+    auto iter = map_[bucket].find(user_id);
+    if (iter != map_[bucket].end()){
+      iter->second.last_active_ms = now_ms;
+    }
+    else {
+      Data& data = map_[bucket][user_id];
+      data.last_active_ms = now_ms;
+      Arm(bucket, user_id, &data);
+    }
+  }
+
+  // Return the number of expired users.
+  int64_t Sweep(int64_t now_ms){
+    int64_t expired_num = 0;
+    for (int bucket = 0; bucket < kBucketNum; ++bucket){
+      std::unique_lock<std::mutex> lck(mutex_[bucket]);
+      auto& map = map_[bucket];
+      wheels_[bucket]->Advance(now_ms / FLAGS_tick_ms, [&](int64_t user_id, int64_t tick){
+        auto iter = map.find(user_id);
+        if (iter == map.end() || iter->second.expire_tick != tick){
+          return;
+        }
+        if (iter->second.last_active_ms <= now_ms - FLAGS_timeout_s * 1000L){
+          map.erase(iter);
+          ++expired_num;
+        }
+        else {
+          Arm(bucket, user_id, &iter->second);
+        }
+      });
+    }
+    return expired_num;
+  }
+
+ private:
+  struct Data {
+    int64_t last_active_ms;
+    int64_t expire_tick;
+  };
+
+  void Arm(int bucket, int64_t user_id, Data* data){
+    data->expire_tick = (data->last_active_ms + FLAGS_timeout_s * 1000L + FLAGS_tick_ms - 1)
+                        / FLAGS_tick_ms;
+    wheels_[bucket]->Add(user_id, data->expire_tick);
+  }
+
+  enum { kBucketNum = 16 };
+  std::mutex mutex_[kBucketNum];
+  std::unordered_map<int64_t, Data> map_[kBucketNum];
+  std::unique_ptr<tinyim::TimingWheel> wheels_[kBucketNum];
+};
+
+template <typename Fn>
+void RunThreads(Fn fn){
+  std::vector<std::thread> threads;
+  for (int i = 0; i < FLAGS_thread_num; ++i){
+    threads.emplace_back(fn);
+  }
+  for (auto& thread : threads){
+    thread.join();
+  }
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+  const int64_t refresh_total = FLAGS_refresh_num * FLAGS_thread_num;
+
+  if (FLAGS_mode == "timer"){
+    TimerTable table;
+    {
+      Meter meter;
+      for (int64_t user_id = 1; user_id <= FLAGS_user_num; ++user_id){
+        table.Refresh(user_id);
+      }
+      meter.Report("connect", FLAGS_user_num);
+    }
+    {
+      Meter meter;
+      RunThreads([&table]{
+        for (int64_t i = 0; i < FLAGS_refresh_num; ++i){
+          table.Refresh(butil::fast_rand_less_than(FLAGS_user_num) + 1);
+        }
+      });
+      meter.Report("refresh", refresh_total);
+    }
+    table.Clear();
+  }
+  else if (FLAGS_mode == "wheel"){
+    WheelTable table;
+    int64_t now_ms = 0;
+    {
+      Meter meter;
+      for (int64_t user_id = 1; user_id <= FLAGS_user_num; ++user_id){
+        table.Refresh(user_id, now_ms);
+      }
+      meter.Report("connect", FLAGS_user_num);
+    }
+    {
+      // half a timeout later every user heartbeats at least once
+      now_ms += FLAGS_timeout_s * 500L;
+      Meter meter;
+      RunThreads([&table, now_ms]{
+        for (int64_t i = 0; i < FLAGS_refresh_num; ++i){
+          table.Refresh(butil::fast_rand_less_than(FLAGS_user_num) + 1, now_ms);
+        }
+      });
+      for (int64_t user_id = 1; user_id <= FLAGS_user_num; ++user_id){
+        table.Refresh(user_id, now_ms);
+      }
+      meter.Report("refresh", refresh_total + FLAGS_user_num);
+    }
+    {
+      // timers armed at connect fire and are re-armed for the refresh
+      now_ms = FLAGS_timeout_s * 1000L;
+      Meter meter;
+      const int64_t expired_num = table.Sweep(now_ms);
+      meter.Report("sweep_rearm", FLAGS_user_num);
+      CHECK_EQ(expired_num, 0);
+    }
+    {
+      // nobody heartbeats after the refresh
+      Meter meter;
+      now_ms = FLAGS_timeout_s * 1500L;
+      const int64_t expired_num = table.Sweep(now_ms);
+      meter.Report("sweep_expire", expired_num);
+      CHECK_EQ(expired_num, FLAGS_user_num);
+    }
+  }
+  else {
+    LOG(ERROR) << "Unknown mode=" << FLAGS_mode;
+    return -1;
+  }
+  return 0;
+}
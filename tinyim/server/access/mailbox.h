@@ -0,0 +1,85 @@
+#ifndef TINYIM_ACCESS_MAILBOX_H_
+#define TINYIM_ACCESS_MAILBOX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+
+#include "common/messages.pb.h"
+
+namespace tinyim {
+
+// Pushes to a user that arrived while no PullData was parked, kept in order
+// until the next PullData drains them all into its reply. Holds at most
+// `capacity' and grows as pushes come, when full the oldest one is dropped,
+// drops are counted so the client knows to fetch them with GetMsgs. Not
+// thread safe.
+class Mailbox {
+ public:
+  explicit Mailbox(size_t capacity): capacity_(capacity) {}
+
+  Mailbox(const Mailbox&) = delete;
+  Mailbox& operator=(const Mailbox&) = delete;
+
+  // Memory a queued `msg' is counted for, its serialized size and the object.
+  static int64_t MsgBytes(const Msg& msg){
+    return msg.ByteSizeLong() + sizeof(Msg);
+  }
+
+  // Return the change of bytes held, the oldest message is dropped if full.
+  int64_t Push(const Msg& msg){
+    int64_t delta = 0;
+    if (msgs_.size() >= capacity_){
+      delta -= MsgBytes(msgs_.front());
+      msgs_.pop_front();
+      ++dropped_num_;
+    }
+    msgs_.push_back(msg);
+    delta += MsgBytes(msgs_.back());
+    bytes_ += delta;
+    return delta;
+  }
+
+  // Count messages dropped without being queued.
+  void AddDropped(int64_t num = 1){
+    dropped_num_ += num;
+  }
+
+  // Move every message and the drop count into `msgs', return the bytes
+  // freed.
+  int64_t Drain(Msgs* msgs){
+    msgs->mutable_msg()->Reserve(msgs->msg_size() + msgs_.size());
+    for (Msg& msg : msgs_){
+      msgs->add_msg()->Swap(&msg);
+    }
+    msgs_.clear();
+    msgs->set_dropped_num(msgs->dropped_num() + dropped_num_);
+    dropped_num_ = 0;
+    const int64_t bytes = bytes_;
+    bytes_ = 0;
+    return bytes;
+  }
+
+  // True if Drain has something to report
+  bool pending() const {
+    return !msgs_.empty() || dropped_num_ > 0;
+  }
+
+  size_t size() const {
+    return msgs_.size();
+  }
+
+  int64_t bytes() const {
+    return bytes_;
+  }
+
+ private:
+  const size_t capacity_;
+  std::deque<Msg> msgs_;
+  int64_t bytes_ = 0;  // MsgBytes of the queued messages
+  int64_t dropped_num_ = 0;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_ACCESS_MAILBOX_H_
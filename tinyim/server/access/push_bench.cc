@@ -0,0 +1,200 @@
+#include "access/access_service.h"
+
+#include <gflags/gflags.h>
+#include <brpc/channel.h>
+#include <brpc/server.h>
+#include <brpc/stream.h>
+#include <bthread/bthread.h>
+#include <butil/fast_rand.h>
+#include <butil/iobuf.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+
+#include <sys/resource.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "util/initialize.h"
+
+// Pushes from -sender_num bthreads calling SendtoAccess to -user_num users
+// connected to an access in the same process, received over streams or by
+// long-polling PullData. CPU is of the whole process, so it covers both ends
+// of each delivery.
+
+DEFINE_string(mode, "stream", "stream: receive over streams, poll: long-poll PullData");
+DEFINE_int32(port, 5100, "Port of the access under test");
+DEFINE_int32(user_num, 1000, "Connected users");
+DEFINE_int32(sender_num, 16, "Bthreads pushing like logic");
+DEFINE_int32(msg_size, 100, "Bytes of each message");
+DEFINE_int32(duration_s, 10, "Seconds to push");
+DEFINE_string(connection_type, "single", "Connection type of the clients");
+
+namespace {
+
+std::atomic<int64_t> g_delivered_num(0);
+std::atomic<int64_t> g_batch_num(0);
+std::atomic<bool> g_stop(false);
+
+int64_t CpuUs(){
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L
+         + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+class CountHandler : public brpc::StreamInputHandler {
+ public:
+  int on_received_messages(brpc::StreamId id,
+                           butil::IOBuf *const messages[],
+                           size_t size) override {
+    for (size_t i = 0; i < size; ++i){
+      tinyim::Msgs msgs;
+      butil::IOBufAsZeroCopyInputStream wrapper(*messages[i]);
+      if (msgs.ParseFromZeroCopyStream(&wrapper)){
+        g_delivered_num.fetch_add(msgs.msg_size(), std::memory_order_relaxed);
+        g_batch_num.fetch_add(1, std::memory_order_relaxed);
+      }
+    }
+    return 0;
+  }
+
+  void on_idle_timeout(brpc::StreamId id) override {}
+  void on_closed(brpc::StreamId id) override {}
+};
+
+struct UserArgs {
+  brpc::Channel* channel;
+  tinyim::user_id_t user_id;
+};
+
+void* LongPoll(void* arg){
+  auto args = static_cast<UserArgs*>(arg);
+  tinyim::AccessService_Stub stub(args->channel);
+  while (!g_stop.load(std::memory_order_relaxed)){
+    brpc::Controller cntl;
+    cntl.set_timeout_ms(1000);
+    tinyim::Ping ping;
+    ping.set_user_id(args->user_id);
+    tinyim::Msgs msgs;
+    stub.PullData(&cntl, &ping, &msgs, nullptr);
+    if (!cntl.Failed()){
+      g_delivered_num.fetch_add(msgs.msg_size(), std::memory_order_relaxed);
+      g_batch_num.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  return nullptr;
+}
+
+void* Send(void* arg){
+  auto channel = static_cast<brpc::Channel*>(arg);
+  tinyim::AccessService_Stub stub(channel);
+  tinyim::Msg msg;
+  msg.set_message(std::string(FLAGS_msg_size, 'x'));
+  while (!g_stop.load(std::memory_order_relaxed)){
+    brpc::Controller cntl;
+    msg.set_user_id(butil::fast_rand_less_than(FLAGS_user_num) + 1);
+    msg.set_msg_id(msg.msg_id() + 1);
+    tinyim::Pong pong;
+    stub.SendtoAccess(&cntl, &msg, &pong, nullptr);
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  tinyim::AccessServiceImpl access_service_impl(nullptr, nullptr);
+  brpc::Server server;
+  if (server.AddService(&access_service_impl, brpc::SERVER_DOESNT_OWN_SERVICE) != 0){
+    LOG(ERROR) << "Fail to add service";
+    return -1;
+  }
+  if (server.Start(FLAGS_port, nullptr) != 0){
+    LOG(ERROR) << "Fail to start access";
+    return -1;
+  }
+
+  const std::string addr = "127.0.0.1:" + std::to_string(FLAGS_port);
+  brpc::ChannelOptions options;
+  options.protocol = brpc::PROTOCOL_BAIDU_STD;
+  options.connection_type = FLAGS_connection_type;
+  options.timeout_ms = 1000;
+  brpc::Channel channel;
+  if (channel.Init(addr.c_str(), &options) != 0){
+    LOG(ERROR) << "Fail to initialize channel";
+    return -1;
+  }
+
+  CountHandler handler;
+  std::vector<brpc::StreamId> streams;
+  std::vector<UserArgs> user_args(FLAGS_user_num);
+  std::vector<bthread_t> pollers;
+  for (int i = 0; i < FLAGS_user_num; ++i){
+    user_args[i] = UserArgs{&channel, i + 1};
+    if (FLAGS_mode == "stream"){
+      brpc::StreamOptions stream_options;
+      stream_options.handler = &handler;
+      brpc::Controller cntl;
+      brpc::StreamId stream;
+      if (brpc::StreamCreate(&stream, cntl, &stream_options) != 0){
+        LOG(ERROR) << "Fail to create stream";
+        return -1;
+      }
+      tinyim::Ping ping;
+      ping.set_user_id(i + 1);
+      tinyim::Pong pong;
+      tinyim::AccessService_Stub stub(&channel);
+      stub.CreateStream(&cntl, &ping, &pong, nullptr);
+      if (cntl.Failed()){
+        LOG(ERROR) << "Fail to call CreateStream. " << cntl.ErrorText();
+        return -1;
+      }
+      streams.push_back(stream);
+    }
+    else {
+      bthread_t tid;
+      bthread_start_background(&tid, nullptr, LongPoll, &user_args[i]);
+      pollers.push_back(tid);
+    }
+  }
+  // let every PullData get parked
+  bthread_usleep(500000L);
+
+  const int64_t start_us = butil::gettimeofday_us();
+  const int64_t start_cpu_us = CpuUs();
+  std::vector<bthread_t> senders(FLAGS_sender_num);
+  for (auto& tid : senders){
+    bthread_start_background(&tid, nullptr, Send, &channel);
+  }
+  bthread_usleep(FLAGS_duration_s * 1000000L);
+  const int64_t delivered_num = g_delivered_num.load();
+  const int64_t batch_num = g_batch_num.load();
+  const int64_t cpu_us = CpuUs() - start_cpu_us;
+  const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+
+  g_stop.store(true);
+  for (auto tid : senders){
+    bthread_join(tid, nullptr);
+  }
+  for (auto tid : pollers){
+    bthread_join(tid, nullptr);
+  }
+  for (auto stream : streams){
+    brpc::StreamClose(stream);
+  }
+
+  LOG(INFO) << FLAGS_mode << ": users=" << FLAGS_user_num
+            << " delivered=" << delivered_num
+            << " qps=" << delivered_num * 1000000 / elapsed_us
+            << " msgs_per_batch=" << (batch_num == 0 ? 0 : delivered_num / batch_num)
+            << " cpu_ns_per_msg=" << (delivered_num == 0 ? 0 : cpu_us * 1000 / delivered_num);
+
+  access_service_impl.Clear();
+  server.Stop(0);
+  server.Join();
+  return 0;
+}
@@ -0,0 +1,150 @@
+#include "access/stream_pusher.h"
+
+#include <errno.h>
+
+#include <brpc/controller.h>
+#include <bthread/bthread.h>
+#include <butil/iobuf.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_int32(access_stream_max_buf_kb, 2048, "Unconsumed bytes of a push stream before "
+             "writes wait for the client");
+DEFINE_int32(access_stream_write_timeout_ms, 5000, "Close a push stream whose client consumes "
+             "nothing for so long");
+DEFINE_int32(access_stream_idle_timeout_s, 0, "Close a push stream the client sends nothing on "
+             "for so long, 0 for -recv_heartbeat_timeout_s");
+DECLARE_int32(recv_heartbeat_timeout_s);
+
+namespace {
+
+bvar::Adder<int64_t> g_stream_count("access_stream_count");
+bvar::Adder<int64_t> g_stream_push_count("access_stream_push_count");
+bvar::Adder<int64_t> g_stream_dropped_count("access_stream_dropped_count");
+bvar::IntRecorder g_stream_batch_size("access_stream_batch_size");
+
+}  // namespace
+
+namespace tinyim {
+
+StreamPusher::StreamPusher(size_t batch_capacity, std::function<void()> on_heartbeat)
+  : batch_(batch_capacity), on_heartbeat_(std::move(on_heartbeat)) {}
+
+bool StreamPusher::Accept(brpc::Controller* cntl){
+  brpc::StreamOptions options;
+  options.handler = this;
+  options.max_buf_size = FLAGS_access_stream_max_buf_kb * 1024L;
+  options.idle_timeout_ms = (FLAGS_access_stream_idle_timeout_s > 0
+                             ? FLAGS_access_stream_idle_timeout_s
+                             : FLAGS_recv_heartbeat_timeout_s) * 1000;
+  if (brpc::StreamAccept(&stream_id_, *cntl, &options) != 0){
+    closed_.store(true, std::memory_order_release);
+    return false;
+  }
+  self_ = shared_from_this();
+  g_stream_count << 1;
+  return true;
+}
+
+void StreamPusher::Push(const Msg& msg){
+  if (closed()){
+    g_stream_dropped_count << 1;
+    return;
+  }
+  std::unique_lock<std::mutex> lck(mutex_);
+  const size_t size = batch_.size();
+  batch_.Push(msg);
+  if (batch_.size() == size){
+    g_stream_dropped_count << 1;
+  }
+  if (flushing_){
+    return;
+  }
+  flushing_ = true;
+  lck.unlock();
+
+  auto arg = new std::shared_ptr<StreamPusher>(shared_from_this());
+  bthread_t tid;
+  if (bthread_start_background(&tid, nullptr, Flush, arg) != 0){
+    LOG(ERROR) << "Fail to start bthread, flush in place";
+    Flush(arg);
+  }
+}
+
+void StreamPusher::AddDropped(int64_t num){
+  std::unique_lock<std::mutex> lck(mutex_);
+  batch_.AddDropped(num);
+}
+
+void StreamPusher::Close(){
+  if (!closed_.exchange(true)){
+    brpc::StreamClose(stream_id_);
+  }
+}
+
+void* StreamPusher::Flush(void* arg){
+  std::unique_ptr<std::shared_ptr<StreamPusher>> holder(static_cast<std::shared_ptr<StreamPusher>*>(arg));
+  StreamPusher* this_ = holder->get();
+  Msgs msgs;
+  butil::IOBuf buf;
+  while (true){
+    std::unique_lock<std::mutex> lck(this_->mutex_);
+    if (!this_->batch_.pending()){
+      this_->flushing_ = false;
+      return nullptr;
+    }
+    msgs.Clear();
+    this_->batch_.Drain(&msgs);
+    lck.unlock();
+
+    buf.clear();
+    {
+      butil::IOBufAsZeroCopyOutputStream wrapper(&buf);
+      msgs.SerializeToZeroCopyStream(&wrapper);
+    }
+    int rc = 0;
+    while ((rc = brpc::StreamWrite(this_->stream_id_, buf)) == EAGAIN){
+      // the client is behind, wait for it to consume
+      const timespec due_time = butil::milliseconds_from_now(FLAGS_access_stream_write_timeout_ms);
+      rc = brpc::StreamWait(this_->stream_id_, &due_time);
+      if (rc != 0){
+        break;
+      }
+    }
+    if (rc != 0){
+      LOG(WARNING) << "Fail to write stream=" << this_->stream_id_ << ", " << berror(rc);
+      g_stream_dropped_count << msgs.msg_size();
+      this_->Close();
+      lck.lock();
+      this_->flushing_ = false;
+      return nullptr;
+    }
+    g_stream_push_count << msgs.msg_size();
+    g_stream_batch_size << msgs.msg_size();
+  }
+}
+
+int StreamPusher::on_received_messages(brpc::StreamId id,
+                                       butil::IOBuf *const messages[],
+                                       size_t size){
+  on_heartbeat_();
+  return 0;
+}
+
+void StreamPusher::on_idle_timeout(brpc::StreamId id){
+  DLOG(INFO) << "Stream=" << id << " has no data from client for a while";
+  Close();
+}
+
+void StreamPusher::on_closed(brpc::StreamId id){
+  DLOG(INFO) << "Stream=" << id << " is closed";
+  closed_.store(true, std::memory_order_release);
+  g_stream_count << -1;
+  // the last callback of the stream, may free this on return
+  std::shared_ptr<StreamPusher> self;
+  self.swap(self_);
+}
+
+}  // namespace tinyim
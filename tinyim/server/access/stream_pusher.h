@@ -0,0 +1,67 @@
+#ifndef TINYIM_ACCESS_STREAM_PUSHER_H_
+#define TINYIM_ACCESS_STREAM_PUSHER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+#include <brpc/stream.h>
+
+#include "access/mailbox.h"
+#include "common/messages.pb.h"
+
+namespace tinyim {
+
+// Push channel of one user over a brpc stream accepted in CreateStream.
+// Messages pushed while a write is in flight or blocked by flow control are
+// batched and written as one Msgs, the oldest are dropped and counted when
+// the batch is full. Data from the client is taken as a heartbeat, the
+// stream is closed when idle. It handles its own stream so it keeps itself
+// alive until the stream is closed.
+class StreamPusher : public brpc::StreamInputHandler,
+                     public std::enable_shared_from_this<StreamPusher> {
+ public:
+  // `on_heartbeat' is called for data received from the client.
+  StreamPusher(size_t batch_capacity, std::function<void()> on_heartbeat);
+
+  // Accept the stream of the CreateStream request, false on failure.
+  bool Accept(brpc::Controller* cntl);
+
+  // Queue `msg' and start a flush unless one is running.
+  void Push(const Msg& msg);
+
+  // Report messages dropped before the stream took over.
+  void AddDropped(int64_t num);
+
+  void Close();
+
+  // Once closed, pushes are dropped and the user falls back to PullData
+  bool closed() const {
+    return closed_.load(std::memory_order_acquire);
+  }
+
+  int on_received_messages(brpc::StreamId id,
+                           butil::IOBuf *const messages[],
+                           size_t size) override;
+  void on_idle_timeout(brpc::StreamId id) override;
+  void on_closed(brpc::StreamId id) override;
+
+ private:
+  // Write batches until there is nothing left to write
+  static void* Flush(void* arg);
+
+  std::mutex mutex_;
+  Mailbox batch_;  // guarded by mutex_
+  bool flushing_ = false;  // guarded by mutex_
+
+  brpc::StreamId stream_id_ = brpc::INVALID_STREAM_ID;
+  std::atomic<bool> closed_{false};
+  std::function<void()> on_heartbeat_;
+  std::shared_ptr<StreamPusher> self_;  // released when the stream is closed
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_ACCESS_STREAM_PUSHER_H_
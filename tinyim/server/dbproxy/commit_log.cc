@@ -0,0 +1,295 @@
+#include "dbproxy/commit_log.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <mutex>
+#include <vector>
+
+#include <butil/crc32c.h>
+#include <butil/files/file_path.h>
+#include <butil/files/file_util.h>
+#include <bvar/bvar.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_int32(db_log_segment_mb, 64, "Start a new commit log segment beyond this size");
+
+namespace {
+
+bvar::Adder<int64_t> g_log_fsync_count("dbproxy_log_fsync_count");
+bvar::PerSecond<bvar::Adder<int64_t>> g_log_fsync_second("dbproxy_log_fsync_second", &g_log_fsync_count);
+bvar::IntRecorder g_log_sync_batch("dbproxy_log_sync_batch");
+
+const size_t kHeaderSize = 16;
+const char kCheckpointFile[] = "CHECKPOINT";
+const char kSegmentSuffix[] = ".log";
+
+uint32_t Crc(const char* seq_and_data, size_t size){
+  return butil::crc32c::Mask(butil::crc32c::Value(seq_and_data, size));
+}
+
+int WriteAll(int fd, const char* data, size_t size){
+  while (size > 0){
+    const ssize_t n = ::write(fd, data, size);
+    if (n < 0){
+      if (errno == EINTR){
+        continue;
+      }
+      return -1;
+    }
+    data += n;
+    size -= n;
+  }
+  return 0;
+}
+
+int SyncDir(const std::string& dir){
+  const int dir_fd = ::open(dir.c_str(), O_RDONLY);
+  if (dir_fd < 0){
+    return -1;
+  }
+  const int ret = ::fsync(dir_fd);
+  ::close(dir_fd);
+  return ret;
+}
+
+}  // namespace
+
+namespace tinyim {
+
+CommitLog::CommitLog(): fd_(-1),
+                        segment_size_(0),
+                        next_seq_(1),
+                        synced_seq_(0),
+                        syncing_(false),
+                        failed_(false),
+                        checkpoint_(0) {}
+
+CommitLog::~CommitLog() {
+  if (fd_ >= 0){
+    ::close(fd_);
+  }
+}
+
+int CommitLog::Open(const std::string& dir, const ReplayFn& replay){
+  dir_ = dir;
+  if (!butil::CreateDirectory(butil::FilePath(dir_))){
+    PLOG(ERROR) << "Fail to create " << dir_;
+    return -1;
+  }
+  std::string checkpoint;
+  if (butil::ReadFileToString(butil::FilePath(dir_ + "/" + kCheckpointFile), &checkpoint)){
+    checkpoint_ = strtoll(checkpoint.c_str(), nullptr, 10);
+  }
+
+  DIR* d = ::opendir(dir_.c_str());
+  if (d == nullptr){
+    PLOG(ERROR) << "Fail to open " << dir_;
+    return -1;
+  }
+  while (struct dirent* ent = ::readdir(d)){
+    const std::string name = ent->d_name;
+    const size_t suffix_len = sizeof(kSegmentSuffix) - 1;
+    if (name.size() > suffix_len
+        && name.compare(name.size() - suffix_len, suffix_len, kSegmentSuffix) == 0){
+      segments_[strtoll(name.c_str(), nullptr, 10)] = dir_ + "/" + name;
+    }
+  }
+  ::closedir(d);
+
+  next_seq_ = checkpoint_ + 1;
+  int64_t replayed_num = 0;
+  for (auto iter = segments_.begin(); iter != segments_.end(); ++iter){
+    const bool last = std::next(iter) == segments_.end();
+    std::string content;
+    if (!butil::ReadFileToString(butil::FilePath(iter->second), &content)){
+      PLOG(ERROR) << "Fail to read " << iter->second;
+      return -1;
+    }
+    size_t offset = 0;
+    while (offset < content.size()){
+      bool ok = content.size() - offset >= kHeaderSize;
+      uint32_t length = 0;
+      uint32_t crc = 0;
+      int64_t seq = 0;
+      if (ok){
+        memcpy(&length, content.data() + offset, 4);
+        memcpy(&crc, content.data() + offset + 4, 4);
+        memcpy(&seq, content.data() + offset + 8, 8);
+        ok = content.size() - offset - kHeaderSize >= length
+             && Crc(content.data() + offset + 8, 8 + length) == crc;
+      }
+      if (!ok){
+        // a crash in the middle of a write leaves it at the end of the
+        // last segment only
+        if (!last){
+          LOG(ERROR) << "Corrupted record in " << iter->second << " at offset=" << offset;
+          return -1;
+        }
+        LOG(WARNING) << "Cut torn tail of " << iter->second << " at offset=" << offset;
+        if (::truncate(iter->second.c_str(), offset) != 0){
+          PLOG(ERROR) << "Fail to truncate " << iter->second;
+          return -1;
+        }
+        break;
+      }
+      if (seq > checkpoint_){
+        replay(seq, content.substr(offset + kHeaderSize, length));
+        ++replayed_num;
+      }
+      next_seq_ = std::max(next_seq_, seq + 1);
+      offset += kHeaderSize + length;
+    }
+  }
+  synced_seq_ = next_seq_ - 1;
+  LOG(INFO) << "Opened commit log " << dir_ << " checkpoint=" << checkpoint_
+            << " replayed=" << replayed_num << " next_seq=" << next_seq_;
+
+  std::unique_lock<bthread::Mutex> lck(mutex_);
+  return OpenSegment(next_seq_);
+}
+
+int CommitLog::OpenSegment(int64_t first_seq){
+  char name[32];
+  snprintf(name, sizeof(name), "%020" PRId64 "%s", first_seq, kSegmentSuffix);
+  const std::string path = dir_ + "/" + name;
+  const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (fd < 0){
+    PLOG(ERROR) << "Fail to open " << path;
+    return -1;
+  }
+  if (SyncDir(dir_) != 0){
+    PLOG(ERROR) << "Fail to sync " << dir_;
+    ::close(fd);
+    return -1;
+  }
+  if (fd_ >= 0){
+    ::close(fd_);
+  }
+  fd_ = fd;
+  segment_size_ = ::lseek(fd, 0, SEEK_END);
+  segments_[first_seq] = path;
+  return 0;
+}
+
+int64_t CommitLog::Append(const std::string& data){
+  std::string record(kHeaderSize + data.size(), '\0');
+  const uint32_t length = data.size();
+  memcpy(&record[0], &length, 4);
+  memcpy(&record[kHeaderSize], data.data(), data.size());
+
+  std::unique_lock<bthread::Mutex> lck(mutex_);
+  if (failed_){
+    return -1;
+  }
+  if (segment_size_ >= FLAGS_db_log_segment_mb * 1024L * 1024L){
+    // the fd of a sync in progress is not closed under it
+    while (syncing_){
+      cond_.wait(lck);
+    }
+    if (::fdatasync(fd_) != 0 || OpenSegment(next_seq_) != 0){
+      PLOG(ERROR) << "Fail to roll commit log segment";
+      failed_ = true;
+      return -1;
+    }
+    g_log_fsync_count << 1;
+    synced_seq_ = next_seq_ - 1;
+  }
+  const int64_t seq = next_seq_;
+  memcpy(&record[8], &seq, 8);
+  const uint32_t crc = Crc(record.data() + 8, 8 + data.size());
+  memcpy(&record[4], &crc, 4);
+  if (WriteAll(fd_, record.data(), record.size()) != 0){
+    // the segment may end with part of it, cut on replay if last
+    PLOG(ERROR) << "Fail to append to commit log";
+    failed_ = true;
+    return -1;
+  }
+  segment_size_ += record.size();
+  ++next_seq_;
+  return seq;
+}
+
+bool CommitLog::Sync(int64_t seq){
+  std::unique_lock<bthread::Mutex> lck(mutex_);
+  while (synced_seq_ < seq && !failed_){
+    if (syncing_){
+      cond_.wait(lck);
+      continue;
+    }
+
+    // become leader, sync everything appended so far
+    syncing_ = true;
+    const int fd = fd_;
+    const int64_t target_seq = next_seq_ - 1;
+    const int64_t batch = target_seq - synced_seq_;
+    lck.unlock();
+
+    const int ret = ::fdatasync(fd);
+    g_log_fsync_count << 1;
+    g_log_sync_batch << batch;
+
+    lck.lock();
+    syncing_ = false;
+    if (ret != 0){
+      PLOG(ERROR) << "Fail to sync commit log";
+      failed_ = true;
+    }
+    else {
+      synced_seq_ = std::max(synced_seq_, target_seq);
+    }
+    cond_.notify_all();
+  }
+  return synced_seq_ >= seq;
+}
+
+int CommitLog::Checkpoint(int64_t seq){
+  // write a new file and rename it over, a crash leaves either one
+  const std::string path = dir_ + "/" + kCheckpointFile;
+  const std::string tmp_path = path + ".tmp";
+  const std::string content = std::to_string(seq);
+  const int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0){
+    PLOG(ERROR) << "Fail to open " << tmp_path;
+    return -1;
+  }
+  const bool written = WriteAll(fd, content.data(), content.size()) == 0 && ::fdatasync(fd) == 0;
+  ::close(fd);
+  if (!written || ::rename(tmp_path.c_str(), path.c_str()) != 0 || SyncDir(dir_) != 0){
+    PLOG(ERROR) << "Fail to write " << path;
+    return -1;
+  }
+
+  std::vector<std::string> removed;
+  {
+    std::unique_lock<bthread::Mutex> lck(mutex_);
+    checkpoint_ = std::max(checkpoint_, seq);
+    // a segment ends right before the first seq of the next one
+    while (segments_.size() > 1 && std::next(segments_.begin())->first <= checkpoint_ + 1){
+      removed.push_back(segments_.begin()->second);
+      segments_.erase(segments_.begin());
+    }
+  }
+  for (const std::string& segment : removed){
+    if (::unlink(segment.c_str()) != 0){
+      PLOG(WARNING) << "Fail to remove " << segment;
+    }
+  }
+  return 0;
+}
+
+int64_t CommitLog::checkpoint(){
+  std::unique_lock<bthread::Mutex> lck(mutex_);
+  return checkpoint_;
+}
+
+}  // namespace tinyim
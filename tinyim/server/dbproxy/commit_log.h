@@ -0,0 +1,66 @@
+#ifndef TINYIM_DBPROXY_COMMIT_LOG_H_
+#define TINYIM_DBPROXY_COMMIT_LOG_H_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+
+#include <bthread/condition_variable.h>
+#include <bthread/mutex.h>
+
+namespace tinyim {
+
+// Append-only records in segment files of a directory, each named by the
+// seq of its first record and rolled at -db_log_segment_mb. A record is
+//   | length u32 | crc32c u32 of seq and data | seq u64 | data |
+// Seqs go up by one from 1. Records up to the checkpoint have been applied
+// elsewhere and are not replayed, segments holding only them are removed.
+class CommitLog {
+ public:
+  using ReplayFn = std::function<void(int64_t seq, const std::string& data)>;
+
+  CommitLog();
+  ~CommitLog();
+
+  CommitLog(const CommitLog&) = delete;
+  CommitLog& operator=(const CommitLog&) = delete;
+
+  // Call `replay' with each record after the checkpoint in order, cut a
+  // torn tail of the last segment and start a new segment for appends.
+  int Open(const std::string& dir, const ReplayFn& replay);
+
+  // Write `data' and return its seq, -1 on error. It is not durable until
+  // Sync(seq) returns true.
+  int64_t Append(const std::string& data);
+
+  // Block until record `seq' is on disk. The first waiter finding no sync in
+  // progress fdatasyncs everything appended so far, the others wait for it.
+  bool Sync(int64_t seq);
+
+  // Records up to `seq' need no replay any more.
+  int Checkpoint(int64_t seq);
+
+  int64_t checkpoint();
+
+ private:
+  // Must hold mutex_
+  int OpenSegment(int64_t first_seq);
+
+  std::string dir_;
+
+  bthread::Mutex mutex_;
+  bthread::ConditionVariable cond_;  // a sync finished
+  int fd_;
+  int64_t segment_size_;
+  int64_t next_seq_;    // of the next record
+  int64_t synced_seq_;  // records up to it are on disk
+  bool syncing_;
+  bool failed_;  // sticky, a failed write or sync may have lost records
+  int64_t checkpoint_;
+  std::map<int64_t, std::string> segments_;  // first seq to path, the last is written
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_DBPROXY_COMMIT_LOG_H_
@@ -29,9 +29,50 @@ CREATE TABLE `group_members` (
   `user_name` varchar(255) COLLATE utf8mb4_unicode_ci NOT NULL,
 
   `join_at` timestamp NOT NULL,
-  PRIMARY KEY (`id`)
+  PRIMARY KEY (`id`),
+  KEY (`group_id`),
+  KEY (`user_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci;
+
+-- the last change of each group, taken under the row lock so that changes
+-- of a group commit in version order
+CREATE TABLE `group_member_versions` (
+  `group_id` bigint(20) NOT NULL,
+  `version` bigint(20) NOT NULL,
+
+  PRIMARY KEY (`group_id`)
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci;
 
+-- joins and leaves of each group, version is what logic caches members at
+CREATE TABLE `group_member_changes` (
+  `id` bigint(20) NOT NULL AUTO_INCREMENT,
+
+  `group_id` bigint(20) NOT NULL,
+  `version` bigint(20) NOT NULL,
+  `user_id` bigint(20) NOT NULL,
+  `joined` tinyint(4) NOT NULL, -- 1 join, 0 leave
+
+  PRIMARY KEY (`id`),
+  UNIQUE KEY (`group_id`, `version`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci;
+
+DELIMITER ;;
+CREATE TRIGGER group_member_join AFTER INSERT ON group_members FOR EACH ROW
+BEGIN
+  INSERT INTO group_member_versions(group_id, version) VALUES(NEW.group_id, 1)
+    ON DUPLICATE KEY UPDATE version = version + 1;
+  INSERT INTO group_member_changes(group_id, version, user_id, joined)
+    SELECT NEW.group_id, version, NEW.user_id, 1 FROM group_member_versions WHERE group_id = NEW.group_id;
+END;;
+CREATE TRIGGER group_member_leave AFTER DELETE ON group_members FOR EACH ROW
+BEGIN
+  INSERT INTO group_member_versions(group_id, version) VALUES(OLD.group_id, 1)
+    ON DUPLICATE KEY UPDATE version = version + 1;
+  INSERT INTO group_member_changes(group_id, version, user_id, joined)
+    SELECT OLD.group_id, version, OLD.user_id, 0 FROM group_member_versions WHERE group_id = OLD.group_id;
+END;;
+DELIMITER ;
+
 INSERT INTO group_members(group_id, group_name, user_id, user_name) VALUES(10000, "测试组1", 123, "123");
 INSERT INTO group_members(group_id, group_name, user_id, user_name) VALUES(10000, "测试组1", 1234, "1234");
 INSERT INTO group_members(group_id, group_name, user_id, user_name) VALUES(10000, "测试组1", 12345, "12345");
@@ -94,4 +135,57 @@ CREATE TABLE `messages` (
   UNIQUE key `userid_and_sender_and_time`(`user_id`, `sender`, `client_time`)
 ) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci;
 
+-- msg ids abandoned by idgen or logic, they hold no message
+CREATE TABLE `skipped_ranges` (
+  `id` bigint(20) NOT NULL AUTO_INCREMENT,
+
+  `user_id` bigint(20) NOT NULL,
+  `start_msg_id` bigint(20) NOT NULL,
+  `end_msg_id` bigint(20) NOT NULL, -- inclusive
+
+  PRIMARY KEY (`id`),
+  KEY (`user_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci;
+
+-- msgs of read diffusion groups, stored once for all members
+CREATE TABLE `group_seqs` (
+  `group_id` bigint(20) NOT NULL,
+  `seq` bigint(20) NOT NULL, -- seq of the last msg
+
+  PRIMARY KEY (`group_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci;
+
+CREATE TABLE `group_messages` (
+  `id` bigint(20) NOT NULL AUTO_INCREMENT,
+
+  `group_id` bigint(20) NOT NULL,
+  `seq` bigint(20) NOT NULL,
+  `sender` bigint(20) NOT NULL,
+
+  `message` text COLLATE utf8mb4_unicode_ci NOT NULL,
+  `deleted` tinyint(4) NOT NULL DEFAULT '0',
+
+  `client_time` timestamp NOT NULL,
+  `msg_time` timestamp NOT NULL,
+
+  PRIMARY KEY (`id`),
+  UNIQUE key `group_id_and_seq`(`group_id`, `seq`),
+  UNIQUE key `group_id_and_sender_and_time`(`group_id`, `sender`, `client_time`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci;
+
+-- the last seq each member has received of a read diffusion group
+CREATE TABLE `group_cursors` (
+  `user_id` bigint(20) NOT NULL,
+  `group_id` bigint(20) NOT NULL,
+  `read_seq` bigint(20) NOT NULL,
+
+  PRIMARY KEY (`user_id`, `group_id`)
+) ENGINE=InnoDB DEFAULT CHARSET=utf8mb4 COLLATE=utf8mb4_unicode_ci;
+
+-- group_seqs may be in another database, a member without a cursor gets one
+-- at the group seq on its next GetMsgs; one leaving drops it, so a rejoin
+-- does not read what was sent meanwhile
+CREATE TRIGGER group_member_leave_cursor AFTER DELETE ON group_members FOR EACH ROW
+  DELETE FROM group_cursors WHERE user_id = OLD.user_id AND group_id = OLD.group_id;
+
 INSERT INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) VALUES (123, 123, 1234, 1, 0, "first msg", FROM_UNIXTIME(1599455174), FROM_UNIXTIME(1599455174));
@@ -1,8 +1,16 @@
 #include "dbproxy/dbproxy_service.h"
 
 #include <cstdio>
+#include <map>
 #include <sstream>
+#include <unordered_map>
+#include <unordered_set>
 
+#include <utility>
+#include <vector>
+
+#include <butil/time.h>
+#include <bvar/bvar.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
@@ -16,9 +24,35 @@ DEFINE_string(redis_connection_type, "", "Connection type. Available values: sin
 DEFINE_string(redis_server, "127.0.0.1:6379", "IP Address of server");
 DEFINE_int32(redis_timeout_ms, 1000, "RPC timeout in milliseconds");
 DEFINE_int32(redis_max_retry, 3, "Max retries(not including the first RPC)");
+DEFINE_int32(db_group_delta_max_rows, 1000, "Answer GetGroupMemberDelta with all members when "
+             "more changes than this are behind");
+DEFINE_int32(db_group_timeline_max_msgs, 100, "Msgs of each read diffusion group returned by "
+             "GetMsgs at most");
+DEFINE_bool(db_commit_log, true, "Ack saved msgs once synced to the local commit log and "
+            "write them to MySQL in the background");
+DEFINE_string(db_log_dir, "./dbproxy_log", "Directory of the commit log");
+DEFINE_int32(db_drain_batch, 1000, "Log entries written to MySQL in one transaction at most");
+DEFINE_int32(db_drain_interval_ms, 10, "Drainer sleeps this long when the log is drained or "
+             "MySQL fails");
 
 // TODO db reconnect when timeout
 
+namespace {
+
+bvar::Adder<int64_t> g_empty_range_hit_count("dbproxy_empty_range_hit_count");
+bvar::Adder<int64_t> g_group_full_count("dbproxy_group_member_full_count");
+bvar::Adder<int64_t> g_group_delta_count("dbproxy_group_member_delta_count");
+// rows written by SaveGroupMsg, one per member or one for the whole group
+bvar::Adder<int64_t> g_group_inbox_rows_count("dbproxy_group_inbox_rows_count");
+bvar::Adder<int64_t> g_group_timeline_rows_count("dbproxy_group_timeline_rows_count");
+// from the save request to the log synced
+bvar::LatencyRecorder g_log_save("dbproxy_log_save");
+bvar::LatencyRecorder g_drain("dbproxy_drain");
+bvar::IntRecorder g_drain_batch_size("dbproxy_drain_batch_size");
+bvar::Adder<int64_t> g_drain_fail_count("dbproxy_drain_fail_count");
+
+}  // namespace
+
 namespace tinyim {
 
 constexpr int kConnectNumEachDb = 10;
@@ -41,9 +75,36 @@ DbproxyServiceImpl::DbproxyServiceImpl():db_message_connect_pool_(kConnectNumEac
     LOG(ERROR) << "Fail to initialize channel";
     exit(-1);
   }
+
+  drainer_stopped_.store(false, std::memory_order_relaxed);
+  if (FLAGS_db_commit_log){
+    // entries after the checkpoint may be missing from MySQL
+    const int ret = commit_log_.Open(FLAGS_db_log_dir, [this](int64_t seq, const std::string& data){
+      auto entry = std::make_shared<LogEntry>();
+      if (!entry->ParseFromString(data)){
+        LOG(ERROR) << "Fail to parse log entry seq=" << seq;
+        exit(-1);
+      }
+      log_tail_.Add(seq, std::move(entry));
+    });
+    if (ret != 0){
+      LOG(ERROR) << "Fail to open commit log " << FLAGS_db_log_dir;
+      exit(-1);
+    }
+    if (bthread_start_background(&drainer_, nullptr, RunDrainer, this) != 0){
+      LOG(ERROR) << "Fail to start drainer";
+      exit(-1);
+    }
+  }
 }
 
-DbproxyServiceImpl::~DbproxyServiceImpl() {}
+DbproxyServiceImpl::~DbproxyServiceImpl() {
+  if (FLAGS_db_commit_log){
+    // entries left are replayed on restart
+    drainer_stopped_.store(true, std::memory_order_release);
+    bthread_join(drainer_, nullptr);
+  }
+}
 
 void DbproxyServiceImpl::Test(google::protobuf::RpcController* controller,
                             const Ping* ping,
@@ -156,42 +217,25 @@ void DbproxyServiceImpl::SavePrivateMsg(google::protobuf::RpcController* control
                                         google::protobuf::Closure* done){
   brpc::ClosureGuard done_guard(done);
   brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
-  try {
-    auto pool = ChooseDatabase(new_msg->sender());
-    auto peer_pool = ChooseDatabase(new_msg->receiver());
-    if (pool == peer_pool){
-      soci::session sql(*pool);
-      sql << "INSERT INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) "
-             "VALUES (:user_id, :sender, :receiver, :msg_id, :group_id, :message, FROM_UNIXTIME(:client_time), FROM_UNIXTIME(:msg_time)), "
-             "(:receiver2, :sender2, :receiver2, :receiver_msg_id2, :group_id2, :message2, FROM_UNIXTIME(:client_time2), FROM_UNIXTIME(:msg_time2));",
-             soci::use(new_msg->sender()),
-             soci::use(new_msg->sender()),
-             soci::use(new_msg->receiver()),
-             soci::use(new_msg->sender_msg_id()),
-
-             soci::use(0),
-             soci::use(new_msg->message()),
-             soci::use(new_msg->client_time()),
-             soci::use(new_msg->msg_time()),
-
-
-             soci::use(new_msg->receiver()),
-             soci::use(new_msg->sender()),
-             soci::use(new_msg->receiver()),
-             soci::use(new_msg->receiver_msg_id()),
-
-             soci::use(0),
-             soci::use(new_msg->message()),
-             soci::use(new_msg->client_time()),
-             soci::use(new_msg->msg_time());
-
-      LOG(INFO) << "sql= " << sql.get_query();
+  if (FLAGS_db_commit_log){
+    auto entry = std::make_shared<LogEntry>();
+    *entry->mutable_private_msg() = *new_msg;
+    // saved below, the log only holds inbox rows
+    entry->mutable_private_msg()->clear_skipped_ranges();
+    if (!AppendLog_(std::move(entry))){
+      cntl->SetFailed(EIO, "Fail to append to commit log.");
+      return;
     }
-    else{
-      {
+  }
+  else {
+    try {
+      auto pool = ChooseDatabase(new_msg->sender());
+      auto peer_pool = ChooseDatabase(new_msg->receiver());
+      if (pool == peer_pool){
         soci::session sql(*pool);
         sql << "INSERT INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) "
-               "VALUES (:user_id, :sender, :receiver, :msg_id, :group_id, :message, FROM_UNIXTIME(:client_time), FROM_UNIXTIME(:msg_time));",
+               "VALUES (:user_id, :sender, :receiver, :msg_id, :group_id, :message, FROM_UNIXTIME(:client_time), FROM_UNIXTIME(:msg_time)), "
+               "(:receiver2, :sender2, :receiver2, :receiver_msg_id2, :group_id2, :message2, FROM_UNIXTIME(:client_time2), FROM_UNIXTIME(:msg_time2));",
                soci::use(new_msg->sender()),
                soci::use(new_msg->sender()),
                soci::use(new_msg->receiver()),
@@ -200,12 +244,9 @@ void DbproxyServiceImpl::SavePrivateMsg(google::protobuf::RpcController* control
                soci::use(0),
                soci::use(new_msg->message()),
                soci::use(new_msg->client_time()),
-               soci::use(new_msg->msg_time());
-      }
-      {
-        soci::session sql(*peer_pool);
-        sql << "INSERT INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) "
-               "VALUES (:user_id, :sender, :receiver, :receiver_msg_id, :group_id, :message, FROM_UNIXTIME(:client_send), FROM_UNIXTIME(:msg_time));",
+               soci::use(new_msg->msg_time()),
+
+
                soci::use(new_msg->receiver()),
                soci::use(new_msg->sender()),
                soci::use(new_msg->receiver()),
@@ -215,16 +256,52 @@ void DbproxyServiceImpl::SavePrivateMsg(google::protobuf::RpcController* control
                soci::use(new_msg->message()),
                soci::use(new_msg->client_time()),
                soci::use(new_msg->msg_time());
+
+        LOG(INFO) << "sql= " << sql.get_query();
+      }
+      else{
+        {
+          soci::session sql(*pool);
+          sql << "INSERT INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) "
+                 "VALUES (:user_id, :sender, :receiver, :msg_id, :group_id, :message, FROM_UNIXTIME(:client_time), FROM_UNIXTIME(:msg_time));",
+                 soci::use(new_msg->sender()),
+                 soci::use(new_msg->sender()),
+                 soci::use(new_msg->receiver()),
+                 soci::use(new_msg->sender_msg_id()),
+
+                 soci::use(0),
+                 soci::use(new_msg->message()),
+                 soci::use(new_msg->client_time()),
+                 soci::use(new_msg->msg_time());
+        }
+        {
+          soci::session sql(*peer_pool);
+          sql << "INSERT INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) "
+                 "VALUES (:user_id, :sender, :receiver, :receiver_msg_id, :group_id, :message, FROM_UNIXTIME(:client_send), FROM_UNIXTIME(:msg_time));",
+                 soci::use(new_msg->receiver()),
+                 soci::use(new_msg->sender()),
+                 soci::use(new_msg->receiver()),
+                 soci::use(new_msg->receiver_msg_id()),
+
+                 soci::use(0),
+                 soci::use(new_msg->message()),
+                 soci::use(new_msg->client_time()),
+                 soci::use(new_msg->msg_time());
+        }
       }
     }
+    catch (const soci::soci_error& err) {
+      LOG(ERROR) << "Fail to insert into messages"
+                  << " sender=" << new_msg->sender()
+                  << " receiver=" << new_msg->receiver()
+                  << " msg_id=" << new_msg->sender_msg_id()
+                  << ". " << err.what();
+      cntl->SetFailed(EINVAL, "Fail to insert into messages.");
+      return;
+    }
   }
-  catch (const soci::soci_error& err) {
-    LOG(ERROR) << "Fail to insert into messages"
-                << " sender=" << new_msg->sender()
-                << " receiver=" << new_msg->receiver()
-                << " msg_id=" << new_msg->sender_msg_id()
-                << ". " << err.what();
-    cntl->SetFailed(EINVAL, "Fail to insert into messages.");
+  SaveSkippedRanges_(new_msg->skipped_ranges());
+  if (new_msg->skip_last_send()){
     return;
   }
 
@@ -245,29 +322,100 @@ void DbproxyServiceImpl::SaveGroupMsg(google::protobuf::RpcController* controlle
   const user_id_t sender_user_id = new_group_msg->sender_user_id();
   const group_id_t group_id = new_group_msg->group_id();
   try {
-    for (int i = 0, size = new_group_msg->user_and_msgids_size(); i < size; ++i){
-      // TODO each db inserts all once
-      const auto& user_and_msgid = new_group_msg->user_and_msgids(i);
-      auto pool = ChooseDatabase(user_and_msgid.user_id());
-      soci::session sql(*pool);
-      sql << "INSERT INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) "
-              "VALUES (:user_id, :sender, :receiver, :msg_id, :group_id, :message, FROM_UNIXTIME(:client_send), FROM_UNIXTIME(:msg_time)) ",
-              soci::use(user_and_msgid.user_id()),
-              soci::use(sender_user_id),
-              soci::use(group_id),
-              soci::use(user_and_msgid.msg_id()),
-
-              soci::use(group_id),
-              soci::use(new_group_msg->message()),
-              soci::use(new_group_msg->client_time()),
-              soci::use(new_group_msg->msg_time());
+    if (new_group_msg->read_diffusion()){
+      // the row of group_seqs is locked till commit, senders of a group
+      // take their seqs in turn
+      long long seq = 0;
+      {
+        soci::session sql(*ChooseDatabase(group_id));
+        soci::transaction tr(sql);
+        sql << "INSERT INTO group_seqs(group_id, seq) VALUES (:group_id, LAST_INSERT_ID(1)) "
+               "ON DUPLICATE KEY UPDATE seq = LAST_INSERT_ID(seq + 1)",
+               soci::use(group_id);
+        sql << "SELECT LAST_INSERT_ID()", soci::into(seq);
+        // a retry whose earlier try got in keeps its seq, the new one is
+        // rolled back
+        long long saved_seq = 0;
+        soci::indicator ind;
+        sql << "SELECT seq FROM group_messages "
+               "WHERE group_id = :group_id AND sender = :sender AND client_time = FROM_UNIXTIME(:client_time)",
+               soci::into(saved_seq, ind),
+               soci::use(group_id),
+               soci::use(sender_user_id),
+               soci::use(new_group_msg->client_time());
+        if (sql.got_data() && ind == soci::i_ok){
+          seq = saved_seq;
+        }
+        else {
+          sql << "INSERT INTO group_messages(group_id, seq, sender, message, client_time, msg_time) "
+                 "VALUES (:group_id, :seq, :sender, :message, FROM_UNIXTIME(:client_time), FROM_UNIXTIME(:msg_time))",
+                 soci::use(group_id),
+                 soci::use(seq),
+                 soci::use(sender_user_id),
+                 soci::use(new_group_msg->message()),
+                 soci::use(new_group_msg->client_time()),
+                 soci::use(new_group_msg->msg_time());
+          tr.commit();
+          g_group_timeline_rows_count << 1;
+        }
+      }
+      // the copy of the sender in its own database, after the timeline so
+      // that a retry finishes it
+      for (const auto& user_and_msgid : new_group_msg->user_and_msgids()){
+        soci::session sql(*ChooseDatabase(user_and_msgid.user_id()));
+        sql << "INSERT IGNORE INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) "
+                "VALUES (:user_id, :sender, :receiver, :msg_id, :group_id, :message, FROM_UNIXTIME(:client_send), FROM_UNIXTIME(:msg_time)) ",
+                soci::use(user_and_msgid.user_id()),
+                soci::use(sender_user_id),
+                soci::use(group_id),
+                soci::use(user_and_msgid.msg_id()),
+
+                soci::use(group_id),
+                soci::use(new_group_msg->message()),
+                soci::use(new_group_msg->client_time()),
+                soci::use(new_group_msg->msg_time());
+      }
+      reply->set_group_seq(seq);
     }
+    else if (FLAGS_db_commit_log){
+      auto entry = std::make_shared<LogEntry>();
+      *entry->mutable_group_msg() = *new_group_msg;
+      entry->mutable_group_msg()->clear_skipped_ranges();
+      if (!AppendLog_(std::move(entry))){
+        cntl->SetFailed(EIO, "Fail to append to commit log.");
+        return;
+      }
+    }
+    else {
+      for (int i = 0, size = new_group_msg->user_and_msgids_size(); i < size; ++i){
+        // TODO each db inserts all once
+        const auto& user_and_msgid = new_group_msg->user_and_msgids(i);
+        auto pool = ChooseDatabase(user_and_msgid.user_id());
+        soci::session sql(*pool);
+        sql << "INSERT INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) "
+                "VALUES (:user_id, :sender, :receiver, :msg_id, :group_id, :message, FROM_UNIXTIME(:client_send), FROM_UNIXTIME(:msg_time)) ",
+                soci::use(user_and_msgid.user_id()),
+                soci::use(sender_user_id),
+                soci::use(group_id),
+                soci::use(user_and_msgid.msg_id()),
+
+                soci::use(group_id),
+                soci::use(new_group_msg->message()),
+                soci::use(new_group_msg->client_time()),
+                soci::use(new_group_msg->msg_time());
+      }
+    }
+    g_group_inbox_rows_count << new_group_msg->user_and_msgids_size();
   }
   catch (const std::exception& err) {
     LOG(ERROR) << "Fail to insert into messages. " << err.what();
     cntl->SetFailed(EINVAL, "Fail to insert into messages.");
     return;
   }
+  SaveSkippedRanges_(new_group_msg->skipped_ranges());
+  if (new_group_msg->skip_last_send()){
+    return;
+  }
 
   UserLastSendData user_last_send_data;
   user_last_send_data.set_user_id(sender_user_id);
@@ -393,6 +541,36 @@ void DbproxyServiceImpl::GetMsgs(google::protobuf::RpcController* controller,
   brpc::Controller* pcntl = static_cast<brpc::Controller*>(controller);
 
   const user_id_t user_id = msg_range->user_id();
+  if (msg_range->read_group_seqs_size() > 0 && !SaveGroupCursors_(user_id, msg_range->read_group_seqs())){
+    pcntl->SetFailed(EINVAL, "Fail to save group cursors.");
+    return;
+  }
+  // the inbox merged with the timelines of read diffusion groups, when
+  // asked for, gap probes need not
+  if (msg_range->read_timelines() && !GetGroupTimelines_(user_id, msgs)){
+    pcntl->SetFailed(EINVAL, "Fail to select from group_messages.");
+    return;
+  }
+
+  // known empty parts are flagged so that clients do not ask for them again,
+  // the whole range being empty needs no scan
+  bool covered = false;
+  if (!skipped_range_cache_.Find(user_id, msg_range->start_msg_id(), msg_range->end_msg_id(),
+                                 msgs->mutable_empty_ranges(), &covered)
+      && LoadSkippedRanges_(user_id)){
+    skipped_range_cache_.Find(user_id, msg_range->start_msg_id(), msg_range->end_msg_id(),
+                              msgs->mutable_empty_ranges(), &covered);
+  }
+  if (covered){
+    g_empty_range_hit_count << 1;
+    return;
+  }
+
+  // the tail is read first, an entry drained meanwhile is in MySQL then
+  Msgs tail_msgs;
+  log_tail_.Find(user_id, msg_range->start_msg_id(), msg_range->end_msg_id(), &tail_msgs);
+
+  const int first_inbox_msg = msgs->msg_size();
   auto pool = ChooseDatabase(user_id);
   soci::session sql(*pool);
   try {
@@ -430,12 +608,301 @@ void DbproxyServiceImpl::GetMsgs(google::protobuf::RpcController* controller,
   catch (const soci::soci_error& err) {
     LOG(ERROR) << err.what();
     pcntl->SetFailed(EINVAL, "Fail to select from messages.");
+    return;
+  }
+  if (tail_msgs.msg_size() > 0){
+    std::unordered_set<msg_id_t> drained;
+    for (int i = first_inbox_msg; i < msgs->msg_size(); ++i){
+      drained.insert(msgs->msg(i).msg_id());
+    }
+    for (Msg& msg : *tail_msgs.mutable_msg()){
+      if (drained.count(msg.msg_id()) == 0){
+        msgs->add_msg()->Swap(&msg);
+      }
+    }
   }
   DLOG_IF(INFO, msgs->msg_size() == 0) << "Select return nil. user_id=" << msg_range->user_id()
                                        << "start_msg_id=" << msg_range->start_msg_id()
                                        << "end_msg_id=" << msg_range->end_msg_id();
 }
 
+bool DbproxyServiceImpl::SaveGroupCursors_(user_id_t user_id,
+                                           const google::protobuf::RepeatedPtrField<GroupSeq>& seqs){
+  try {
+    soci::session sql(*ChooseDatabase(user_id));
+    for (const GroupSeq& seq : seqs){
+      // never back, acks of an older GetMsgs may come late
+      sql << "INSERT INTO group_cursors(user_id, group_id, read_seq) "
+             "VALUES (:user_id, :group_id, :read_seq) "
+             "ON DUPLICATE KEY UPDATE read_seq = GREATEST(read_seq, VALUES(read_seq))",
+             soci::use(user_id),
+             soci::use(seq.group_id()),
+             soci::use(seq.seq());
+    }
+  }
+  catch (const soci::soci_error& err) {
+    LOG(ERROR) << "Fail to insert into group_cursors user_id=" << user_id << ". " << err.what();
+    return false;
+  }
+  return true;
+}
+
+bool DbproxyServiceImpl::GetGroupTimelines_(user_id_t user_id, Msgs* msgs){
+  const int limit = FLAGS_db_group_timeline_max_msgs;
+  try {
+    // groups of the user with their cursors, -1 for a new member
+    std::vector<std::pair<group_id_t, long long>> cursors;
+    std::map<soci::connection_pool*, std::vector<group_id_t>> db_groups;
+    {
+      soci::session sql(*ChooseDatabase(user_id));
+      soci::rowset<soci::row> rs = (sql.prepare << "SELECT m.group_id, COALESCE(c.read_seq, -1) "
+                                                   "FROM group_members m "
+                                                   "LEFT JOIN group_cursors c ON c.user_id = m.user_id AND c.group_id = m.group_id "
+                                                   "WHERE m.user_id = :user_id",
+                                                  soci::use(user_id));
+      for (auto it = rs.begin(); it != rs.end(); ++it) {
+        const group_id_t group_id = it->get<long long>(0);
+        cursors.emplace_back(group_id, it->get<long long>(1));
+        db_groups[ChooseDatabase(group_id)].push_back(group_id);
+      }
+    }
+
+    // only groups with read diffusion msgs have a seq, from the database of
+    // each group
+    std::unordered_map<group_id_t, long long> seqs;
+    for (const auto& pool_and_groups : db_groups){
+      std::ostringstream oss;
+      oss << "SELECT group_id, seq FROM group_seqs WHERE group_id IN (";
+      for (size_t k = 0; k < pool_and_groups.second.size(); ++k){
+        oss << (k == 0 ? "" : ",") << pool_and_groups.second[k];
+      }
+      oss << ")";
+      soci::session sql(*pool_and_groups.first);
+      soci::rowset<soci::row> rs = (sql.prepare << oss.str());
+      for (auto it = rs.begin(); it != rs.end(); ++it) {
+        seqs[it->get<long long>(0)] = it->get<long long>(1);
+      }
+    }
+
+    for (const auto& cursor : cursors){
+      auto seq_iter = seqs.find(cursor.first);
+      if (cursor.second < 0){
+        // a new member starts from the seq of the group's database now, msgs
+        // before it are not read
+        soci::session sql(*ChooseDatabase(user_id));
+        const long long seq = seq_iter == seqs.end() ? 0 : seq_iter->second;
+        sql << "INSERT IGNORE INTO group_cursors(user_id, group_id, read_seq) "
+               "VALUES (:user_id, :group_id, :read_seq)",
+               soci::use(user_id),
+               soci::use(cursor.first),
+               soci::use(seq);
+        continue;
+      }
+      if (seq_iter == seqs.end() || seq_iter->second <= cursor.second){
+        continue;
+      }
+      soci::session sql(*ChooseDatabase(cursor.first));
+      soci::rowset<soci::row> msg_rs = (sql.prepare << "SELECT seq, sender, message, "
+                                                         "UNIX_TIMESTAMP(client_time), UNIX_TIMESTAMP(msg_time) "
+                                                       "FROM group_messages "
+                                                       "WHERE group_id = :group_id AND seq > :read_seq AND deleted = 0 "
+                                                       "ORDER BY seq LIMIT :limit",
+                                                      soci::use(cursor.first),
+                                                      soci::use(cursor.second),
+                                                      soci::use(limit));
+      for (auto it = msg_rs.begin(); it != msg_rs.end(); ++it) {
+        const soci::row& row = *it;
+        const user_id_t sender = row.get<long long>(1);
+        if (sender == user_id){
+          // the sender has it in the inbox
+          continue;
+        }
+        auto msg = msgs->add_msg();
+        msg->set_user_id(user_id);
+        msg->set_sender(sender);
+        msg->set_receiver(cursor.first);
+        msg->set_group_id(cursor.first);
+        msg->set_group_seq(row.get<long long>(0));
+        msg->set_message(row.get<std::string>(2));
+        msg->set_client_time(static_cast<int>(row.get<long long>(3)));
+        msg->set_msg_time(static_cast<int>(row.get<long long>(4)));
+      }
+    }
+  }
+  catch (const soci::soci_error& err) {
+    LOG(ERROR) << "Fail to select group timelines user_id=" << user_id << ". " << err.what();
+    return false;
+  }
+  return true;
+}
+
+bool DbproxyServiceImpl::AppendLog_(std::shared_ptr<const LogEntry> entry){
+  const int64_t start_us = butil::gettimeofday_us();
+  std::string data;
+  if (!entry->SerializeToString(&data)){
+    LOG(ERROR) << "Fail to serialize log entry";
+    return false;
+  }
+  const int64_t seq = commit_log_.Append(data);
+  if (seq < 0){
+    return false;
+  }
+  if (!commit_log_.Sync(seq)){
+    // the seq is never added, failed_ is sticky so nothing after it is
+    // either. The record may still be on disk and replayed on restart, a
+    // save answered EIO can show up later, at least once with its retry
+    return false;
+  }
+  // readable and drained only once durable, the drainer waits for seqs still
+  // syncing in seq order
+  log_tail_.Add(seq, std::move(entry));
+  g_log_save << butil::gettimeofday_us() - start_us;
+  return true;
+}
+
+bool DbproxyServiceImpl::ApplyLogEntries_(const std::vector<LogTail::Entry>& entries){
+  struct Rows {
+    std::vector<long long> user_ids;
+    std::vector<long long> senders;
+    std::vector<long long> receivers;
+    std::vector<long long> msg_ids;
+    std::vector<long long> group_ids;
+    std::vector<std::string> messages;
+    std::vector<int> client_times;
+    std::vector<int> msg_times;
+
+    void Add(user_id_t user_id, user_id_t sender, int64_t receiver, msg_id_t msg_id,
+             group_id_t group_id, const std::string& message, int client_time, int msg_time){
+      user_ids.push_back(user_id);
+      senders.push_back(sender);
+      receivers.push_back(receiver);
+      msg_ids.push_back(msg_id);
+      group_ids.push_back(group_id);
+      messages.push_back(message);
+      client_times.push_back(client_time);
+      msg_times.push_back(msg_time);
+    }
+  };
+  std::map<soci::connection_pool*, Rows> db_rows;
+  for (const auto& seq_and_entry : entries){
+    const LogEntry& entry = *seq_and_entry.second;
+    if (entry.has_private_msg()){
+      const NewPrivateMsg& msg = entry.private_msg();
+      db_rows[ChooseDatabase(msg.sender())].Add(msg.sender(), msg.sender(), msg.receiver(),
+                                                msg.sender_msg_id(), 0, msg.message(),
+                                                msg.client_time(), msg.msg_time());
+      db_rows[ChooseDatabase(msg.receiver())].Add(msg.receiver(), msg.sender(), msg.receiver(),
+                                                  msg.receiver_msg_id(), 0, msg.message(),
+                                                  msg.client_time(), msg.msg_time());
+    }
+    else if (entry.has_group_msg()){
+      const NewGroupMsg& msg = entry.group_msg();
+      for (const auto& user_and_msgid : msg.user_and_msgids()){
+        db_rows[ChooseDatabase(user_and_msgid.user_id())].Add(user_and_msgid.user_id(), msg.sender_user_id(),
+                                                              msg.group_id(), user_and_msgid.msg_id(),
+                                                              msg.group_id(), msg.message(),
+                                                              msg.client_time(), msg.msg_time());
+      }
+    }
+  }
+
+  try {
+    for (auto& pool_and_rows : db_rows){
+      Rows& rows = pool_and_rows.second;
+      soci::session sql(*pool_and_rows.first);
+      soci::transaction tr(sql);
+      // rows of a retry or a replay hit the unique key of (user_id, sender, client_time)
+      sql << "INSERT IGNORE INTO messages(user_id, sender, receiver, msg_id, group_id, message, client_time, msg_time) "
+             "VALUES (:user_id, :sender, :receiver, :msg_id, :group_id, :message, FROM_UNIXTIME(:client_time), FROM_UNIXTIME(:msg_time))",
+             soci::use(rows.user_ids),
+             soci::use(rows.senders),
+             soci::use(rows.receivers),
+             soci::use(rows.msg_ids),
+             soci::use(rows.group_ids),
+             soci::use(rows.messages),
+             soci::use(rows.client_times),
+             soci::use(rows.msg_times);
+      tr.commit();
+    }
+  }
+  catch (const soci::soci_error& err) {
+    LOG(ERROR) << "Fail to apply log entries " << entries.front().first
+               << "-" << entries.back().first << ". " << err.what();
+    return false;
+  }
+  return true;
+}
+
+void* DbproxyServiceImpl::RunDrainer(void* arg){
+  auto self = static_cast<DbproxyServiceImpl*>(arg);
+  int64_t applied_seq = self->commit_log_.checkpoint();
+  std::vector<LogTail::Entry> entries;
+  while (!self->drainer_stopped_.load(std::memory_order_acquire)){
+    entries.clear();
+    self->log_tail_.Peek(applied_seq + 1, FLAGS_db_drain_batch, &entries);
+    if (entries.empty()){
+      bthread_usleep(FLAGS_db_drain_interval_ms * 1000L);
+      continue;
+    }
+    const int64_t start_us = butil::gettimeofday_us();
+    if (!self->ApplyLogEntries_(entries)){
+      g_drain_fail_count << 1;
+      bthread_usleep(FLAGS_db_drain_interval_ms * 1000L);
+      continue;
+    }
+    g_drain << butil::gettimeofday_us() - start_us;
+    g_drain_batch_size << entries.size();
+
+    applied_seq = entries.back().first;
+    // without the checkpoint the entries are applied again after a restart,
+    // which is harmless
+    if (self->commit_log_.Checkpoint(applied_seq) != 0){
+      LOG(WARNING) << "Fail to checkpoint commit log at " << applied_seq;
+    }
+    self->log_tail_.Erase(applied_seq);
+  }
+  return nullptr;
+}
+
+void DbproxyServiceImpl::SaveSkippedRanges_(const google::protobuf::RepeatedPtrField<MsgIdRange>& ranges){
+  for (const auto& range : ranges){
+    try {
+      soci::session sql(*ChooseDatabase(range.user_id()));
+      sql << "INSERT INTO skipped_ranges(user_id, start_msg_id, end_msg_id) "
+             "VALUES (:user_id, :start_msg_id, :end_msg_id)",
+             soci::use(range.user_id()),
+             soci::use(range.start_msg_id()),
+             soci::use(range.end_msg_id());
+    }
+    catch (const soci::soci_error& err) {
+      LOG(ERROR) << "Fail to insert into skipped_ranges user_id=" << range.user_id()
+                 << " start_msg_id=" << range.start_msg_id()
+                 << " end_msg_id=" << range.end_msg_id() << ". " << err.what();
+      continue;
+    }
+    skipped_range_cache_.Add(range);
+  }
+}
+
+bool DbproxyServiceImpl::LoadSkippedRanges_(user_id_t user_id){
+  std::vector<std::pair<msg_id_t, msg_id_t>> ranges;
+  try {
+    soci::session sql(*ChooseDatabase(user_id));
+    soci::rowset<soci::row> rs = (sql.prepare << "SELECT start_msg_id, end_msg_id "
+                                                "FROM skipped_ranges WHERE user_id = :user_id",
+                                                soci::use(user_id));
+    for (auto it = rs.begin(); it != rs.end(); ++it) {
+      ranges.emplace_back(it->get<long long>(0), it->get<long long>(1));
+    }
+  }
+  catch (const soci::soci_error& err) {
+    LOG(ERROR) << "Fail to select from skipped_ranges user_id=" << user_id << ". " << err.what();
+    return false;
+  }
+  skipped_range_cache_.Load(user_id, ranges);
+  return true;
+}
+
 void DbproxyServiceImpl::GetFriends(google::protobuf::RpcController* controller,
                                    const UserId* userid,
                                    UserInfos* user_infos,
@@ -543,4 +1010,72 @@ void DbproxyServiceImpl::GetGroupMembers(google::protobuf::RpcController* contro
   DLOG_IF(INFO, user_infos->user_info_size() == 0) << "Select group_members return nil. group_id=" << group_id;
 }
 
+void DbproxyServiceImpl::GetGroupMemberDelta(google::protobuf::RpcController* controller,
+                                             const GroupMemberVersion* request,
+                                             GroupMemberDelta* delta,
+                                             google::protobuf::Closure* done) {
+  brpc::ClosureGuard done_guard(done);
+  brpc::Controller* pcntl = static_cast<brpc::Controller*>(controller);
+  const group_id_t group_id = request->group_id();
+  delta->set_group_id(group_id);
+
+  auto pool = ChooseDatabase(group_id);
+  soci::session sql(*pool);
+  try {
+    if (!request->full()){
+      // last change of each user, one more row than allowed tells too many
+      const int limit = FLAGS_db_group_delta_max_rows + 1;
+      int64_t version = request->version();
+      std::unordered_map<user_id_t, bool> joined;
+      int row_num = 0;
+      // a version is visible once the ones before it are, none is skipped
+      soci::rowset<soci::row> rs = (sql.prepare << "SELECT version, user_id, joined "
+                                                   "FROM group_member_changes "
+                                                   "WHERE group_id = :group_id AND version > :version "
+                                                   "ORDER BY version LIMIT :limit",
+                                                  soci::use(group_id),
+                                                  soci::use(version),
+                                                  soci::use(limit));
+      for (auto it = rs.begin(); it != rs.end(); ++it) {
+        version = it->get<long long>(0);
+        joined[it->get<long long>(1)] = it->get<int>(2) != 0;
+        ++row_num;
+      }
+      if (row_num < limit){
+        g_group_delta_count << 1;
+        delta->set_version(version);
+        for (const auto& user_and_joined : joined){
+          if (user_and_joined.second){
+            delta->add_added(user_and_joined.first);
+          }
+          else {
+            delta->add_removed(user_and_joined.first);
+          }
+        }
+        return;
+      }
+    }
+
+    // the version first, changes after it are replayed by the next delta
+    g_group_full_count << 1;
+    long long version = 0;
+    soci::indicator ind = soci::i_null;  // no row before the first change
+    sql << "SELECT version FROM group_member_versions WHERE group_id = :group_id",
+           soci::into(version, ind), soci::use(group_id);
+    delta->set_version(ind == soci::indicator::i_ok ? version : 0);
+    delta->set_full(true);
+    soci::rowset<soci::row> rs = (sql.prepare << "SELECT user_id "
+                                                 "FROM group_members "
+                                                 "WHERE group_id = :group_id",
+                                                soci::use(group_id));
+    for (auto it = rs.begin(); it != rs.end(); ++it) {
+      delta->add_added(it->get<long long>(0));
+    }
+  }
+  catch (const soci::soci_error& err) {
+    LOG(ERROR) << err.what();
+    pcntl->SetFailed(EINVAL, "Fail to select group members.");
+  }
+}
+
 }  // namespace tinyim
@@ -2,8 +2,16 @@
 #define TINYIM_DBPROXY_DBPROXY_SERVICE_H_
 
 #include "dbproxy.pb.h"
+#include "dbproxy/commit_log.h"
+#include "dbproxy/log_tail.h"
+#include "dbproxy/skipped_range_cache.h"
 #include "type.h"
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <bthread/bthread.h>
 #include <brpc/channel.h>
 #include <brpc/redis.h>
 #include <gflags/gflags.h>
@@ -82,10 +90,36 @@ class DbproxyServiceImpl : public DbproxyService {
                        const GroupId* group_id,
                        UserInfos* user_infos,
                        google::protobuf::Closure* done) override;
+
+  void GetGroupMemberDelta(google::protobuf::RpcController* controller,
+                           const GroupMemberVersion* request,
+                           GroupMemberDelta* delta,
+                           google::protobuf::Closure* done) override;
  private:
   void SetUserLastSendData_(brpc::Controller* cntl,
                             const UserLastSendData* user_last_send_data);
 
+  // Failures are only logged, the ranges are then scanned like other gaps.
+  void SaveSkippedRanges_(const google::protobuf::RepeatedPtrField<MsgIdRange>& ranges);
+
+  bool LoadSkippedRanges_(user_id_t user_id);
+
+  // Moves the cursors of `user_id' in read diffusion groups up to `seqs'.
+  bool SaveGroupCursors_(user_id_t user_id,
+                         const google::protobuf::RepeatedPtrField<GroupSeq>& seqs);
+
+  // Appends the msgs after the cursor of each read diffusion group of
+  // `user_id', at most -db_group_timeline_max_msgs of a group.
+  bool GetGroupTimelines_(user_id_t user_id, Msgs* msgs);
+
+  // Acked once synced to the commit log, the drainer writes it to MySQL.
+  bool AppendLog_(std::shared_ptr<const LogEntry> entry);
+
+  // Inserts the inbox rows of `entries' into MySQL, those already there
+  // are ignored since entries may be applied again after a restart.
+  bool ApplyLogEntries_(const std::vector<LogTail::Entry>& entries);
+
+  static void* RunDrainer(void* arg);
 
   soci::connection_pool* ChooseDatabase(user_id_t user_id){
     // TODO consistent hash
@@ -96,6 +130,13 @@ class DbproxyServiceImpl : public DbproxyService {
 
   soci::connection_pool db_group_members_connect_pool_;
   brpc::Channel redis_channel_;
+
+  SkippedRangeCache skipped_range_cache_;
+
+  CommitLog commit_log_;
+  LogTail log_tail_;  // entries after the checkpoint
+  bthread_t drainer_;
+  std::atomic<bool> drainer_stopped_;
 };
 
 }  // namespace tinyim
@@ -0,0 +1,104 @@
+#include "dbproxy/log_tail.h"
+
+#include <mutex>
+
+#include <bvar/bvar.h>
+
+namespace {
+
+bvar::Adder<int64_t> g_log_tail_count("dbproxy_log_tail_count");
+
+// Call `fn' with the user and msg_id of each inbox row of `entry'
+template <typename Fn>
+void ForEachRow(const tinyim::LogEntry& entry, Fn fn){
+  if (entry.has_private_msg()){
+    const tinyim::NewPrivateMsg& msg = entry.private_msg();
+    fn(msg.sender(), msg.sender_msg_id());
+    fn(msg.receiver(), msg.receiver_msg_id());
+  }
+  else if (entry.has_group_msg()){
+    for (const tinyim::UserAndMsgId& user_and_msgid : entry.group_msg().user_and_msgids()){
+      fn(user_and_msgid.user_id(), user_and_msgid.msg_id());
+    }
+  }
+}
+
+}  // namespace
+
+namespace tinyim {
+
+void LogTail::Add(int64_t seq, std::shared_ptr<const LogEntry> entry){
+  std::unique_lock<butil::Mutex> ul(mutex_);
+  const LogEntry* raw = entry.get();
+  ForEachRow(*raw, [this, raw](user_id_t user_id, msg_id_t msg_id){
+    inboxes_[user_id][msg_id] = raw;
+  });
+  entries_.emplace(seq, std::move(entry));
+  g_log_tail_count << 1;
+}
+
+void LogTail::Peek(int64_t seq, size_t max_num, std::vector<Entry>* entries){
+  std::unique_lock<butil::Mutex> ul(mutex_);
+  for (auto iter = entries_.find(seq);
+       iter != entries_.end() && iter->first == seq && entries->size() < max_num;
+       ++iter, ++seq){
+    entries->emplace_back(iter->first, iter->second);
+  }
+}
+
+void LogTail::Erase(int64_t seq){
+  std::unique_lock<butil::Mutex> ul(mutex_);
+  while (!entries_.empty() && entries_.begin()->first <= seq){
+    const LogEntry* raw = entries_.begin()->second.get();
+    ForEachRow(*raw, [this, raw](user_id_t user_id, msg_id_t msg_id){
+      auto iter = inboxes_.find(user_id);
+      if (iter == inboxes_.end()){
+        return;
+      }
+      // a retry may have put another entry under the msg_id
+      auto msg_iter = iter->second.find(msg_id);
+      if (msg_iter != iter->second.end() && msg_iter->second == raw){
+        iter->second.erase(msg_iter);
+      }
+      if (iter->second.empty()){
+        inboxes_.erase(iter);
+      }
+    });
+    entries_.erase(entries_.begin());
+    g_log_tail_count << -1;
+  }
+}
+
+void LogTail::Find(user_id_t user_id, msg_id_t start_id, msg_id_t end_id, Msgs* msgs){
+  std::unique_lock<butil::Mutex> ul(mutex_);
+  auto iter = inboxes_.find(user_id);
+  if (iter == inboxes_.end()){
+    return;
+  }
+  for (auto msg_iter = iter->second.lower_bound(start_id);
+       msg_iter != iter->second.end() && msg_iter->first <= end_id; ++msg_iter){
+    const LogEntry& entry = *msg_iter->second;
+    Msg* msg = msgs->add_msg();
+    msg->set_user_id(user_id);
+    msg->set_msg_id(msg_iter->first);
+    if (entry.has_private_msg()){
+      const NewPrivateMsg& private_msg = entry.private_msg();
+      msg->set_sender(private_msg.sender());
+      msg->set_receiver(private_msg.receiver());
+      msg->set_message(private_msg.message());
+      msg->set_client_time(private_msg.client_time());
+      msg->set_msg_time(private_msg.msg_time());
+    }
+    else {
+      const NewGroupMsg& group_msg = entry.group_msg();
+      msg->set_sender(group_msg.sender_user_id());
+      msg->set_receiver(group_msg.group_id());
+      msg->set_group_id(group_msg.group_id());
+      msg->set_message(group_msg.message());
+      msg->set_client_time(group_msg.client_time());
+      msg->set_msg_time(group_msg.msg_time());
+    }
+  }
+}
+
+}  // namespace tinyim
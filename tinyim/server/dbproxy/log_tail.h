@@ -0,0 +1,50 @@
+#ifndef TINYIM_DBPROXY_LOG_TAIL_H_
+#define TINYIM_DBPROXY_LOG_TAIL_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <butil/synchronization/lock.h>
+
+#include "dbproxy.pb.h"
+#include "type.h"
+
+namespace tinyim {
+
+// Saves in the commit log not yet applied to MySQL, by seq and by the
+// inboxes they go to, so that GetMsgs sees them before they are drained.
+class LogTail {
+ public:
+  using Entry = std::pair<int64_t, std::shared_ptr<const LogEntry>>;
+
+  LogTail() = default;
+
+  LogTail(const LogTail&) = delete;
+  LogTail& operator=(const LogTail&) = delete;
+
+  // Seqs may be added out of order by concurrent saves.
+  void Add(int64_t seq, std::shared_ptr<const LogEntry> entry);
+
+  // Entries from `seq' on without a gap, at most `max_num'. A seq missing
+  // is still being added, what follows it waits.
+  void Peek(int64_t seq, size_t max_num, std::vector<Entry>* entries);
+
+  // Entries up to `seq' are in MySQL.
+  void Erase(int64_t seq);
+
+  // Append the msgs of `user_id' with msg_id in [start_id, end_id].
+  void Find(user_id_t user_id, msg_id_t start_id, msg_id_t end_id, Msgs* msgs);
+
+ private:
+  butil::Mutex mutex_;
+  std::map<int64_t, std::shared_ptr<const LogEntry>> entries_;
+  std::unordered_map<user_id_t, std::map<msg_id_t, const LogEntry*>> inboxes_;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_DBPROXY_LOG_TAIL_H_
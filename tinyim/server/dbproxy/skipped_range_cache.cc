@@ -0,0 +1,62 @@
+#include "dbproxy/skipped_range_cache.h"
+
+#include <mutex>
+
+#include <gflags/gflags.h>
+
+DEFINE_int64(skipped_cache_max_users, 1000000, "Max users whose skipped msg id ranges are "
+             "cached, an arbitrary user is dropped when full");
+DEFINE_int32(skipped_cache_max_ranges, 1024, "Max skipped ranges cached of each user, the "
+             "lowest ones are dropped first");
+
+namespace tinyim {
+
+bool SkippedRangeCache::Find(user_id_t user_id, msg_id_t start_id, msg_id_t end_id,
+                             google::protobuf::RepeatedPtrField<MsgIdRange>* empty_ranges,
+                             bool* covered){
+  Shard& s = shard(user_id);
+  std::unique_lock<butil::Mutex> ul(s.mutex);
+  auto iter = s.users.find(user_id);
+  if (iter == s.users.end()){
+    return false;
+  }
+  *covered = iter->second.Covers(start_id, end_id);
+  iter->second.ForEachIn(start_id, end_id, [user_id, empty_ranges](msg_id_t start, msg_id_t end){
+    auto prange = empty_ranges->Add();
+    prange->set_user_id(user_id);
+    prange->set_start_msg_id(start);
+    prange->set_end_msg_id(end);
+  });
+  return true;
+}
+
+void SkippedRangeCache::Load(user_id_t user_id,
+                             const std::vector<std::pair<msg_id_t, msg_id_t>>& ranges){
+  RangeSet range_set;
+  for (const auto& range : ranges){
+    range_set.Add(range.first, range.second);
+  }
+  range_set.Truncate(FLAGS_skipped_cache_max_ranges);
+
+  Shard& s = shard(user_id);
+  std::unique_lock<butil::Mutex> ul(s.mutex);
+  if (!s.users.empty()
+      && static_cast<int64_t>(s.users.size()) * kShardNum >= FLAGS_skipped_cache_max_users){
+    s.users.erase(s.users.begin());
+  }
+  // a range saved during the load may be missed, its gap is scanned then
+  s.users[user_id] = std::move(range_set);
+}
+
+void SkippedRangeCache::Add(const MsgIdRange& range){
+  Shard& s = shard(range.user_id());
+  std::unique_lock<butil::Mutex> ul(s.mutex);
+  auto iter = s.users.find(range.user_id());
+  if (iter == s.users.end()){
+    return;
+  }
+  iter->second.Add(range.start_msg_id(), range.end_msg_id());
+  iter->second.Truncate(FLAGS_skipped_cache_max_ranges);
+}
+
+}  // namespace tinyim
@@ -0,0 +1,57 @@
+#ifndef TINYIM_DBPROXY_SKIPPED_RANGE_CACHE_H_
+#define TINYIM_DBPROXY_SKIPPED_RANGE_CACHE_H_
+
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <butil/synchronization/lock.h>
+
+#include "common/messages.pb.h"
+#include "type.h"
+#include "util/range_set.h"
+
+namespace tinyim {
+
+// Msg id ranges abandoned by idgen or logic of each user, they hold no
+// message. The durable copy is the skipped_ranges table, users are loaded
+// from it on first query and kept in memory, so gap queries are answered
+// without scanning messages.
+class SkippedRangeCache {
+ public:
+  SkippedRangeCache() = default;
+
+  SkippedRangeCache(const SkippedRangeCache&) = delete;
+  SkippedRangeCache& operator=(const SkippedRangeCache&) = delete;
+
+  // Append the skipped parts of [start_id, end_id] of `user_id' to
+  // `empty_ranges' and set `covered' if they are the whole range.
+  // False if the user is not loaded.
+  bool Find(user_id_t user_id, msg_id_t start_id, msg_id_t end_id,
+            google::protobuf::RepeatedPtrField<MsgIdRange>* empty_ranges, bool* covered);
+
+  // Cache `ranges' read from db, [start, end] each.
+  void Load(user_id_t user_id, const std::vector<std::pair<msg_id_t, msg_id_t>>& ranges);
+
+  // Record a range saved to db, ignored if the user is not loaded since
+  // loading it reads the range from db.
+  void Add(const MsgIdRange& range);
+
+ private:
+  struct Shard {
+    butil::Mutex mutex;
+    std::unordered_map<user_id_t, RangeSet> users;
+  };
+
+  Shard& shard(user_id_t user_id) {
+    return shards_[static_cast<uint64_t>(user_id) % kShardNum];
+  }
+
+  enum { kShardNum = 64 };
+  Shard shards_[kShardNum];
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_DBPROXY_SKIPPED_RANGE_CACHE_H_
@@ -0,0 +1,89 @@
+#include "idgen/group_commit_writer.h"
+
+#include <memory>
+
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include <glog/logging.h>
+
+namespace {
+
+bvar::Adder<int64_t> g_fsync_count("idgen_fsync_count");
+bvar::PerSecond<bvar::Adder<int64_t>> g_fsync_second("idgen_fsync_second", &g_fsync_count);
+bvar::IntRecorder g_batch_size("idgen_group_commit_batch_size");
+
+struct WaitArgs {
+  tinyim::GroupCommitWriter* writer;
+  int64_t seq;
+};
+
+void* RunWait(void* arg){
+  std::unique_ptr<WaitArgs> args(static_cast<WaitArgs*>(arg));
+  args->writer->Wait(args->seq);
+  return nullptr;
+}
+
+}  // namespace
+
+namespace tinyim {
+
+GroupCommitWriter::GroupCommitWriter(HwmStore* store): store_(store),
+                                                       pending_seq_(1),
+                                                       committed_seq_(0),
+                                                       writing_(false) {}
+
+GroupCommitWriter::~GroupCommitWriter() {}
+
+int64_t GroupCommitWriter::Append(int64_t user_id, int64_t max_id){
+  std::unique_lock<bthread::Mutex> lck(mutex_);
+  pending_.push_back(HwmUpdate{user_id, max_id});
+  return pending_seq_;
+}
+
+leveldb::Status GroupCommitWriter::Wait(int64_t seq){
+  std::unique_lock<bthread::Mutex> lck(mutex_);
+  while (committed_seq_.load(std::memory_order_relaxed) < seq && status_.ok()){
+    if (writing_){
+      cond_.wait(lck);
+      continue;
+    }
+
+    // become leader, take everything queued so far
+    writing_ = true;
+    std::vector<HwmUpdate> batch;
+    batch.swap(pending_);
+    const int64_t batch_count = batch.size();
+    const int64_t batch_seq = pending_seq_++;
+    lck.unlock();
+
+    auto status = store_->Write(batch);
+    g_fsync_count << 1;
+    g_batch_size << batch_count;
+    DLOG(INFO) << "Group commit seq=" << batch_seq << " count=" << batch_count;
+
+    lck.lock();
+    writing_ = false;
+    if (status.ok()){
+      committed_seq_.store(batch_seq, std::memory_order_release);
+    }
+    else {
+      LOG(ERROR) << "Fail to commit batch seq=" << batch_seq
+                 << " count=" << batch_count << ". " << status.ToString();
+      status_ = status;
+    }
+    cond_.notify_all();
+  }
+  return status_;
+}
+
+void GroupCommitWriter::WaitAsync(int64_t seq){
+  auto args = new WaitArgs{this, seq};
+  bthread_t bt;
+  if (bthread_start_background(&bt, nullptr, RunWait, args) != 0){
+    // the next request needing batch `seq' syncs it
+    LOG(ERROR) << "Fail to start bthread to commit seq=" << seq;
+    delete args;
+  }
+}
+
+}  // namespace tinyim
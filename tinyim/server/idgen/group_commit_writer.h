@@ -0,0 +1,57 @@
+#ifndef TINYIM_IDGEN_GROUP_COMMIT_WRITER_H_
+#define TINYIM_IDGEN_GROUP_COMMIT_WRITER_H_
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <bthread/condition_variable.h>
+#include <bthread/mutex.h>
+#include <leveldb/status.h>
+
+#include "idgen/hwm_store.h"
+
+namespace tinyim {
+
+// Collects high-water mark updates of concurrent requests into one
+// HwmStore::Write, so that many users share a single fsync.
+class GroupCommitWriter {
+ public:
+  explicit GroupCommitWriter(HwmStore* store);
+  ~GroupCommitWriter();
+
+  GroupCommitWriter(const GroupCommitWriter&) = delete;
+  GroupCommitWriter& operator=(const GroupCommitWriter&) = delete;
+
+  // Queue `max_id' of `user_id' into the pending batch and return the sequence
+  // of that batch. The update is not durable until Wait(seq) returns ok.
+  int64_t Append(int64_t user_id, int64_t max_id);
+
+  // Block until batch `seq' is synced. The first waiter that finds no write in
+  // progress becomes the leader and syncs everything queued so far, the others
+  // are woken up when it finishes.
+  leveldb::Status Wait(int64_t seq);
+
+  // Sync batch `seq' in a background bthread, used to persist a segment
+  // before it is needed.
+  void WaitAsync(int64_t seq);
+
+  int64_t committed_seq() const {
+    return committed_seq_.load(std::memory_order_acquire);
+  }
+
+ private:
+  HwmStore* store_;
+
+  bthread::Mutex mutex_;
+  bthread::ConditionVariable cond_;
+  std::vector<HwmUpdate> pending_;
+  int64_t pending_seq_;    // sequence of pending_
+  std::atomic<int64_t> committed_seq_;  // all batches <= committed_seq_ are synced
+  bool writing_;
+  leveldb::Status status_;  // sticky, a failed sync may have lost earlier writes too
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_IDGEN_GROUP_COMMIT_WRITER_H_
@@ -0,0 +1,59 @@
+#ifndef TINYIM_IDGEN_HWM_STORE_H_
+#define TINYIM_IDGEN_HWM_STORE_H_
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <leveldb/status.h>
+
+namespace tinyim {
+
+struct HwmUpdate {
+  int64_t user_id;
+  int64_t max_id;
+};
+
+// Durable storage of the high-water mark of each user, ids up to it may have
+// been handed out so a user restarts from there.
+class HwmStore {
+ public:
+  HwmStore() = default;
+
+  HwmStore(const HwmStore&) = delete;
+  HwmStore& operator=(const HwmStore&) = delete;
+
+  // `max_id' is 0 if `user_id' has no high-water mark yet.
+  virtual leveldb::Status Get(int64_t user_id, int64_t* max_id) = 0;
+
+  // Apply `updates' in order, a later update of the same user wins. They are
+  // durable when it returns ok.
+  virtual leveldb::Status Write(const std::vector<HwmUpdate>& updates) = 0;
+
+  // Call `fn' with every stored high-water mark of users, used to export a
+  // partition. Fences are left out.
+  virtual leveldb::Status ForEach(const std::function<void(int64_t user_id, int64_t max_id)>& fn) = 0;
+
+  // Export and import of a partition store its fence next to the marks, under
+  // a key no user has, so a restart with stale -idgen_partition_moves does not
+  // serve it again on the old node.
+  enum Fence : int64_t { kFenceNone = 0, kFenceExported = 1, kFenceImported = 2 };
+  static int64_t FenceKey(int partition){
+    return -1 - int64_t{partition};
+  }
+
+  // Decimal strings in a LevelDB database
+  static leveldb::Status OpenLevelDb(const std::string& path, std::unique_ptr<HwmStore>* store);
+
+  // Fixed 16-byte records in a memory-mapped file, addressed by an open
+  // addressing hash directory
+  static leveldb::Status OpenMmap(const std::string& path, std::unique_ptr<HwmStore>* store);
+
+  virtual ~HwmStore() {}
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_IDGEN_HWM_STORE_H_
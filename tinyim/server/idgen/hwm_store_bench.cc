@@ -0,0 +1,98 @@
+#include <gflags/gflags.h>
+#include <butil/fast_rand.h>
+#include <butil/files/file_path.h>
+#include <butil/files/file_util.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "idgen/hwm_store.h"
+#include "util/initialize.h"
+
+// Compare the leveldb and mmap high-water mark stores: synced batch writes
+// as done by GroupCommitWriter on refill, and reopening plus loading every
+// user as done after an idgen restart.
+
+DEFINE_string(bench_dir, "./hwm_bench", "Directory of the stores, wiped before each run");
+DEFINE_int32(user_num, 1000000, "Users written before measuring");
+DEFINE_int32(batch_size, 100, "High-water mark updates of each synced batch");
+DEFINE_int32(batch_num, 2000, "Synced batches of random users to measure");
+
+namespace {
+
+typedef leveldb::Status (*OpenFn)(const std::string&, std::unique_ptr<tinyim::HwmStore>*);
+
+std::unique_ptr<tinyim::HwmStore> OpenOrDie(OpenFn open, const std::string& path){
+  std::unique_ptr<tinyim::HwmStore> store;
+  auto status = open(path, &store);
+  CHECK(status.ok()) << "Fail to open " << path << ". " << status.ToString();
+  return store;
+}
+
+void WriteOrDie(tinyim::HwmStore* store, const std::vector<tinyim::HwmUpdate>& batch){
+  auto status = store->Write(batch);
+  CHECK(status.ok()) << "Fail to write. " << status.ToString();
+}
+
+void Run(const std::string& name, OpenFn open){
+  const butil::FilePath dir(FLAGS_bench_dir);
+  butil::DeleteFile(dir, true);
+  CHECK(butil::CreateDirectory(dir));
+  const std::string path = dir.Append(name).value();
+
+  auto store = OpenOrDie(open, path);
+  std::vector<tinyim::HwmUpdate> batch;
+  for (int64_t user_id = 1; user_id <= FLAGS_user_num; ++user_id){
+    batch.push_back(tinyim::HwmUpdate{user_id, 1024});
+    if (static_cast<int>(batch.size()) == FLAGS_batch_size || user_id == FLAGS_user_num){
+      WriteOrDie(store.get(), batch);
+      batch.clear();
+    }
+  }
+
+  butil::Timer timer;
+  timer.start();
+  for (int i = 0; i < FLAGS_batch_num; ++i){
+    batch.clear();
+    for (int j = 0; j < FLAGS_batch_size; ++j){
+      const int64_t user_id = butil::fast_rand_less_than(FLAGS_user_num) + 1;
+      batch.push_back(tinyim::HwmUpdate{user_id, 1024 * (i + 2)});
+    }
+    WriteOrDie(store.get(), batch);
+  }
+  timer.stop();
+  const double write_s = timer.u_elapsed(1) / 1000000.0;
+
+  store.reset();
+  timer.start();
+  store = OpenOrDie(open, path);
+  timer.stop();
+  const int64_t open_ms = timer.m_elapsed();
+
+  timer.start();
+  for (int64_t user_id = 1; user_id <= FLAGS_user_num; ++user_id){
+    int64_t max_id = 0;
+    CHECK(store->Get(user_id, &max_id).ok());
+    CHECK_GE(max_id, 1024);
+  }
+  timer.stop();
+
+  LOG(INFO) << name << " batch_size=" << FLAGS_batch_size
+            << " syncs=" << static_cast<int64_t>(FLAGS_batch_num / write_s) << "/s"
+            << " updates=" << static_cast<int64_t>(FLAGS_batch_num * FLAGS_batch_size / write_s) << "/s"
+            << " open=" << open_ms << "ms"
+            << " load_all=" << timer.m_elapsed() << "ms";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  Run("leveldb", tinyim::HwmStore::OpenLevelDb);
+  Run("mmap", tinyim::HwmStore::OpenMmap);
+  return 0;
+}
@@ -0,0 +1,301 @@
+#ifndef TINYIM_IDGEN_ID_TABLE_H_
+#define TINYIM_IDGEN_ID_TABLE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include <butil/synchronization/lock.h>
+
+namespace tinyim {
+
+// Capacity-bounded concurrent table from user_id to its id segment.
+//
+// Slots are 24 bytes and grouped into sets of kWays, a user can only live in
+// the set its user_id hashes to. Lookups scan the set without lock and ids
+// are claimed with fetch_add on cur_id. Inserting, refilling and evicting
+// lock the set. When a set is full the least recently used slot is evicted
+// by CLOCK.
+//
+// Eviction replaces cur_id with kEvicted by CAS, and only succeeds when no
+// id beyond durable_id has been claimed and no refill is in flight. So every
+// id handed out of an evicted slot is covered by the persisted high-water
+// mark, which is where the user restarts when reloaded. The last id handed
+// out of evicted users is kept so that the ids skipped by reloading them are
+// known.
+class IdTable {
+ public:
+  // key layout: user_id | referenced | refill pending | segment shift | refill epoch
+  static constexpr int kUserIdBits = 48;
+  static constexpr uint64_t kUserIdMask = (uint64_t{1} << kUserIdBits) - 1;
+  static constexpr int64_t kMaxUserId = static_cast<int64_t>(kUserIdMask);
+  static constexpr uint64_t kReferenced = uint64_t{1} << 48;
+  static constexpr uint64_t kPending = uint64_t{1} << 49;
+  static constexpr int kShiftOffset = 50;
+  static constexpr uint64_t kShiftMask = uint64_t{0x1f} << kShiftOffset;
+  static constexpr int kMaxShift = 31;
+  static constexpr int kEpochOffset = 55;
+  static constexpr uint64_t kEpochMask = uint64_t{0xff} << kEpochOffset;
+
+  static constexpr int64_t kEvicted = INT64_MIN / 2;
+
+  struct Slot {
+    std::atomic<uint64_t> key;        // 0 means empty
+    std::atomic<int64_t> cur_id;      // last id handed out
+    std::atomic<int64_t> durable_id;  // synced high-water mark
+  };
+
+  // Segment being persisted, only exists while kPending is set.
+  struct Refill {
+    int64_t max_id;      // high-water mark queued to db
+    int64_t commit_seq;  // batch which makes max_id durable
+  };
+
+  static int64_t UserId(uint64_t key) { return static_cast<int64_t>(key & kUserIdMask); }
+  static int Shift(uint64_t key) { return static_cast<int>((key & kShiftMask) >> kShiftOffset); }
+  static int Epoch(uint64_t key) { return static_cast<int>((key & kEpochMask) >> kEpochOffset); }
+  static uint64_t MakeMeta(int shift, int epoch) {
+    return (static_cast<uint64_t>(shift) << kShiftOffset)
+           | (static_cast<uint64_t>(epoch & 0xff) << kEpochOffset);
+  }
+
+  // `capacity' is the max number of cached users, rounded up to a power of 2.
+  // Up to `evicted_capacity' evicted users remember their last id.
+  explicit IdTable(size_t capacity, size_t evicted_capacity = 0): evicted_capacity_(evicted_capacity) {
+    size_t set_num = 1;
+    while (set_num * kWays < capacity){
+      set_num <<= 1;
+    }
+    set_mask_ = set_num - 1;
+    slots_.reset(new Slot[set_num * kWays]());
+    hands_.reset(new uint8_t[set_num]());
+  }
+
+  IdTable(const IdTable&) = delete;
+  IdTable& operator=(const IdTable&) = delete;
+
+  // Lock free lookup, nullptr if `user_id' is not cached.
+  Slot* Find(int64_t user_id) {
+    Slot* set = &slots_[SetIndex(user_id) * kWays];
+    for (int i = 0; i < kWays; ++i){
+      const uint64_t key = set[i].key.load(std::memory_order_acquire);
+      if (key != 0 && UserId(key) == user_id){
+        if ((key & kReferenced) == 0){
+          // CAS so that a slot evicted meanwhile is not marked
+          uint64_t expected = key;
+          set[i].key.compare_exchange_strong(expected, key | kReferenced, std::memory_order_relaxed);
+        }
+        return &set[i];
+      }
+    }
+    return nullptr;
+  }
+
+  // Cache `user_id' which must not be cached yet, evicting a slot of its set
+  // if full. The evicted key is returned in `evicted_key', 0 if none.
+  // nullptr if every slot of the set has a refill in flight.
+  // Must hold mutex(user_id).
+  Slot* InsertLocked(int64_t user_id, uint64_t meta, int64_t id,
+                     int64_t committed_seq, uint64_t* evicted_key) {
+    const size_t set_index = SetIndex(user_id);
+    Slot* set = &slots_[set_index * kWays];
+    *evicted_key = 0;
+    Slot* slot = nullptr;
+    for (int i = 0; i < kWays && slot == nullptr; ++i){
+      if (set[i].key.load(std::memory_order_relaxed) == 0){
+        slot = &set[i];
+      }
+    }
+    // CLOCK, the second round sees referenced bits cleared by the first
+    for (int i = 0; i < kWays * 2 && slot == nullptr; ++i){
+      Slot& victim = set[hands_[set_index]];
+      hands_[set_index] = (hands_[set_index] + 1) % kWays;
+      const uint64_t key = victim.key.load(std::memory_order_relaxed);
+      if (key & kReferenced){
+        victim.key.fetch_and(~kReferenced, std::memory_order_relaxed);
+        continue;
+      }
+      int64_t last_id = 0;
+      if (Evict(&victim, key, committed_seq, &last_id)){
+        *evicted_key = key;
+        slot = &victim;
+        if (last_id < victim.durable_id.load(std::memory_order_relaxed)){
+          KeepEvicted(UserId(key), last_id);
+        }
+      }
+    }
+    if (slot == nullptr){
+      return nullptr;
+    }
+    slot->cur_id.store(id, std::memory_order_relaxed);
+    slot->durable_id.store(id, std::memory_order_relaxed);
+    slot->key.store(static_cast<uint64_t>(user_id) | meta | kReferenced, std::memory_order_release);
+    return slot;
+  }
+
+  // Forget the last id of evicted `user_id', false if it is not kept.
+  // Must hold mutex(user_id).
+  bool TakeEvictedLocked(int64_t user_id, int64_t* last_id) {
+    auto& evicted = stripes_[SetIndex(user_id) % kStripeNum].evicted;
+    auto iter = evicted.find(user_id);
+    if (iter == evicted.end()){
+      return false;
+    }
+    *last_id = iter->second;
+    evicted.erase(iter);
+    evicted_num_.fetch_sub(1, std::memory_order_relaxed);
+    return true;
+  }
+
+  // Must hold mutex(user_id) for the refill functions.
+  Refill* FindRefill(int64_t user_id) {
+    auto& refills = stripes_[SetIndex(user_id) % kStripeNum].refills;
+    auto iter = refills.find(user_id);
+    return iter == refills.end() ? nullptr : &iter->second;
+  }
+
+  void SetRefill(Slot* slot, int64_t user_id, const Refill& refill) {
+    stripes_[SetIndex(user_id) % kStripeNum].refills[user_id] = refill;
+    slot->key.fetch_or(kPending, std::memory_order_release);
+  }
+
+  void EraseRefill(Slot* slot, int64_t user_id) {
+    stripes_[SetIndex(user_id) % kStripeNum].refills.erase(user_id);
+    slot->key.fetch_and(~kPending, std::memory_order_release);
+  }
+
+  // Replace segment shift and refill epoch of `slot'. Must hold the lock.
+  void SetMeta(Slot* slot, uint64_t meta) {
+    uint64_t key = slot->key.load(std::memory_order_relaxed);
+    while (!slot->key.compare_exchange_weak(key, (key & ~(kShiftMask | kEpochMask)) | meta,
+                                            std::memory_order_relaxed)){
+    }
+  }
+
+  // Drop `slot' even if a refill is in flight or ids beyond durable_id are
+  // claimed, used when its user is no longer served here. Must hold the lock.
+  void EraseLocked(Slot* slot) {
+    const uint64_t key = slot->key.load(std::memory_order_relaxed);
+    if (key & kPending){
+      EraseRefill(slot, UserId(key));
+    }
+    slot->cur_id.store(kEvicted, std::memory_order_release);
+    slot->key.store(0, std::memory_order_release);
+  }
+
+  // Call fn(slot) for every cached user, holding the lock of each set in turn.
+  template <typename Fn>
+  void ForEach(Fn fn) {
+    for (size_t set_index = 0; set_index <= set_mask_; ++set_index){
+      std::unique_lock<butil::Mutex> ul(stripes_[set_index % kStripeNum].mutex);
+      for (int i = 0; i < kWays; ++i){
+        Slot* slot = &slots_[set_index * kWays + i];
+        if (slot->key.load(std::memory_order_relaxed) != 0){
+          fn(slot);
+        }
+      }
+    }
+  }
+
+  // Forget the kept evicted users for which fn(user_id, last_id) returns
+  // true, holding the lock of each stripe in turn.
+  template <typename Fn>
+  void EraseEvictedIf(Fn fn) {
+    for (auto& stripe : stripes_){
+      std::unique_lock<butil::Mutex> ul(stripe.mutex);
+      for (auto iter = stripe.evicted.begin(); iter != stripe.evicted.end();){
+        if (fn(iter->first, iter->second)){
+          iter = stripe.evicted.erase(iter);
+          evicted_num_.fetch_sub(1, std::memory_order_relaxed);
+        }
+        else {
+          ++iter;
+        }
+      }
+    }
+  }
+
+  butil::Mutex& mutex(int64_t user_id) {
+    return stripes_[SetIndex(user_id) % kStripeNum].mutex;
+  }
+
+  size_t capacity() const {
+    return (set_mask_ + 1) * kWays;
+  }
+
+  // Memory held by slots, clock hands, in flight refills and evicted users
+  size_t ResidentBytes() {
+    size_t refill_num = 0;
+    for (int i = 0; i < kStripeNum; ++i){
+      std::unique_lock<butil::Mutex> ul(stripes_[i].mutex);
+      refill_num += stripes_[i].refills.size();
+    }
+    return capacity() * sizeof(Slot) + (set_mask_ + 1)
+           + refill_num * (sizeof(int64_t) + sizeof(Refill) + 2 * sizeof(void*))
+           + evicted_num_.load(std::memory_order_relaxed) * (2 * sizeof(int64_t) + 2 * sizeof(void*));
+  }
+
+ private:
+  bool Evict(Slot* slot, uint64_t key, int64_t committed_seq, int64_t* last_id) {
+    const int64_t user_id = UserId(key);
+    if (key & kPending){
+      Refill* refill = FindRefill(user_id);
+      if (refill->commit_seq > committed_seq){
+        return false;
+      }
+      // synced already, swap to it before dropping the refill
+      slot->durable_id.store(refill->max_id, std::memory_order_release);
+      EraseRefill(slot, user_id);
+    }
+    int64_t cur_id = slot->cur_id.load(std::memory_order_acquire);
+    if (cur_id > slot->durable_id.load(std::memory_order_acquire)){
+      // a claim beyond the synced segment is waiting for a refill
+      return false;
+    }
+    // fails if any id is claimed meanwhile
+    if (!slot->cur_id.compare_exchange_strong(cur_id, kEvicted, std::memory_order_acq_rel)){
+      return false;
+    }
+    slot->key.store(0, std::memory_order_release);
+    *last_id = cur_id;
+    return true;
+  }
+
+  // Ids after `last_id' up to the high-water mark are skipped when `user_id'
+  // is reloaded. Nothing is kept once too many users are kept.
+  // Must hold mutex(user_id).
+  void KeepEvicted(int64_t user_id, int64_t last_id) {
+    auto& evicted = stripes_[SetIndex(user_id) % kStripeNum].evicted;
+    if (evicted_num_.load(std::memory_order_relaxed) >= evicted_capacity_){
+      return;
+    }
+    if (evicted.emplace(user_id, last_id).second){
+      evicted_num_.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  size_t SetIndex(int64_t user_id) const {
+    // fibonacci hashing, spreads sequential user ids
+    return static_cast<size_t>((static_cast<uint64_t>(user_id) * 0x9E3779B97F4A7C15ULL) >> 20) & set_mask_;
+  }
+
+  enum { kWays = 8, kStripeNum = 1024 };
+  struct Stripe {
+    butil::Mutex mutex;
+    std::unordered_map<int64_t, Refill> refills;  // user_id -> refill
+    std::unordered_map<int64_t, int64_t> evicted;  // user_id -> last id handed out
+  };
+  Stripe stripes_[kStripeNum];
+
+  const size_t evicted_capacity_;
+  std::atomic<size_t> evicted_num_{0};
+  size_t set_mask_;
+  std::unique_ptr<Slot[]> slots_;
+  std::unique_ptr<uint8_t[]> hands_;  // CLOCK hand of each set
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_IDGEN_ID_TABLE_H_
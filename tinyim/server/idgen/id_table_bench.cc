@@ -0,0 +1,106 @@
+#include <gflags/gflags.h>
+#include <butil/fast_rand.h>
+#include <butil/logging.h>
+#include <butil/synchronization/lock.h>
+#include <butil/time.h>
+
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "idgen/id_table.h"
+#include "util/initialize.h"
+
+// Compare handing out cached ids from IdTable with the 16 bucket
+// unordered_map LevelDbIdGen used before, both without touching db.
+
+DEFINE_int32(max_thread_num, 64, "Threads are doubled from 1 up to this");
+DEFINE_int32(user_num, 500000, "User ids are picked from [1, user_num]");
+DEFINE_int64(op_num, 2000000, "Id handouts of each thread");
+
+namespace {
+
+class BucketMap {
+ public:
+  int64_t IdGenerate(int64_t user_id){
+    const int bucket = user_id % kBucketNum;
+    std::unique_lock<butil::Mutex> ul(mutex_[bucket]);
+    return ++id_cache_[bucket][user_id];
+  }
+
+ private:
+  enum { kBucketNum = 16 };
+  butil::Mutex mutex_[kBucketNum];
+  std::unordered_map<int64_t, int64_t> id_cache_[kBucketNum];
+};
+
+class Table {
+ public:
+  Table(): id_table_(FLAGS_user_num * 2) {}
+
+  int64_t IdGenerate(int64_t user_id){
+    while (true){
+      auto slot = id_table_.Find(user_id);
+      if (slot == nullptr){
+        std::unique_lock<butil::Mutex> ul(id_table_.mutex(user_id));
+        slot = id_table_.Find(user_id);
+        if (slot == nullptr){
+          uint64_t evicted_key = 0;
+          slot = id_table_.InsertLocked(user_id, 0, 0, 0, &evicted_key);
+          CHECK(slot != nullptr);
+          // never refills, so a full set can still evict
+          slot->durable_id.store(std::numeric_limits<int64_t>::max() / 2);
+        }
+      }
+      const int64_t id = slot->cur_id.fetch_add(1);
+      if (id >= 0 && tinyim::IdTable::UserId(slot->key.load(std::memory_order_acquire)) == user_id){
+        return id + 1;
+      }
+    }
+  }
+
+ private:
+  tinyim::IdTable id_table_;
+};
+
+template <typename T>
+double Run(T* idgen, int thread_num){
+  std::vector<std::thread> threads;
+  butil::Timer timer;
+  timer.start();
+  for (int i = 0; i < thread_num; ++i){
+    threads.emplace_back([idgen]{
+      for (int64_t op = 0; op < FLAGS_op_num; ++op){
+        idgen->IdGenerate(butil::fast_rand_less_than(FLAGS_user_num) + 1);
+      }
+    });
+  }
+  for (auto& thread : threads){
+    thread.join();
+  }
+  timer.stop();
+  return static_cast<double>(FLAGS_op_num) * thread_num / timer.u_elapsed(1) * 1000000;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  for (int thread_num = 1; thread_num <= FLAGS_max_thread_num; thread_num *= 2){
+    BucketMap bucket_map;
+    Table table;
+    // first pass inserts all users
+    Run(&bucket_map, 1);
+    Run(&table, 1);
+    const double bucket_qps = Run(&bucket_map, thread_num);
+    const double table_qps = Run(&table, thread_num);
+    LOG(INFO) << "thread_num=" << thread_num
+              << " bucket_map=" << static_cast<int64_t>(bucket_qps) << "/s"
+              << " id_table=" << static_cast<int64_t>(table_qps) << "/s"
+              << " speedup=" << table_qps / bucket_qps;
+  }
+  return 0;
+}
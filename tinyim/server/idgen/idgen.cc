@@ -1,94 +1,577 @@
 #include "idgen/idgen.h"
 
+#include <algorithm>
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <unordered_map>
+#include <vector>
 
+#include <butil/strings/string_split.h>
 #include <butil/synchronization/lock.h>
-#include <leveldb/db.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
 
+#include "idgen/group_commit_writer.h"
+#include "idgen/hwm_store.h"
+#include "idgen/id_table.h"
+#include "util/partition_map.h"
+
+DEFINE_string(idgen_store, "leveldb", "Where high-water marks are kept: leveldb or mmap");
 DEFINE_string(leveldb_file, "./data/data.db", "Leveldb db file");
-DEFINE_int64(each_gen_id_num, 1024, "Each generate id num from db");
+DEFINE_string(idgen_mmap_file, "./data/hwm.dat", "High-water mark file of -idgen_store=mmap");
+DEFINE_int64(each_gen_id_num, 1024, "Initial segment size of each user, rounded up to a power of 2");
 DEFINE_int64(hash_bucket_num, 12, "Each generate id num from db");
+DEFINE_bool(idgen_group_commit, true, "Share one fsync among the high-water mark "
+            "updates of concurrent requests");
+DEFINE_int64(idgen_table_capacity, 1 << 22, "Max number of users cached in idgen, "
+             "least recently used ones are evicted and reloaded from db");
+DEFINE_int64(idgen_min_segment, 64, "Min segment size of adaptive sizing");
+DEFINE_int64(idgen_max_segment, 1 << 20, "Max segment size of adaptive sizing");
+DEFINE_int32(idgen_target_refill_s, 10, "Segment of a user is grown when it refills more than "
+             "twice as often as this, and shrunk when less than half as often");
+DEFINE_string(idgen_servers, "", "Comma separated addresses of all idgen nodes, node id is "
+              "the index. Empty means a single node serving every user");
+DEFINE_int32(idgen_node_id, 0, "Index of this node in -idgen_servers");
+DEFINE_int32(idgen_partition_num, 1024, "Users are split into this many partitions, must be "
+             "the same on logic and every idgen");
+DEFINE_int32(idgen_vnode_num, 64, "Virtual nodes of each idgen node on the hash ring");
+DEFINE_string(idgen_partition_moves, "", "Partitions placed off the hash ring after being "
+              "moved, \"partition:node,...\"");
+DEFINE_int64(idgen_skip_track_users, 1 << 20, "Max evicted users whose last id is kept, so "
+             "that the ids skipped when reloading them are reported to logic");
+DEFINE_double(idgen_prefetch_ratio, 0.2, "Persist the next segment in background when "
+              "this ratio of the current segment is left, 0 disables prefetch");
+
+namespace {
+
+bvar::Adder<int64_t> g_segment_wait_count("idgen_segment_wait_count");
+bvar::Adder<int64_t> g_returned_range_count("idgen_returned_range_count");
+bvar::Adder<int64_t> g_skipped_range_count("idgen_skipped_range_count");
+
+bvar::Adder<int64_t> g_cache_hit_count("idgen_cache_hit_count");
+bvar::Adder<int64_t> g_cache_miss_count("idgen_cache_miss_count");
+bvar::Adder<int64_t> g_cache_eviction_count("idgen_cache_eviction_count");
+bvar::Window<bvar::Adder<int64_t>> g_cache_hit_minute(&g_cache_hit_count, 60);
+bvar::Window<bvar::Adder<int64_t>> g_cache_miss_minute(&g_cache_miss_count, 60);
+
+double GetCacheHitRatio(void*){
+  const int64_t hit = g_cache_hit_minute.get_value();
+  const int64_t total = hit + g_cache_miss_minute.get_value();
+  return total == 0 ? 1.0 : static_cast<double>(hit) / total;
+}
+bvar::PassiveStatus<double> g_cache_hit_ratio("idgen_cache_hit_ratio", GetCacheHitRatio, nullptr);
+
+int Log2Ceil(int64_t n){
+  int shift = 0;
+  while ((int64_t{1} << shift) < n){
+    ++shift;
+  }
+  return shift;
+}
+
+}  // namespace
 
 namespace tinyim{
 
-class LevelDbIdGen final : public IdGen{
+class SegmentIdGen final : public IdGen{
  public:
-  LevelDbIdGen() = default;
+  SegmentIdGen() = default;
 
   void Init(){
-    leveldb::Options options;
-    options.create_if_missing = true;
-
-    auto status = leveldb::DB::Open(options, FLAGS_leveldb_file, &db_);
+    leveldb::Status status;
+    if (FLAGS_idgen_store == "mmap"){
+      status = HwmStore::OpenMmap(FLAGS_idgen_mmap_file, &store_);
+    }
+    else if (FLAGS_idgen_store == "leveldb"){
+      status = HwmStore::OpenLevelDb(FLAGS_leveldb_file, &store_);
+    }
+    else {
+      status = leveldb::Status::InvalidArgument("Unknown idgen_store", FLAGS_idgen_store);
+    }
     if (!status.ok()) {
-      LOG(ERROR) << "Fail to open leveldb file=" << FLAGS_leveldb_file
-                 << ". " << status.ToString();
+      LOG(ERROR) << "Fail to open " << FLAGS_idgen_store << " store. " << status.ToString();
+      exit(0);
+    }
+    writer_.reset(new GroupCommitWriter(store_.get()));
+
+    std::vector<std::string> servers;
+    butil::SplitString(FLAGS_idgen_servers, ',', &servers);
+    partition_map_.reset(new PartitionMap(FLAGS_idgen_partition_num,
+                                          std::max<int>(servers.size(), 1), FLAGS_idgen_vnode_num));
+    if (!partition_map_->ParseMoves(FLAGS_idgen_partition_moves)){
+      LOG(ERROR) << "Invalid idgen_partition_moves=" << FLAGS_idgen_partition_moves;
       exit(0);
     }
+    owned_.reset(new std::atomic<bool>[FLAGS_idgen_partition_num]);
+    int owned_num = 0;
+    for (int partition = 0; partition < FLAGS_idgen_partition_num; ++partition){
+      bool owned = partition_map_->NodeOf(partition) == FLAGS_idgen_node_id;
+      // a move recorded here wins over flags not updated yet
+      int64_t fence = HwmStore::kFenceNone;
+      status = store_->Get(HwmStore::FenceKey(partition), &fence);
+      if (!status.ok()){
+        LOG(ERROR) << "Fail to read fence of partition=" << partition << ". " << status.ToString();
+        exit(0);
+      }
+      if (fence == HwmStore::kFenceExported && owned){
+        LOG(WARNING) << "Not serving partition=" << partition << " exported from here, "
+                     << "idgen_partition_moves is stale";
+        owned = false;
+      }
+      else if (fence == HwmStore::kFenceImported && !owned){
+        LOG(WARNING) << "Serving partition=" << partition << " imported here, "
+                     << "idgen_partition_moves is stale";
+        owned = true;
+      }
+      owned_[partition].store(owned);
+      owned_num += owned;
+    }
+    LOG(INFO) << "Serving " << owned_num << " of " << FLAGS_idgen_partition_num << " partitions";
+    id_table_.reset(new IdTable(FLAGS_idgen_table_capacity, FLAGS_idgen_skip_track_users));
+
+    resident_bytes_.reset(new bvar::PassiveStatus<int64_t>("idgen_cache_resident_bytes",
+                                                          GetResidentBytes, this));
+
+    min_shift_ = std::min(Log2Ceil(FLAGS_idgen_min_segment), int{IdTable::kMaxShift});
+    max_shift_ = std::clamp(Log2Ceil(FLAGS_idgen_max_segment), min_shift_, int{IdTable::kMaxShift});
+    init_shift_ = std::clamp(Log2Ceil(FLAGS_each_gen_id_num), min_shift_, max_shift_);
+    // cached users of each segment size
+    for (int shift = min_shift_; shift <= max_shift_; ++shift){
+      segment_size_count_[shift].expose("idgen_segment_size_" + std::to_string(int64_t{1} << shift));
+    }
   }
 
   virtual leveldb::Status IdGenerate(int64_t user_id, int64_t need_msgid_num,
                                      int64_t& start_id) override {
-    const int bucket = user_id % kBucketNum;
-    auto& id_cache = id_cache_[bucket];
-    leveldb::Status status;
+    IdRange range{user_id, need_msgid_num, 0};
+    auto status = BatchIdGenerate(&range, 1);
+    start_id = range.start_msgid;
+    return status;
+  }
 
-    bool update_db = false;
-    std::unique_lock<butil::Mutex> ul(mutex_[bucket]);
-    int64_t& original_id = id_cache[user_id];
-    if (original_id == 0){
-      update_db = true;
-      std::string db_id;
-      auto status = db_->Get(leveldb::ReadOptions(), leveldb::Slice(std::to_string(user_id)), &db_id);
-      if (status.ok()){
-        DLOG(INFO) << "user_id=" << user_id << " db_id" << db_id;
-        original_id = std::stoll(db_id);
-      }
-      else if (status.IsNotFound()){
-        DLOG(INFO) << "user_id=" << user_id << " not found";
-        original_id = 0;
-      }
-      else{
-        LOG(ERROR) << "Fail to get id=" << user_id << " from leveldb" << ". " << status.ToString();
+  virtual leveldb::Status BatchIdGenerate(IdRange* ranges, int size) override {
+    for (int i = 0; i < size; ++i){
+      if (!Owns(ranges[i].user_id)){
+        return NotOwner(ranges[i].user_id);
+      }
+    }
+    int64_t wait_seq = 0;
+    for (int i = 0; i < size; ++i){
+      int64_t commit_seq = 0;
+      auto status = Reserve(&ranges[i], commit_seq);
+      if (!status.ok()){
         return status;
       }
+      wait_seq = std::max(wait_seq, commit_seq);
     }
+    // Ids are not handed out until every high-water mark they depend on is
+    // synced, one Wait covers all users since batches are synced in order.
+    if (wait_seq > 0){
+      return writer_->Wait(wait_seq);
+    }
+    return leveldb::Status::OK();
+  }
 
-    if (update_db || (original_id % FLAGS_each_gen_id_num + need_msgid_num > FLAGS_each_gen_id_num)){
-      int64_t db_id = ((original_id + need_msgid_num + FLAGS_each_gen_id_num - 1)
-                          / FLAGS_each_gen_id_num) * FLAGS_each_gen_id_num;
-      auto write_options = leveldb::WriteOptions();
-      // XXX 同步写
-      write_options.sync = true;
-      DLOG(INFO) << "Putting" << user_id << " db_id=" << db_id;
-      status = db_->Put(write_options, leveldb::Slice(std::to_string(user_id)),
-                                            leveldb::Slice(std::to_string(db_id)));
+  virtual int ReturnIds(const IdRange* ranges, int size) override {
+    int returned_num = 0;
+    for (int i = 0; i < size; ++i){
+      const int64_t user_id = ranges[i].user_id;
+      if (ranges[i].need_msgid_num <= 0 || user_id <= 0 || user_id > IdTable::kMaxUserId
+          || !Owns(user_id)){
+        continue;
+      }
+      // the lock keeps the slot from being evicted and reused meanwhile
+      std::unique_lock<butil::Mutex> ul(id_table_->mutex(user_id));
+      IdTable::Slot* slot = id_table_->Find(user_id);
+      if (slot == nullptr){
+        continue;
+      }
+      int64_t end_id = ranges[i].start_msgid + ranges[i].need_msgid_num - 1;
+      returned_num += slot->cur_id.compare_exchange_strong(end_id, ranges[i].start_msgid - 1);
+    }
+    g_returned_range_count << returned_num;
+    return returned_num;
+  }
+
+  virtual leveldb::Status ExportPartition(int partition, std::vector<HwmUpdate>* hwms) override {
+    if (partition < 0 || partition >= partition_map_->partition_num()){
+      return leveldb::Status::InvalidArgument("Invalid partition");
+    }
+    owned_[partition].store(false);
+
+    // Refills check ownership under the lock of their set, so once every set
+    // is visited no high-water mark of the partition can grow any more.
+    std::unordered_map<int64_t, int64_t> max_ids;
+    int64_t wait_seq = 0;
+    id_table_->ForEach([this, partition, &max_ids, &wait_seq](IdTable::Slot* slot){
+      const uint64_t key = slot->key.load(std::memory_order_relaxed);
+      const int64_t user_id = IdTable::UserId(key);
+      if (partition_map_->PartitionOf(user_id) != partition){
+        return;
+      }
+      int64_t max_id = std::max(slot->cur_id.load(), slot->durable_id.load());
+      if (key & IdTable::kPending){
+        const IdTable::Refill* refill = id_table_->FindRefill(user_id);
+        max_id = std::max(max_id, refill->max_id);
+        wait_seq = std::max(wait_seq, refill->commit_seq);
+      }
+      max_ids[user_id] = max_id;
+      segment_size_count_[IdTable::Shift(key)] << -1;
+      id_table_->EraseLocked(slot);
+    });
+    // the new owner may hand out ids after their last ids
+    id_table_->EraseEvictedIf([this, partition](int64_t user_id, int64_t){
+      return partition_map_->PartitionOf(user_id) == partition;
+    });
+    // so that exporting again returns the same marks
+    if (wait_seq > 0){
+      auto status = writer_->Wait(wait_seq);
       if (!status.ok()){
-        LOG(ERROR) << "Fail to generate db_id=" << db_id << " for user_id=" << user_id
-                  << ". " << status.ToString();
         return status;
       }
     }
-    start_id = original_id + 1;
-    original_id += need_msgid_num;
-    return status;
+    auto status = store_->ForEach([this, partition, &max_ids](int64_t user_id, int64_t max_id){
+      if (partition_map_->PartitionOf(user_id) == partition){
+        int64_t& export_id = max_ids[user_id];
+        export_id = std::max(export_id, max_id);
+      }
+    });
+    if (!status.ok()){
+      LOG(ERROR) << "Fail to export partition=" << partition << ". " << status.ToString();
+      return status;
+    }
+    // before the marks leave, a restart must not serve the partition again
+    status = store_->Write({HwmUpdate{HwmStore::FenceKey(partition), HwmStore::kFenceExported}});
+    if (!status.ok()){
+      LOG(ERROR) << "Fail to fence partition=" << partition << ". " << status.ToString();
+      return status;
+    }
+
+    hwms->clear();
+    hwms->reserve(max_ids.size());
+    for (const auto& user_and_id : max_ids){
+      hwms->push_back(HwmUpdate{user_and_id.first, user_and_id.second});
+    }
+    LOG(INFO) << "Exported partition=" << partition << " user_num=" << hwms->size();
+    return leveldb::Status::OK();
   }
 
-  virtual ~LevelDbIdGen(){
-    delete db_;
+  virtual leveldb::Status ImportPartition(int partition, const std::vector<HwmUpdate>& hwms) override {
+    if (partition < 0 || partition >= partition_map_->partition_num()){
+      return leveldb::Status::InvalidArgument("Invalid partition");
+    }
+    if (owned_[partition].load()){
+      return leveldb::Status::InvalidArgument("Partition is served here already");
+    }
+    // Users of a partition not served here are never cached, only the store
+    // may hold marks left from an earlier ownership.
+    std::vector<HwmUpdate> updates;
+    for (const auto& hwm : hwms){
+      if (partition_map_->PartitionOf(hwm.user_id) != partition){
+        return leveldb::Status::InvalidArgument("User not in partition", std::to_string(hwm.user_id));
+      }
+      int64_t max_id = 0;
+      auto status = store_->Get(hwm.user_id, &max_id);
+      if (!status.ok()){
+        return status;
+      }
+      if (hwm.max_id > max_id){
+        updates.push_back(hwm);
+      }
+    }
+    // in the same write as the marks
+    updates.push_back(HwmUpdate{HwmStore::FenceKey(partition), HwmStore::kFenceImported});
+    auto status = store_->Write(updates);
+    if (!status.ok()){
+      LOG(ERROR) << "Fail to import partition=" << partition << ". " << status.ToString();
+      return status;
+    }
+    owned_[partition].store(true);
+    LOG(INFO) << "Imported partition=" << partition << " user_num=" << hwms.size();
+    return leveldb::Status::OK();
+  }
+
+  virtual void Stop() override {
+    std::unique_ptr<bool[]> owned(new bool[partition_map_->partition_num()]);
+    for (int partition = 0; partition < partition_map_->partition_num(); ++partition){
+      owned[partition] = owned_[partition].exchange(false);
+    }
+
+    // Claims racing with the exchange see kEvicted and fail, so no id after
+    // the last ids is handed out.
+    std::vector<HwmUpdate> updates;
+    id_table_->ForEach([this, &owned, &updates](IdTable::Slot* slot){
+      const uint64_t key = slot->key.load(std::memory_order_relaxed);
+      const int64_t user_id = IdTable::UserId(key);
+      const int64_t last_id = slot->cur_id.exchange(IdTable::kEvicted);
+      if (owned[partition_map_->PartitionOf(user_id)] && last_id > 0){
+        updates.push_back(HwmUpdate{user_id, last_id});
+      }
+      segment_size_count_[IdTable::Shift(key)] << -1;
+      id_table_->EraseLocked(slot);
+    });
+    id_table_->EraseEvictedIf([this, &owned, &updates](int64_t user_id, int64_t last_id){
+      if (owned[partition_map_->PartitionOf(user_id)]){
+        updates.push_back(HwmUpdate{user_id, last_id});
+      }
+      return true;
+    });
+
+    // queued after every refill, so a lowered mark wins
+    int64_t seq = 0;
+    for (const auto& update : updates){
+      seq = writer_->Append(update.user_id, update.max_id);
+    }
+    if (seq > 0){
+      auto status = writer_->Wait(seq);
+      if (!status.ok()){
+        LOG(ERROR) << "Fail to lower high-water marks, ids after them are skipped. "
+                   << status.ToString();
+        return;
+      }
+    }
+    LOG(INFO) << "Stopped, lowered high-water marks of " << updates.size() << " users";
+  }
+
+  virtual ~SegmentIdGen(){
+    writer_.reset();
   }
 
  private:
-  leveldb::DB* db_;
+  // Claim ids from the cached segment of the user of `range', queue a new
+  // high-water mark when the segment runs out. `commit_seq' is the batch that
+  // must be synced before the ids can be returned, 0 if they are durable
+  // already.
+  leveldb::Status Reserve(IdRange* range, int64_t& commit_seq){
+    const int64_t user_id = range->user_id;
+    const int64_t need_msgid_num = range->need_msgid_num;
+    int64_t& start_id = range->start_msgid;
+    if (user_id <= 0 || user_id > IdTable::kMaxUserId){
+      LOG(ERROR) << "Invalid user_id=" << user_id;
+      return leveldb::Status::InvalidArgument("Invalid user_id");
+    }
+
+    commit_seq = 0;
+    while (true){
+      IdTable::Slot* slot = id_table_->Find(user_id);
+      int64_t end_id = 0;
+      if (slot != nullptr){
+        // fast path, no lock
+        const int64_t cur_id = slot->cur_id.fetch_add(need_msgid_num);
+        if (cur_id < 0 || IdTable::UserId(slot->key.load(std::memory_order_acquire)) != user_id){
+          // evicted after Find, drop the claim
+          continue;
+        }
+        end_id = cur_id + need_msgid_num;
+        const int64_t durable_id = slot->durable_id.load(std::memory_order_acquire);
+        if (end_id <= durable_id){
+          g_cache_hit_count << 1;
+          start_id = cur_id + 1;
+          if (durable_id - end_id < PrefetchThreshold(slot)
+              && (slot->key.load(std::memory_order_relaxed) & IdTable::kPending) == 0){
+            std::unique_lock<butil::Mutex> ul(id_table_->mutex(user_id), std::try_to_lock);
+            if (ul.owns_lock()){
+              PrefetchLocked(user_id, slot);
+            }
+          }
+          return leveldb::Status::OK();
+        }
+      }
+
+      // slow path, load the user or claimed ids are beyond the synced segment
+      std::unique_lock<butil::Mutex> ul(id_table_->mutex(user_id));
+      if (!Owns(user_id)){
+        // partition exported meanwhile
+        return NotOwner(user_id);
+      }
+      if (slot != nullptr){
+        if (IdTable::UserId(slot->key.load(std::memory_order_relaxed)) != user_id){
+          continue;
+        }
+        g_cache_hit_count << 1;
+      }
+      else {
+        slot = id_table_->Find(user_id);
+        if (slot == nullptr){
+          g_cache_miss_count << 1;
+          auto status = LoadLocked(range, &slot);
+          if (!status.ok()){
+            return status;
+          }
+        }
+        end_id = slot->cur_id.fetch_add(need_msgid_num) + need_msgid_num;
+      }
+      start_id = end_id - need_msgid_num + 1;
+      return RefillLocked(user_id, slot, end_id, commit_seq);
+    }
+  }
+
+  // Read the high-water mark of the user of `range' from db and cache it, the
+  // user restarts from there since ids up to it may have been handed out.
+  // Ids skipped by that are set in `range' if the user was evicted here.
+  // Must hold mutex(user_id).
+  leveldb::Status LoadLocked(IdRange* range, IdTable::Slot** slot){
+    const int64_t user_id = range->user_id;
+    int64_t original_id = 0;
+    auto status = store_->Get(user_id, &original_id);
+    if (!status.ok()){
+      LOG(ERROR) << "Fail to get id=" << user_id << " from " << FLAGS_idgen_store
+                 << ". " << status.ToString();
+      return status;
+    }
+
+    uint64_t evicted_key = 0;
+    *slot = id_table_->InsertLocked(user_id, IdTable::MakeMeta(init_shift_, RefillEpoch()),
+                                    original_id, writer_->committed_seq(), &evicted_key);
+    if (*slot == nullptr){
+      LOG(ERROR) << "Fail to cache user_id=" << user_id << ", all users of its set are refilling";
+      return leveldb::Status::IOError("Id cache set is busy");
+    }
+    if (evicted_key != 0){
+      DLOG(INFO) << "Evicted user_id=" << IdTable::UserId(evicted_key);
+      g_cache_eviction_count << 1;
+      segment_size_count_[IdTable::Shift(evicted_key)] << -1;
+    }
+    segment_size_count_[init_shift_] << 1;
+
+    int64_t last_id = 0;
+    if (id_table_->TakeEvictedLocked(user_id, &last_id) && last_id < original_id){
+      range->skipped_start_msgid = last_id + 1;
+      range->skipped_end_msgid = original_id;
+      g_skipped_range_count << 1;
+    }
+    return leveldb::Status::OK();
+  }
+
+  // Make sure ids up to `end_id' are covered by a synced or queued segment.
+  // Must hold mutex(user_id).
+  leveldb::Status RefillLocked(int64_t user_id, IdTable::Slot* slot,
+                               int64_t end_id, int64_t& commit_seq){
+    IdTable::Refill* refill = id_table_->FindRefill(user_id);
+    if (refill != nullptr && end_id > slot->durable_id.load(std::memory_order_relaxed)
+        && refill->commit_seq <= writer_->committed_seq()){
+      // the prefetched segment has been synced, swap to it
+      slot->durable_id.store(refill->max_id, std::memory_order_release);
+      id_table_->EraseRefill(slot, user_id);
+      refill = nullptr;
+    }
+
+    int64_t max_id = refill != nullptr ? refill->max_id
+                                       : slot->durable_id.load(std::memory_order_relaxed);
+    if (end_id > max_id){
+      // not prefetched or too many ids wanted, cover the concurrent claims too
+      const int64_t claimed_id = std::max(end_id, slot->cur_id.load(std::memory_order_relaxed));
+      const int64_t segment = AdaptSegment(slot);
+      max_id = ((claimed_id + segment - 1) / segment) * segment;
+      DLOG(INFO) << "Putting" << user_id << " db_id=" << max_id;
+      const int64_t seq = writer_->Append(user_id, max_id);
+      if (!FLAGS_idgen_group_commit){
+        auto status = writer_->Wait(seq);
+        if (!status.ok()){
+          LOG(ERROR) << "Fail to generate db_id=" << max_id << " for user_id=" << user_id
+                    << ". " << status.ToString();
+          return status;
+        }
+        slot->durable_id.store(max_id, std::memory_order_release);
+      }
+      else {
+        id_table_->SetRefill(slot, user_id, IdTable::Refill{max_id, seq});
+      }
+    }
+    if (end_id > slot->durable_id.load(std::memory_order_relaxed)){
+      g_segment_wait_count << 1;
+      commit_seq = id_table_->FindRefill(user_id)->commit_seq;
+    }
+    PrefetchLocked(user_id, slot);
+    return leveldb::Status::OK();
+  }
+
+  int64_t PrefetchThreshold(const IdTable::Slot* slot) const {
+    return (int64_t{1} << IdTable::Shift(slot->key.load(std::memory_order_relaxed)))
+              * FLAGS_idgen_prefetch_ratio;
+  }
+
+  // The refill time of a user is kept as an 8-bit epoch, one epoch is half
+  // of the target refill interval.
+  int RefillEpoch() const {
+    const int64_t epoch_ms = std::max<int64_t>(1, FLAGS_idgen_target_refill_s * 1000L / 2);
+    return static_cast<int>(butil::gettimeofday_ms() / epoch_ms) & 0xff;
+  }
+
+  // Called on each refill, grow the segment of users which refill more often
+  // than the target interval and shrink it for idle ones, so heavy users do
+  // fewer fsyncs and light users leave small gaps on restart. Return the new
+  // segment size. Must hold the lock of `slot'.
+  int64_t AdaptSegment(IdTable::Slot* slot){
+    const uint64_t key = slot->key.load(std::memory_order_relaxed);
+    const int shift = IdTable::Shift(key);
+    const int epoch = RefillEpoch();
+    const int elapsed = (epoch - IdTable::Epoch(key)) & 0xff;
+    int new_shift = shift;
+    if (elapsed == 0){
+      // within half of the target interval
+      new_shift = std::min(shift + 1, max_shift_);
+    }
+    else if (elapsed > 4){
+      // longer than twice the target interval
+      new_shift = std::max(shift - 1, min_shift_);
+    }
+    id_table_->SetMeta(slot, IdTable::MakeMeta(new_shift, epoch));
+    if (new_shift != shift){
+      segment_size_count_[shift] << -1;
+      segment_size_count_[new_shift] << 1;
+    }
+    return int64_t{1} << new_shift;
+  }
+
+  // Queue the next segment and sync it in background if the current one is
+  // nearly used up. Must hold the lock of `slot'.
+  void PrefetchLocked(int64_t user_id, IdTable::Slot* slot){
+    // the lock is shared by the set, the slot may have been taken by another
+    // user before it was locked
+    if (IdTable::UserId(slot->key.load(std::memory_order_relaxed)) != user_id){
+      return;
+    }
+    const int64_t durable_id = slot->durable_id.load(std::memory_order_relaxed);
+    if (!FLAGS_idgen_group_commit || !Owns(user_id)
+        || (slot->key.load(std::memory_order_relaxed) & IdTable::kPending)
+        || durable_id - slot->cur_id.load(std::memory_order_relaxed) >= PrefetchThreshold(slot)){
+      return;
+    }
+    const int64_t max_id = durable_id + AdaptSegment(slot);
+    const int64_t seq = writer_->Append(user_id, max_id);
+    id_table_->SetRefill(slot, user_id, IdTable::Refill{max_id, seq});
+    writer_->WaitAsync(seq);
+  }
+
+  bool Owns(int64_t user_id) const {
+    return owned_[partition_map_->PartitionOf(user_id)].load();
+  }
+
+  leveldb::Status NotOwner(int64_t user_id) const {
+    return leveldb::Status::InvalidArgument("Not owner of partition",
+                                            std::to_string(partition_map_->PartitionOf(user_id)));
+  }
+
+  static int64_t GetResidentBytes(void* arg){
+    return static_cast<SegmentIdGen*>(arg)->id_table_->ResidentBytes();
+  }
+
+  std::unique_ptr<HwmStore> store_;
+  std::unique_ptr<GroupCommitWriter> writer_;
+  std::unique_ptr<IdTable> id_table_;
+  std::unique_ptr<PartitionMap> partition_map_;
+  std::unique_ptr<std::atomic<bool>[]> owned_;  // partitions served here
 
-  enum { kBucketNum = 16 };
-  butil::Mutex mutex_[kBucketNum];
-  std::unordered_map<int64_t, int64_t> id_cache_[kBucketNum];
-  //                 user_id  msg_id
+  int min_shift_;
+  int max_shift_;
+  int init_shift_;
+  bvar::Adder<int64_t> segment_size_count_[IdTable::kMaxShift + 1];
+  std::unique_ptr<bvar::PassiveStatus<int64_t>> resident_bytes_;
 };
 
 namespace {
@@ -99,9 +582,9 @@ IdGen *g_idgen = nullptr;
 }
 
 IdGen* IdGen::Default(){
-  // LevelDbIdGen* id_gen =  new LevelDbIdGen;
+  // SegmentIdGen* id_gen =  new SegmentIdGen;
   std::call_once(idgen_once_flag, []{
-    LevelDbIdGen *idgen = new LevelDbIdGen;
+    SegmentIdGen *idgen = new SegmentIdGen;
     idgen->Init();
     g_idgen = idgen;
   });
@@ -110,4 +593,4 @@ IdGen* IdGen::Default(){
 
 IdGen::~IdGen() {}
 
-}  // namespace tinyim
\ No newline at end of file
+}  // namespace tinyim
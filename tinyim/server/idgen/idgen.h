@@ -1,21 +1,57 @@
 #ifndef TINYIM_IDGEN_IDGEN_H_
 #define TINYIM_IDGEN_IDGEN_H_
 
+#include <cstdint>
+#include <vector>
+
 #include <leveldb/status.h>
 
+#include "idgen/hwm_store.h"
+
 
 namespace tinyim {
 
+struct IdRange {
+  int64_t user_id;
+  int64_t need_msgid_num;
+  int64_t start_msgid;  // output
+  // output, ids abandoned by idgen right before this range, none if
+  // skipped_start_msgid is 0
+  int64_t skipped_start_msgid;
+  int64_t skipped_end_msgid;
+};
+
 class IdGen {
  public:
   IdGen() = default;
 
   IdGen(const IdGen&) = delete;
   IdGen& operator=(const IdGen&) = delete;
-  // TODO user_id批量申请
 
   virtual leveldb::Status IdGenerate(int64_t user_id, int64_t need_msgid_num,
                                      int64_t& start_msgid) = 0;
+
+  // Generate ids for all users of one request, high-water mark updates of
+  // the whole batch are made durable together.
+  virtual leveldb::Status BatchIdGenerate(IdRange* ranges, int size) = 0;
+
+  // Take back unused ids [start_msgid, start_msgid + need_msgid_num) of each
+  // range if no id after them is handed out yet, otherwise they are skipped.
+  // Return the number of ranges taken back.
+  virtual int ReturnIds(const IdRange* ranges, int size) = 0;
+
+  // Stop serving `partition' and return the high-water marks of its users,
+  // every id handed out here is below them.
+  virtual leveldb::Status ExportPartition(int partition, std::vector<HwmUpdate>* hwms) = 0;
+
+  // Persist the high-water marks exported by the previous owner and start
+  // serving `partition' above them.
+  virtual leveldb::Status ImportPartition(int partition, const std::vector<HwmUpdate>& hwms) = 0;
+
+  // Stop serving and lower the high-water mark of every user to its last
+  // handed out id, so a clean restart skips no id.
+  virtual void Stop() = 0;
+
   static IdGen* Default();
 
   virtual ~IdGen();
@@ -25,4 +61,4 @@ class IdGen {
 
 
 
-#endif  // TINYIM_IDGEN_IDGEN_H_
\ No newline at end of file
+#endif  // TINYIM_IDGEN_IDGEN_H_
@@ -0,0 +1,322 @@
+#include <gflags/gflags.h>
+#include <butil/fast_rand.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+#include <brpc/callback.h>
+#include <brpc/channel.h>
+#include <brpc/server.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "idgen.pb.h"
+#include "util/initialize.h"
+
+// Load generator of idgen. Closed loop keeps -thread_num requests in flight,
+// open loop sends at -qps no matter how idgen keeps up and measures latency
+// from the scheduled send time. Users follow a Zipf distribution, requests
+// are private (sender and peer) or group (-group_size users) messages.
+// Latency of the warmup is not counted. fsyncs are read from the
+// idgen_fsync_count bvar of the server.
+
+DEFINE_string(protocol, "baidu_std", "Protocol type. Defined in src/brpc/options.proto");
+DEFINE_string(connection_type, "", "Connection type. Available values: single, pooled, short");
+DEFINE_string(server, "0.0.0.0:8000", "IP Address of server");
+DEFINE_string(load_balancer, "", "The algorithm for load balancing");
+DEFINE_int32(timeout_ms, 1000, "RPC timeout in milliseconds");
+DEFINE_int32(max_retry, 0, "Max retries(not including the first RPC)");
+DEFINE_string(mode, "closed", "closed: each bthread waits for its reply before sending "
+              "again, open: send at -qps");
+DEFINE_int32(thread_num, 50, "Sending bthreads");
+DEFINE_int32(qps, 10000, "Requests per second of open loop");
+DEFINE_int32(max_inflight, 10000, "Requests in flight of open loop, sends beyond are dropped");
+DEFINE_int32(user_num, 100000, "User ids are picked from [1, user_num]");
+DEFINE_double(zipf_s, 0.99, "Exponent of the Zipf distribution of user ids, 0 is uniform");
+DEFINE_double(group_ratio, 0.1, "Ratio of group messages, the others are private");
+DEFINE_int32(group_size, 500, "Users of a group message, first one is sender");
+DEFINE_int32(each_request_msgid_num, 1, "Each request msgid num of every user");
+DEFINE_int32(warmup_s, 5, "Seconds before measuring");
+DEFINE_int32(duration_s, 30, "Seconds to measure, 0 means until asked to quit");
+
+namespace {
+
+// Log-linear histogram of latencies in us, 64 sub-buckets for each power of
+// 2 so the error is below 2%.
+class Histogram {
+ public:
+  void Add(int64_t us){
+    counts_[Index(std::max<int64_t>(us, 0))].fetch_add(1, std::memory_order_relaxed);
+  }
+
+  int64_t Percentile(double ratio) const {
+    int64_t total = 0;
+    for (const auto& count : counts_){
+      total += count.load(std::memory_order_relaxed);
+    }
+    const int64_t rank = std::ceil(total * ratio);
+    int64_t seen = 0;
+    for (int i = 0; i < kBucketNum; ++i){
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen >= rank && seen > 0){
+        return Upper(i);
+      }
+    }
+    return 0;
+  }
+
+ private:
+  enum { kSubBits = 6, kSub = 1 << kSubBits, kBucketNum = (64 - kSubBits + 1) * kSub };
+
+  static int Index(int64_t us){
+    if (us < kSub){
+      return us;
+    }
+    const int shift = 63 - __builtin_clzll(us) - kSubBits;
+    return (shift + 1) * kSub + ((us >> shift) - kSub);
+  }
+
+  static int64_t Upper(int index){
+    if (index < kSub){
+      return index;
+    }
+    const int shift = index / kSub - 1;
+    return ((index % kSub + kSub + 1) << shift) - 1;
+  }
+
+  std::atomic<int64_t> counts_[kBucketNum] = {};
+};
+
+// Inverse CDF sampling of Zipf ranks, rank r has weight 1/r^s.
+class ZipfUsers {
+ public:
+  ZipfUsers(int user_num, double s): cdf_(user_num) {
+    double sum = 0;
+    for (int i = 0; i < user_num; ++i){
+      sum += 1.0 / std::pow(i + 1, s);
+      cdf_[i] = sum;
+    }
+    for (auto& p : cdf_){
+      p /= sum;
+    }
+  }
+
+  int64_t Next() const {
+    const double p = butil::fast_rand_double();
+    return std::lower_bound(cdf_.begin(), cdf_.end(), p) - cdf_.begin() + 1;
+  }
+
+ private:
+  std::vector<double> cdf_;
+};
+
+ZipfUsers* g_users = nullptr;
+std::atomic<bool> g_measuring(false);
+Histogram g_histogram;
+bvar::Adder<int64_t> g_request_count("idgen_bench_request_count");
+bvar::Adder<int64_t> g_id_count("idgen_bench_id_count");
+bvar::Adder<int64_t> g_error_count("idgen_bench_error_count");
+bvar::Adder<int64_t> g_dropped_count("idgen_bench_dropped_count");
+bvar::LatencyRecorder g_latency_recorder("idgen_bench_client");
+std::atomic<int> g_inflight(0);
+
+void BuildRequest(tinyim::MsgIdRequest* request){
+  const bool group = butil::fast_rand_double() < FLAGS_group_ratio;
+  const int size = group ? FLAGS_group_size : 2;
+  for (int i = 0; i < size; ++i){
+    auto user_and_id_num = request->add_user_ids();
+    user_and_id_num->set_user_id(g_users->Next());
+    user_and_id_num->set_need_msgid_num(FLAGS_each_request_msgid_num);
+  }
+}
+
+void Record(const brpc::Controller& cntl, int64_t latency_us, int user_num){
+  if (cntl.Failed()){
+    g_error_count << 1;
+    LOG_EVERY_SECOND(WARNING) << cntl.ErrorText();
+    return;
+  }
+  g_latency_recorder << latency_us;
+  if (g_measuring.load(std::memory_order_relaxed)){
+    g_histogram.Add(latency_us);
+    g_request_count << 1;
+    g_id_count << int64_t{user_num} * FLAGS_each_request_msgid_num;
+  }
+}
+
+void* ClosedLoopSender(void* arg){
+  auto channel = static_cast<brpc::Channel*>(arg);
+  tinyim::IdGenService_Stub stub(channel);
+
+  while (!brpc::IsAskedToQuit()) {
+    tinyim::MsgIdRequest request;
+    tinyim::MsgIdReply reply;
+    brpc::Controller cntl;
+    BuildRequest(&request);
+    stub.IdGenerate(&cntl, &request, &reply, nullptr);
+    Record(cntl, cntl.latency_us(), request.user_ids_size());
+    if (cntl.Failed()){
+      bthread_usleep(50000);
+    }
+  }
+  return nullptr;
+}
+
+struct OpenLoopCall {
+  brpc::Controller cntl;
+  tinyim::MsgIdRequest request;
+  tinyim::MsgIdReply reply;
+  int64_t scheduled_us;
+};
+
+void OnOpenLoopDone(OpenLoopCall* call){
+  // from the scheduled time, so a slow idgen cannot hide queueing delay
+  Record(call->cntl, butil::gettimeofday_us() - call->scheduled_us, call->request.user_ids_size());
+  g_inflight.fetch_sub(1, std::memory_order_relaxed);
+  delete call;
+}
+
+void* OpenLoopSender(void* arg){
+  auto channel = static_cast<brpc::Channel*>(arg);
+  tinyim::IdGenService_Stub stub(channel);
+  const double interval_us = 1000000.0 * FLAGS_thread_num / std::max(FLAGS_qps, 1);
+
+  double scheduled_us = butil::gettimeofday_us();
+  while (!brpc::IsAskedToQuit()) {
+    scheduled_us += interval_us;
+    const int64_t wait_us = static_cast<int64_t>(scheduled_us) - butil::gettimeofday_us();
+    if (wait_us > 0){
+      bthread_usleep(wait_us);
+    }
+    if (g_inflight.fetch_add(1, std::memory_order_relaxed) >= FLAGS_max_inflight){
+      g_inflight.fetch_sub(1, std::memory_order_relaxed);
+      g_dropped_count << 1;
+      continue;
+    }
+    auto call = new OpenLoopCall;
+    call->scheduled_us = static_cast<int64_t>(scheduled_us);
+    BuildRequest(&call->request);
+    stub.IdGenerate(&call->cntl, &call->request, &call->reply,
+                    brpc::NewCallback(OnOpenLoopDone, call));
+  }
+  return nullptr;
+}
+
+// Value of bvar `name' on the server through its builtin /vars page, -1 if
+// not available.
+int64_t GetServerVar(const std::string& name){
+  brpc::ChannelOptions options;
+  options.protocol = brpc::PROTOCOL_HTTP;
+  brpc::Channel channel;
+  if (channel.Init(FLAGS_server.c_str(), &options) != 0){
+    return -1;
+  }
+  brpc::Controller cntl;
+  cntl.http_request().uri() = "/vars/" + name;
+  channel.CallMethod(nullptr, &cntl, nullptr, nullptr, nullptr);
+  if (cntl.Failed()){
+    LOG(WARNING) << "Fail to get " << name << ". " << cntl.ErrorText();
+    return -1;
+  }
+  // "name : value"
+  const std::string body = cntl.response_attachment().to_string();
+  const size_t pos = body.rfind(':');
+  return pos == std::string::npos ? -1 : strtoll(body.c_str() + pos + 1, nullptr, 10);
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  const bool open_loop = FLAGS_mode == "open";
+  if (!open_loop && FLAGS_mode != "closed"){
+    LOG(ERROR) << "Unknown mode=" << FLAGS_mode;
+    return -1;
+  }
+  ZipfUsers users(FLAGS_user_num, FLAGS_zipf_s);
+  g_users = &users;
+
+  brpc::ChannelOptions options;
+  options.protocol = FLAGS_protocol;
+  options.connection_type = FLAGS_connection_type;
+  options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
+  options.max_retry = FLAGS_max_retry;
+  brpc::Channel channel;
+  if (channel.Init(FLAGS_server.c_str(), FLAGS_load_balancer.c_str(), &options) != 0) {
+      LOG(ERROR) << "Fail to initialize channel";
+      return -1;
+  }
+
+  std::vector<bthread_t> bids(FLAGS_thread_num);
+  for (int i = 0; i < FLAGS_thread_num; ++i){
+    if (bthread_start_background(&bids[i], nullptr,
+                                 open_loop ? OpenLoopSender : ClosedLoopSender, &channel) != 0){
+      LOG(ERROR) << "Fail to create bthread";
+      return -1;
+    }
+  }
+
+  for (int second = 1; second <= FLAGS_warmup_s && !brpc::IsAskedToQuit(); ++second){
+    sleep(1);
+    LOG(INFO) << "Warming up qps=" << g_latency_recorder.qps(1)
+              << " latency=" << g_latency_recorder.latency(1) << "us";
+  }
+
+  const int64_t start_fsync_count = GetServerVar("idgen_fsync_count");
+  butil::Timer timer;
+  timer.start();
+  g_measuring.store(true);
+  for (int second = 1; !brpc::IsAskedToQuit(); ++second){
+    sleep(1);
+    LOG(INFO) << "Sending IdGenerate qps=" << g_latency_recorder.qps(1)
+              << " latency=" << g_latency_recorder.latency(1) << "us"
+              << " inflight=" << g_inflight.load()
+              << " error=" << g_error_count.get_value()
+              << " dropped=" << g_dropped_count.get_value();
+    if (FLAGS_duration_s > 0 && second >= FLAGS_duration_s){
+      break;
+    }
+  }
+  g_measuring.store(false);
+  timer.stop();
+  const int64_t end_fsync_count = GetServerVar("idgen_fsync_count");
+
+  const double seconds = timer.u_elapsed(1) / 1000000.0;
+  const int64_t requests = g_request_count.get_value();
+  std::string fsync_second = "n/a";
+  if (start_fsync_count >= 0 && end_fsync_count >= 0){
+    fsync_second = std::to_string(static_cast<int64_t>((end_fsync_count - start_fsync_count) / seconds));
+  }
+  LOG(INFO) << "IdGenerate summary mode=" << FLAGS_mode
+            << " thread_num=" << FLAGS_thread_num
+            << (open_loop ? " target_qps=" + std::to_string(FLAGS_qps) : "")
+            << " zipf_s=" << FLAGS_zipf_s
+            << " group_ratio=" << FLAGS_group_ratio
+            << " group_size=" << FLAGS_group_size
+            << " qps=" << static_cast<int64_t>(requests / seconds)
+            << " ids/s=" << static_cast<int64_t>(g_id_count.get_value() / seconds)
+            << " p50=" << g_histogram.Percentile(0.5) << "us"
+            << " p99=" << g_histogram.Percentile(0.99) << "us"
+            << " p999=" << g_histogram.Percentile(0.999) << "us"
+            << " max=" << g_histogram.Percentile(1) << "us"
+            << " fsync/s=" << fsync_second
+            << " error=" << g_error_count.get_value()
+            << " dropped=" << g_dropped_count.get_value();
+  brpc::AskToQuit();
+  for (int i = 0; i < FLAGS_thread_num; ++i){
+    bthread_join(bids[i], nullptr);
+  }
+  // let open loop calls in flight finish before their channel goes away
+  while (g_inflight.load() > 0){
+    bthread_usleep(10000);
+  }
+  return 0;
+}
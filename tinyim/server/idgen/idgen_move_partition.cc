@@ -0,0 +1,62 @@
+#include <gflags/gflags.h>
+#include <butil/logging.h>
+#include <brpc/channel.h>
+
+#include "idgen.pb.h"
+#include "util/initialize.h"
+
+// Move a partition between idgen nodes. The old owner stops serving it and
+// exports the high-water marks of its users, the new owner persists them and
+// serves the partition above them, so no id is handed out twice. Add the
+// partition to -idgen_partition_moves of logic and idgen afterwards so that
+// requests are routed to the new owner and restarts keep the placement.
+
+DEFINE_string(from, "127.0.0.1:8000", "Idgen node owning the partition");
+DEFINE_string(to, "127.0.0.1:8001", "Idgen node taking over the partition");
+DEFINE_int32(partition, -1, "Partition to move");
+DEFINE_int32(timeout_ms, 30000, "RPC timeout in milliseconds");
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  brpc::ChannelOptions options;
+  options.protocol = brpc::PROTOCOL_BAIDU_STD;
+  options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
+  // not idempotent, a retried export or import may hit a changed partition
+  options.max_retry = 0;
+  brpc::Channel from_channel;
+  brpc::Channel to_channel;
+  if (from_channel.Init(FLAGS_from.c_str(), &options) != 0
+      || to_channel.Init(FLAGS_to.c_str(), &options) != 0) {
+      LOG(ERROR) << "Fail to initialize channel";
+      return -1;
+  }
+
+  tinyim::Partition partition;
+  partition.set_partition(FLAGS_partition);
+  tinyim::PartitionHwms hwms;
+  brpc::Controller export_cntl;
+  tinyim::IdGenService_Stub from_stub(&from_channel);
+  from_stub.ExportPartition(&export_cntl, &partition, &hwms, nullptr);
+  if (export_cntl.Failed()) {
+    LOG(ERROR) << "Fail to export partition=" << FLAGS_partition << " from " << FLAGS_from
+               << ". " << export_cntl.ErrorText();
+    return -1;
+  }
+  LOG(INFO) << "Exported partition=" << FLAGS_partition << " user_num=" << hwms.hwms_size();
+
+  tinyim::PartitionReply reply;
+  brpc::Controller import_cntl;
+  tinyim::IdGenService_Stub to_stub(&to_channel);
+  to_stub.ImportPartition(&import_cntl, &hwms, &reply, nullptr);
+  if (import_cntl.Failed()) {
+    // the partition is served by neither node now, retry the import with
+    // the same marks, exporting again would return them as well
+    LOG(ERROR) << "Fail to import partition=" << FLAGS_partition << " to " << FLAGS_to
+               << ". " << import_cntl.ErrorText();
+    return -1;
+  }
+  LOG(INFO) << "Moved partition=" << FLAGS_partition << " from " << FLAGS_from
+            << " to " << FLAGS_to << " user_num=" << reply.user_num();
+  return 0;
+}
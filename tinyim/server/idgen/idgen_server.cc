@@ -2,6 +2,8 @@
 #include "idgen/idgen.h"
 #include "idgen.pb.h"
 
+#include <vector>
+
 #include <brpc/server.h>
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -39,26 +41,101 @@ class IdGenServiceImpl final : public IdGenService {
 
     // cntl->response_attachment().append(cntl->request_attachment());
 
-    for (int i = 0; i < request->user_ids_size(); ++i){
-        const int64_t user_id = request->user_ids(i).user_id();
-        const int64_t need_msgid_num = request->user_ids(i).need_msgid_num();
-        int64_t start_msgid = 0;
-        auto status = id_gen_->IdGenerate(user_id, need_msgid_num, start_msgid);
-        if (status.ok()){
-          auto pmsg_id = response->add_msg_ids();
-          pmsg_id->set_user_id(user_id);
-          pmsg_id->set_start_msg_id(start_msgid);
-          pmsg_id->set_msg_id_num(need_msgid_num);
-          LOG(INFO) << "Replying userid=" << user_id
-                    << " start_msg_id=" << start_msgid
-                    << " need_msgid_num=" << need_msgid_num;
-        }
-        else{
-          cntl->SetFailed(status.ToString());
-          return;
-        }
+    const int size = request->user_ids_size();
+    std::vector<IdRange> ranges(size);
+    for (int i = 0; i < size; ++i){
+      ranges[i].user_id = request->user_ids(i).user_id();
+      ranges[i].need_msgid_num = request->user_ids(i).need_msgid_num();
+      ranges[i].start_msgid = 0;
+    }
+    auto status = id_gen_->BatchIdGenerate(ranges.data(), size);
+    if (!status.ok()){
+      cntl->SetFailed(status.ToString());
+      return;
+    }
+    for (int i = 0; i < size; ++i){
+      auto pmsg_id = response->add_msg_ids();
+      pmsg_id->set_user_id(ranges[i].user_id);
+      pmsg_id->set_start_msg_id(ranges[i].start_msgid);
+      pmsg_id->set_msg_id_num(ranges[i].need_msgid_num);
+      if (ranges[i].skipped_start_msgid > 0){
+        auto pskipped = pmsg_id->add_skipped_ranges();
+        pskipped->set_user_id(ranges[i].user_id);
+        pskipped->set_start_msg_id(ranges[i].skipped_start_msgid);
+        pskipped->set_end_msg_id(ranges[i].skipped_end_msgid);
+      }
+      DLOG(INFO) << "Replying userid=" << ranges[i].user_id
+                 << " start_msg_id=" << ranges[i].start_msgid
+                 << " need_msgid_num=" << ranges[i].need_msgid_num;
     }
   }
+
+  virtual void ReturnIds(google::protobuf::RpcController* cntl_base,
+                         const MsgIdReply* request,
+                         ReturnIdsReply* response,
+                         google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+
+    const int size = request->msg_ids_size();
+    std::vector<IdRange> ranges(size);
+    for (int i = 0; i < size; ++i){
+      ranges[i].user_id = request->msg_ids(i).user_id();
+      ranges[i].need_msgid_num = request->msg_ids(i).msg_id_num();
+      ranges[i].start_msgid = request->msg_ids(i).start_msg_id();
+    }
+    response->set_returned_num(id_gen_->ReturnIds(ranges.data(), size));
+    DLOG(INFO) << "Returned " << response->returned_num() << " of " << size << " ranges";
+  }
+
+  virtual void ExportPartition(google::protobuf::RpcController* cntl_base,
+                               const Partition* request,
+                               PartitionHwms* response,
+                               google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    brpc::Controller* cntl =
+        static_cast<brpc::Controller*>(cntl_base);
+
+    LOG(INFO) << "Exporting partition=" << request->partition()
+              << " to " << cntl->remote_side();
+    std::vector<HwmUpdate> hwms;
+    auto status = id_gen_->ExportPartition(request->partition(), &hwms);
+    if (!status.ok()){
+      cntl->SetFailed(status.ToString());
+      return;
+    }
+    response->set_partition(request->partition());
+    for (const auto& hwm : hwms){
+      auto phwm = response->add_hwms();
+      phwm->set_user_id(hwm.user_id);
+      phwm->set_max_msg_id(hwm.max_id);
+    }
+  }
+
+  virtual void ImportPartition(google::protobuf::RpcController* cntl_base,
+                               const PartitionHwms* request,
+                               PartitionReply* response,
+                               google::protobuf::Closure* done) {
+    brpc::ClosureGuard done_guard(done);
+    brpc::Controller* cntl =
+        static_cast<brpc::Controller*>(cntl_base);
+
+    LOG(INFO) << "Importing partition=" << request->partition()
+              << " from " << cntl->remote_side()
+              << " user_num=" << request->hwms_size();
+    std::vector<HwmUpdate> hwms(request->hwms_size());
+    for (int i = 0; i < request->hwms_size(); ++i){
+      hwms[i].user_id = request->hwms(i).user_id();
+      hwms[i].max_id = request->hwms(i).max_msg_id();
+    }
+    auto status = id_gen_->ImportPartition(request->partition(), hwms);
+    if (!status.ok()){
+      cntl->SetFailed(status.ToString());
+      return;
+    }
+    response->set_partition(request->partition());
+    response->set_user_num(request->hwms_size());
+  }
+
  private:
   IdGen * id_gen_;
 };
@@ -86,6 +163,7 @@ int main(int argc, char* argv[]) {
       return -1;
   }
   server.RunUntilAskedToQuit();
+  tinyim::IdGen::Default()->Stop();
 
   return 0;
 }
@@ -0,0 +1,76 @@
+#include "idgen/hwm_store.h"
+
+#include <memory>
+#include <string>
+
+#include <glog/logging.h>
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+
+namespace tinyim {
+
+namespace {
+
+class LevelDbHwmStore final : public HwmStore {
+ public:
+  explicit LevelDbHwmStore(leveldb::DB* db): db_(db) {}
+
+  virtual leveldb::Status Get(int64_t user_id, int64_t* max_id) override {
+    std::string db_id;
+    auto status = db_->Get(leveldb::ReadOptions(), leveldb::Slice(std::to_string(user_id)), &db_id);
+    if (status.ok()){
+      DLOG(INFO) << "user_id=" << user_id << " db_id" << db_id;
+      *max_id = std::stoll(db_id);
+    }
+    else if (status.IsNotFound()){
+      DLOG(INFO) << "user_id=" << user_id << " not found";
+      *max_id = 0;
+      status = leveldb::Status::OK();
+    }
+    return status;
+  }
+
+  virtual leveldb::Status Write(const std::vector<HwmUpdate>& updates) override {
+    leveldb::WriteBatch batch;
+    for (const auto& update : updates){
+      batch.Put(std::to_string(update.user_id), std::to_string(update.max_id));
+    }
+    auto write_options = leveldb::WriteOptions();
+    write_options.sync = true;
+    return db_->Write(write_options, &batch);
+  }
+
+  virtual leveldb::Status ForEach(const std::function<void(int64_t, int64_t)>& fn) override {
+    std::unique_ptr<leveldb::Iterator> iter(db_->NewIterator(leveldb::ReadOptions()));
+    for (iter->SeekToFirst(); iter->Valid(); iter->Next()){
+      const int64_t user_id = std::stoll(iter->key().ToString());
+      if (user_id > 0){
+        fn(user_id, std::stoll(iter->value().ToString()));
+      }
+    }
+    return iter->status();
+  }
+
+  virtual ~LevelDbHwmStore(){
+    delete db_;
+  }
+
+ private:
+  leveldb::DB* db_;
+};
+
+}  // namespace
+
+leveldb::Status HwmStore::OpenLevelDb(const std::string& path, std::unique_ptr<HwmStore>* store){
+  leveldb::Options options;
+  options.create_if_missing = true;
+
+  leveldb::DB* db = nullptr;
+  auto status = leveldb::DB::Open(options, path, &db);
+  if (status.ok()){
+    store->reset(new LevelDbHwmStore(db));
+  }
+  return status;
+}
+
+}  // namespace tinyim
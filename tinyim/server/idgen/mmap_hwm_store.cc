@@ -0,0 +1,308 @@
+#include "idgen/hwm_store.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#include <butil/files/file_path.h>
+#include <butil/files/file_util.h>
+#include <butil/synchronization/lock.h>
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+
+DEFINE_int64(idgen_mmap_capacity, 1 << 20, "Initial record number of the mmap high-water "
+             "mark file, doubled when half full");
+DEFINE_bool(idgen_mmap_msync, true, "Sync dirty pages of the mmap high-water mark file with "
+            "msync, otherwise fdatasync the whole file");
+
+namespace tinyim {
+
+namespace {
+
+const char kMagic[8] = {'T', 'I', 'M', 'H', 'W', 'M', '0', '1'};
+const size_t kPageSize = 4096;
+
+// The first page of the file, records follow it.
+struct Header {
+  char magic[8];
+  uint64_t capacity;  // record number, power of 2
+  uint64_t size;      // used records
+};
+
+// user_id 0 means empty, negative ones are fences. Both fields are 8-byte aligned so an update is
+// never torn, and a record never spans two pages.
+struct Record {
+  int64_t user_id;
+  int64_t max_id;
+};
+
+leveldb::Status IOError(const std::string& context){
+  return leveldb::Status::IOError(context, strerror(errno));
+}
+
+class MmapHwmStore final : public HwmStore {
+ public:
+  explicit MmapHwmStore(const std::string& path): path_(path),
+                                                  fd_(-1),
+                                                  base_(nullptr),
+                                                  map_size_(0) {}
+
+  leveldb::Status Open(){
+    if (!butil::CreateDirectory(butil::FilePath(path_).DirName())){
+      return IOError(path_);
+    }
+    const int fd = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0){
+      return IOError(path_);
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0){
+      ::close(fd);
+      return IOError(path_);
+    }
+    if (st.st_size == 0){
+      uint64_t capacity = 1;
+      while (capacity < static_cast<uint64_t>(std::max<int64_t>(FLAGS_idgen_mmap_capacity, 1))){
+        capacity <<= 1;
+      }
+      return Create(fd, capacity);
+    }
+
+    auto status = Map(fd, st.st_size);
+    if (!status.ok()){
+      return status;
+    }
+    if (memcmp(header()->magic, kMagic, sizeof(kMagic)) != 0
+        || header()->capacity == 0 || (header()->capacity & (header()->capacity - 1)) != 0
+        || MapSize(header()->capacity) != map_size_){
+      return leveldb::Status::Corruption(path_, "bad header");
+    }
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status Get(int64_t user_id, int64_t* max_id) override {
+    std::unique_lock<butil::Mutex> ul(mutex_);
+    bool found = false;
+    Record* record = Probe(user_id, &found);
+    *max_id = found ? record->max_id : 0;
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status Write(const std::vector<HwmUpdate>& updates) override {
+    // one writer at a time, so the mapping only changes under write_mutex_
+    std::unique_lock<butil::Mutex> write_lock(write_mutex_);
+    std::vector<size_t> dirty_pages;
+    bool full_sync = !FLAGS_idgen_mmap_msync;
+    {
+      std::unique_lock<butil::Mutex> ul(mutex_);
+      for (const auto& update : updates){
+        DCHECK_NE(update.user_id, 0);
+        bool found = false;
+        Record* record = Probe(update.user_id, &found);
+        if (!found && (record == nullptr || (header()->size + 1) * 2 > header()->capacity)){
+          auto status = Grow();
+          if (!status.ok()){
+            return status;
+          }
+          // remapped, page offsets collected so far are stale
+          full_sync = true;
+          record = Probe(update.user_id, &found);
+        }
+        record->max_id = update.max_id;
+        if (!found){
+          record->user_id = update.user_id;
+          ++header()->size;
+          dirty_pages.push_back(0);
+        }
+        dirty_pages.push_back((reinterpret_cast<char*>(record) - base_) / kPageSize);
+      }
+    }
+
+    if (full_sync){
+      if (::fdatasync(fd_) != 0){
+        return IOError(path_);
+      }
+      return leveldb::Status::OK();
+    }
+    // msync each run of adjacent dirty pages
+    std::sort(dirty_pages.begin(), dirty_pages.end());
+    dirty_pages.erase(std::unique(dirty_pages.begin(), dirty_pages.end()), dirty_pages.end());
+    for (size_t i = 0; i < dirty_pages.size();){
+      size_t j = i + 1;
+      while (j < dirty_pages.size() && dirty_pages[j] == dirty_pages[j - 1] + 1){
+        ++j;
+      }
+      if (::msync(base_ + dirty_pages[i] * kPageSize, (j - i) * kPageSize, MS_SYNC) != 0){
+        return IOError(path_);
+      }
+      i = j;
+    }
+    return leveldb::Status::OK();
+  }
+
+  virtual leveldb::Status ForEach(const std::function<void(int64_t, int64_t)>& fn) override {
+    std::unique_lock<butil::Mutex> ul(mutex_);
+    for (uint64_t i = 0; i < header()->capacity; ++i){
+      if (records()[i].user_id > 0){
+        fn(records()[i].user_id, records()[i].max_id);
+      }
+    }
+    return leveldb::Status::OK();
+  }
+
+  virtual ~MmapHwmStore(){
+    Unmap();
+  }
+
+ private:
+  static size_t MapSize(uint64_t capacity){
+    return kPageSize + capacity * sizeof(Record);
+  }
+
+  Header* header() const {
+    return reinterpret_cast<Header*>(base_);
+  }
+
+  Record* records() const {
+    return reinterpret_cast<Record*>(base_ + kPageSize);
+  }
+
+  // The record of `user_id' if found, else the empty record to insert it
+  // into, nullptr if the table is full. Must hold mutex_.
+  Record* Probe(int64_t user_id, bool* found) const {
+    const uint64_t mask = header()->capacity - 1;
+    uint64_t index = (static_cast<uint64_t>(user_id) * 0x9E3779B97F4A7C15ULL) >> 17;
+    for (uint64_t i = 0; i <= mask; ++i, ++index){
+      Record* record = &records()[index & mask];
+      if (record->user_id == user_id){
+        *found = true;
+        return record;
+      }
+      if (record->user_id == 0){
+        *found = false;
+        return record;
+      }
+    }
+    *found = false;
+    return nullptr;
+  }
+
+  // Build a new file with twice the capacity next to the current one, sync
+  // it and rename it over, so a crash leaves either file complete.
+  // Must hold mutex_.
+  leveldb::Status Grow(){
+    const uint64_t old_capacity = header()->capacity;
+    const Record* old_records = records();
+    const std::string tmp_path = path_ + ".tmp";
+    LOG(INFO) << "Growing " << path_ << " to capacity=" << old_capacity * 2;
+
+    const int fd = ::open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0){
+      return IOError(tmp_path);
+    }
+    MmapHwmStore grown(tmp_path);
+    auto status = grown.Create(fd, old_capacity * 2);
+    if (!status.ok()){
+      return status;
+    }
+    for (uint64_t i = 0; i < old_capacity; ++i){
+      if (old_records[i].user_id != 0){
+        bool found = false;
+        Record* record = grown.Probe(old_records[i].user_id, &found);
+        *record = old_records[i];
+        ++grown.header()->size;
+      }
+    }
+    if (::fdatasync(grown.fd_) != 0){
+      return IOError(tmp_path);
+    }
+    if (::rename(tmp_path.c_str(), path_.c_str()) != 0){
+      return IOError(tmp_path);
+    }
+    const std::string dir = butil::FilePath(path_).DirName().value();
+    const int dir_fd = ::open(dir.c_str(), O_RDONLY);
+    if (dir_fd < 0){
+      return IOError(dir);
+    }
+    const int ret = ::fsync(dir_fd);
+    ::close(dir_fd);
+    if (ret != 0){
+      return IOError(dir);
+    }
+
+    Unmap();
+    std::swap(fd_, grown.fd_);
+    std::swap(base_, grown.base_);
+    std::swap(map_size_, grown.map_size_);
+    return leveldb::Status::OK();
+  }
+
+  // Size an empty file for `capacity' records and write its header.
+  leveldb::Status Create(int fd, uint64_t capacity){
+    if (::ftruncate(fd, MapSize(capacity)) != 0){
+      ::close(fd);
+      return IOError(path_);
+    }
+    auto status = Map(fd, MapSize(capacity));
+    if (!status.ok()){
+      return status;
+    }
+    memcpy(header()->magic, kMagic, sizeof(kMagic));
+    header()->capacity = capacity;
+    header()->size = 0;
+    if (::fdatasync(fd_) != 0){
+      return IOError(path_);
+    }
+    return leveldb::Status::OK();
+  }
+
+  // Take over `fd' and map `size' bytes of it.
+  leveldb::Status Map(int fd, size_t size){
+    fd_ = fd;
+    void* base = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED){
+      return IOError(path_);
+    }
+    base_ = static_cast<char*>(base);
+    map_size_ = size;
+    return leveldb::Status::OK();
+  }
+
+  void Unmap(){
+    if (base_ != nullptr){
+      ::munmap(base_, map_size_);
+      base_ = nullptr;
+    }
+    if (fd_ >= 0){
+      ::close(fd_);
+      fd_ = -1;
+    }
+  }
+
+  const std::string path_;
+  int fd_;
+  char* base_;
+  size_t map_size_;
+  butil::Mutex mutex_;        // protects records and the mapping
+  butil::Mutex write_mutex_;  // serializes Write
+};
+
+}  // namespace
+
+leveldb::Status HwmStore::OpenMmap(const std::string& path, std::unique_ptr<HwmStore>* store){
+  std::unique_ptr<MmapHwmStore> mmap_store(new MmapHwmStore(path));
+  auto status = mmap_store->Open();
+  if (status.ok()){
+    store->reset(mmap_store.release());
+  }
+  return status;
+}
+
+}  // namespace tinyim
@@ -0,0 +1,103 @@
+#include "logic/access_registry.h"
+
+#include <mutex>
+#include <utility>
+
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+#include <glog/logging.h>
+
+namespace {
+
+bvar::Adder<int64_t> g_access_count("logic_access_count");
+bvar::Adder<int64_t> g_background_register_count("logic_access_background_register_count");
+
+}  // namespace
+
+namespace tinyim {
+
+AccessRegistry::AccessRegistry(const brpc::ChannelOptions& options): options_(options) {}
+
+int32_t AccessRegistry::Find(const std::string& addr){
+  butil::DoublyBufferedData<Accesses>::ScopedPtr ptr;
+  if (accesses_.Read(&ptr) != 0){
+    return kNoAccess;
+  }
+  auto iter = ptr->ids.find(addr);
+  return iter == ptr->ids.end() ? kNoAccess : iter->second;
+}
+
+int32_t AccessRegistry::Register(const std::string& addr){
+  const int32_t found = Find(addr);
+  if (found != kNoAccess){
+    return found;
+  }
+
+  // rare, once an access, registrations queue here and readers go on
+  std::unique_lock<butil::Mutex> ul(register_mutex_);
+  const int32_t registered = Find(addr);
+  if (registered != kNoAccess){
+    return registered;
+  }
+  std::unique_ptr<brpc::Channel> channel(new brpc::Channel);
+  if (channel->Init(addr.c_str(), &options_) != 0){
+    LOG(ERROR) << "Fail to initialize channel to access " << addr;
+    return kNoAccess;
+  }
+  brpc::Channel* const raw_channel = channel.get();
+  owned_channels_.push_back(std::move(channel));
+  const int32_t id = owned_channels_.size() - 1;
+  // applied to both copies, the second after readers leave the first
+  auto add = [&](Accesses& accesses) -> size_t {
+    accesses.ids[addr] = id;
+    accesses.channels.push_back(raw_channel);
+    return 1;
+  };
+  accesses_.Modify(add);
+  g_access_count << 1;
+  LOG(INFO) << "Registered access " << addr << " as id=" << id;
+  return id;
+}
+
+void AccessRegistry::RegisterInBackground(const std::string& addr){
+  {
+    std::unique_lock<butil::Mutex> ul(pending_mutex_);
+    if (!pending_addrs_.insert(addr).second){
+      return;
+    }
+  }
+  g_background_register_count << 1;
+  auto args = new std::pair<AccessRegistry*, std::string>(this, addr);
+  auto run = [](void* arg) -> void* {
+    std::unique_ptr<std::pair<AccessRegistry*, std::string>> args(
+        static_cast<std::pair<AccessRegistry*, std::string>*>(arg));
+    AccessRegistry* const registry = args->first;
+    registry->Register(args->second);
+    std::unique_lock<butil::Mutex> ul(registry->pending_mutex_);
+    registry->pending_addrs_.erase(args->second);
+    return nullptr;
+  };
+  bthread_t bt;
+  if (bthread_start_background(&bt, nullptr, run, args) != 0){
+    LOG(ERROR) << "Fail to start bthread registering access " << addr;
+    delete args;
+    std::unique_lock<butil::Mutex> ul(pending_mutex_);
+    pending_addrs_.erase(addr);
+  }
+}
+
+void AccessRegistry::GetChannels(const std::vector<int32_t>& ids,
+                                 std::vector<brpc::Channel*>* channels){
+  channels->assign(ids.size(), nullptr);
+  butil::DoublyBufferedData<Accesses>::ScopedPtr ptr;
+  if (accesses_.Read(&ptr) != 0){
+    return;
+  }
+  for (size_t i = 0; i < ids.size(); ++i){
+    if (ids[i] >= 0 && static_cast<size_t>(ids[i]) < ptr->channels.size()){
+      (*channels)[i] = ptr->channels[ids[i]];
+    }
+  }
+}
+
+}  // namespace tinyim
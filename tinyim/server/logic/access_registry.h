@@ -0,0 +1,62 @@
+#ifndef TINYIM_LOGIC_ACCESS_REGISTRY_H_
+#define TINYIM_LOGIC_ACCESS_REGISTRY_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <brpc/channel.h>
+#include <butil/containers/doubly_buffered_data.h>
+#include <butil/synchronization/lock.h>
+
+namespace tinyim {
+
+// Channels to the accesses, each known by a small id. Accesses are
+// registered when a SessionChanged announces them, or in the background after
+// a fan-out meets one, and are never removed, so fan-outs only read and take
+// no lock shared with each other.
+class AccessRegistry {
+ public:
+  enum : int32_t { kNoAccess = -1 };
+
+  explicit AccessRegistry(const brpc::ChannelOptions& options);
+
+  AccessRegistry(const AccessRegistry&) = delete;
+  AccessRegistry& operator=(const AccessRegistry&) = delete;
+
+  // Id of access `addr', registered with a new channel if unknown,
+  // kNoAccess if the channel fails to initialize.
+  int32_t Register(const std::string& addr);
+
+  // Id of access `addr', kNoAccess if not registered yet. Takes no lock.
+  int32_t Find(const std::string& addr);
+
+  // Register `addr' in a background bthread, once however many ask meanwhile.
+  void RegisterInBackground(const std::string& addr);
+
+  // Channels of `ids' in the same order, nullptr for kNoAccess. They live as
+  // long as the registry.
+  void GetChannels(const std::vector<int32_t>& ids, std::vector<brpc::Channel*>* channels);
+
+ private:
+  struct Accesses {
+    std::unordered_map<std::string, int32_t> ids;
+    std::vector<brpc::Channel*> channels;  // by id
+  };
+
+  const brpc::ChannelOptions options_;
+  butil::DoublyBufferedData<Accesses> accesses_;
+
+  butil::Mutex register_mutex_;
+  std::vector<std::unique_ptr<brpc::Channel>> owned_channels_;
+
+  butil::Mutex pending_mutex_;
+  std::unordered_set<std::string> pending_addrs_;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_LOGIC_ACCESS_REGISTRY_H_
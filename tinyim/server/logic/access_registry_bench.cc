@@ -0,0 +1,165 @@
+#include <gflags/gflags.h>
+#include <brpc/channel.h>
+#include <bthread/bthread.h>
+#include <butil/fast_rand.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+
+#include <sys/resource.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "logic/access_registry.h"
+#include "util/initialize.h"
+
+// -thread_num bthreads each resolving the channels of -fanout receivers
+// spread over -access_num accesses, as SendtoPeers does for a msg, through
+// an address map behind one mutex (-mode=mutex, the old access_map_) or the
+// AccessRegistry by id (-mode=registry). A new access is registered every
+// -register_interval_ms to have writers among the readers. Channels are not
+// connected, only looked up.
+
+DEFINE_string(mode, "registry", "mutex: map of addresses behind a mutex, registry: AccessRegistry");
+DEFINE_int32(thread_num, 64, "Bthreads fanning out at once");
+DEFINE_int32(access_num, 32, "Accesses the receivers are on");
+DEFINE_int32(fanout, 200, "Receivers of each msg");
+DEFINE_int32(register_interval_ms, 100, "Register a new access this often, 0 for never");
+DEFINE_int32(duration_s, 10, "Seconds to run");
+
+namespace {
+
+std::atomic<int64_t> g_fanout_num(0);
+std::atomic<bool> g_stop(false);
+
+int64_t CpuUs(){
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L
+         + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+std::string AccessAddr(int index){
+  return "10.0." + std::to_string(index / 250) + "." + std::to_string(index % 250 + 1) + ":5000";
+}
+
+brpc::ChannelOptions Options(){
+  brpc::ChannelOptions options;
+  options.protocol = brpc::PROTOCOL_BAIDU_STD;
+  return options;
+}
+
+// What SendtoPeers did before the registry
+class MutexMap {
+ public:
+  brpc::Channel* Get(const std::string& addr){
+    std::unique_lock<std::mutex> lck(mutex_);
+    auto iter = map_.find(addr);
+    if (iter == map_.end()){
+      const brpc::ChannelOptions options = Options();
+      map_[addr].Init(addr.c_str(), &options);
+    }
+    return &map_[addr];
+  }
+
+  std::mutex& mutex() {
+    return mutex_;
+  }
+
+  std::unordered_map<std::string, brpc::Channel>& map() {
+    return map_;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::unordered_map<std::string, brpc::Channel> map_;
+};
+
+struct Context {
+  MutexMap mutex_map;
+  tinyim::AccessRegistry registry{Options()};
+  std::vector<std::string> addrs;
+  std::vector<int32_t> ids;
+};
+
+void* FanOut(void* arg){
+  auto ctx = static_cast<Context*>(arg);
+  std::vector<int32_t> ids(FLAGS_fanout);
+  std::vector<const std::string*> addrs(FLAGS_fanout);
+  std::vector<brpc::Channel*> channels;
+  while (!g_stop.load(std::memory_order_relaxed)){
+    for (int i = 0; i < FLAGS_fanout; ++i){
+      const int index = butil::fast_rand_less_than(FLAGS_access_num);
+      ids[i] = ctx->ids[index];
+      addrs[i] = &ctx->addrs[index];
+    }
+    if (FLAGS_mode == "mutex"){
+      channels.clear();
+      // the whole receiver loop under the lock, as it was
+      std::unique_lock<std::mutex> lck(ctx->mutex_map.mutex());
+      for (const std::string* addr : addrs){
+        channels.push_back(&ctx->mutex_map.map()[*addr]);
+      }
+    }
+    else {
+      ctx->registry.GetChannels(ids, &channels);
+    }
+    CHECK_EQ(channels.size(), static_cast<size_t>(FLAGS_fanout));
+    g_fanout_num.fetch_add(1, std::memory_order_relaxed);
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  Context ctx;
+  for (int i = 0; i < FLAGS_access_num; ++i){
+    ctx.addrs.push_back(AccessAddr(i));
+    ctx.mutex_map.Get(ctx.addrs.back());
+    ctx.ids.push_back(ctx.registry.Register(ctx.addrs.back()));
+  }
+
+  const int64_t start_cpu_us = CpuUs();
+  const int64_t start_us = butil::gettimeofday_us();
+  std::vector<bthread_t> tids(FLAGS_thread_num);
+  for (auto& tid : tids){
+    bthread_start_background(&tid, nullptr, FanOut, &ctx);
+  }
+  int registered_num = 0;
+  while (butil::gettimeofday_us() - start_us < FLAGS_duration_s * 1000000L){
+    if (FLAGS_register_interval_ms <= 0){
+      bthread_usleep(100000L);
+      continue;
+    }
+    bthread_usleep(FLAGS_register_interval_ms * 1000L);
+    // accesses no fan-out sends to, only writers
+    const std::string addr = AccessAddr(FLAGS_access_num + registered_num++);
+    if (FLAGS_mode == "mutex"){
+      ctx.mutex_map.Get(addr);
+    }
+    else {
+      ctx.registry.Register(addr);
+    }
+  }
+  const int64_t fanout_num = g_fanout_num.load();
+  const int64_t cpu_us = CpuUs() - start_cpu_us;
+  const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+
+  g_stop.store(true);
+  for (auto tid : tids){
+    bthread_join(tid, nullptr);
+  }
+
+  LOG(INFO) << FLAGS_mode << ": thread_num=" << FLAGS_thread_num
+            << " fanout=" << FLAGS_fanout
+            << " fanouts_per_s=" << fanout_num * 1000000 / elapsed_us
+            << " cpu_ns_per_fanout=" << (fanout_num == 0 ? 0 : cpu_us * 1000 / fanout_num)
+            << " registered=" << registered_num;
+  return 0;
+}
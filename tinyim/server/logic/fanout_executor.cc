@@ -0,0 +1,132 @@
+#include "logic/fanout_executor.h"
+
+#include <algorithm>
+#include <mutex>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+
+DEFINE_int32(logic_fanout_workers, 16, "Bthreads pushing msgs to accesses");
+DEFINE_int32(logic_fanout_chunk_size, 256, "Receivers of a msg pushed by one worker at a time");
+DEFINE_int32(logic_fanout_max_inflight, 1024, "Msgs being pushed at most, SendMsg waits beyond it");
+
+namespace {
+
+// from the msg saved to its last receiver pushed
+bvar::LatencyRecorder g_fanout_lag("logic_fanout_lag");
+bvar::Adder<int64_t> g_fanout_inflight("logic_fanout_inflight");
+bvar::Adder<int64_t> g_fanout_admit_wait_count("logic_fanout_admit_wait_count");
+bvar::IntRecorder g_fanout_chunk_num("logic_fanout_chunk_num");
+
+}  // namespace
+
+namespace tinyim {
+
+FanoutExecutor::FanoutExecutor(): inflight_(0), stopped_(false) {}
+
+FanoutExecutor::~FanoutExecutor() {
+  Stop();
+}
+
+int FanoutExecutor::Start(){
+  const int worker_num = std::max(FLAGS_logic_fanout_workers, 1);
+  for (int i = 0; i < worker_num; ++i){
+    bthread_t bt;
+    if (bthread_start_background(&bt, nullptr, RunWorker, this) != 0){
+      LOG(ERROR) << "Fail to start fan-out worker";
+      return -1;
+    }
+    workers_.push_back(bt);
+  }
+  return 0;
+}
+
+void FanoutExecutor::Stop(){
+  {
+    std::unique_lock<bthread::Mutex> lck(mutex_);
+    if (stopped_){
+      return;
+    }
+    stopped_ = true;
+    DLOG_IF(INFO, !chunks_.empty()) << "Drop " << chunks_.size() << " fan-out chunks";
+    chunk_cond_.notify_all();
+    admit_cond_.notify_all();
+  }
+  for (bthread_t bt : workers_){
+    bthread_join(bt, nullptr);
+  }
+  workers_.clear();
+}
+
+bool FanoutExecutor::Submit(std::shared_ptr<const FanoutJob> job, int64_t persisted_us){
+  const int size = job->size();
+  if (size == 0){
+    return true;
+  }
+  const int chunk_size = std::max(FLAGS_logic_fanout_chunk_size, 1);
+  const int chunk_num = (size + chunk_size - 1) / chunk_size;
+  auto pending = std::make_shared<Pending>();
+  pending->job = std::move(job);
+  pending->persisted_us = persisted_us;
+  pending->remaining.store(chunk_num, std::memory_order_relaxed);
+
+  std::unique_lock<bthread::Mutex> lck(mutex_);
+  if (inflight_ >= FLAGS_logic_fanout_max_inflight && !stopped_){
+    g_fanout_admit_wait_count << 1;
+    do {
+      admit_cond_.wait(lck);
+    } while (inflight_ >= FLAGS_logic_fanout_max_inflight && !stopped_);
+  }
+  if (stopped_){
+    return false;
+  }
+  ++inflight_;
+  g_fanout_inflight << 1;
+  g_fanout_chunk_num << chunk_num;
+  for (int begin = 0; begin < size; begin += chunk_size){
+    chunks_.push_back(Chunk{pending, begin, std::min(begin + chunk_size, size)});
+  }
+  if (chunk_num == 1){
+    chunk_cond_.notify_one();
+  }
+  else {
+    chunk_cond_.notify_all();
+  }
+  return true;
+}
+
+void* FanoutExecutor::RunWorker(void* arg){
+  auto self = static_cast<FanoutExecutor*>(arg);
+  std::unique_lock<bthread::Mutex> lck(self->mutex_);
+  while (true){
+    while (self->chunks_.empty() && !self->stopped_){
+      self->chunk_cond_.wait(lck);
+    }
+    if (self->stopped_){
+      break;
+    }
+    Chunk chunk = std::move(self->chunks_.front());
+    self->chunks_.pop_front();
+    lck.unlock();
+
+    chunk.pending->job->Run(chunk.begin, chunk.end);
+    const bool last = chunk.pending->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1;
+    if (last){
+      g_fanout_lag << butil::gettimeofday_us() - chunk.pending->persisted_us;
+      g_fanout_inflight << -1;
+    }
+    // the job is released out of the lock
+    chunk.pending.reset();
+
+    lck.lock();
+    if (last){
+      --self->inflight_;
+      self->admit_cond_.notify_one();
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace tinyim
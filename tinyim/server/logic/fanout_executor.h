@@ -0,0 +1,78 @@
+#ifndef TINYIM_LOGIC_FANOUT_EXECUTOR_H_
+#define TINYIM_LOGIC_FANOUT_EXECUTOR_H_
+
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <bthread/bthread.h>
+#include <bthread/condition_variable.h>
+#include <bthread/mutex.h>
+
+namespace tinyim {
+
+// Pushes of one msg to its receivers. Chunks of the receivers run on
+// several workers at once, so Run() only reads what the job holds.
+class FanoutJob {
+ public:
+  virtual ~FanoutJob() = default;
+
+  // Number of receivers
+  virtual int size() const = 0;
+
+  // Push the receivers in [begin, end)
+  virtual void Run(int begin, int end) const = 0;
+};
+
+// A fixed pool of -logic_fanout_workers bthreads pushing the msgs of all
+// senders. A job is split into chunks of -logic_fanout_chunk_size receivers
+// queued in order, a big group is pushed by many workers and the others
+// still get their turn. At most -logic_fanout_max_inflight jobs are queued
+// or running, Submit() waits for one to finish beyond that.
+class FanoutExecutor {
+ public:
+  FanoutExecutor();
+  ~FanoutExecutor();
+
+  FanoutExecutor(const FanoutExecutor&) = delete;
+  FanoutExecutor& operator=(const FanoutExecutor&) = delete;
+
+  int Start();
+
+  // Wake the workers and join them, chunks not started are dropped.
+  void Stop();
+
+  // Queue the chunks of `job', persisted at `persisted_us', the lag till
+  // its last chunk is pushed goes to bvar logic_fanout_lag. False if
+  // stopped.
+  bool Submit(std::shared_ptr<const FanoutJob> job, int64_t persisted_us);
+
+ private:
+  struct Pending {
+    std::shared_ptr<const FanoutJob> job;
+    int64_t persisted_us;
+    std::atomic<int> remaining;  // chunks not done
+  };
+
+  struct Chunk {
+    std::shared_ptr<Pending> pending;
+    int begin;
+    int end;
+  };
+
+  static void* RunWorker(void* arg);
+
+  bthread::Mutex mutex_;
+  bthread::ConditionVariable chunk_cond_;  // chunks_ not empty or stopped
+  bthread::ConditionVariable admit_cond_;  // a job finished or stopped
+  std::deque<Chunk> chunks_;
+  int inflight_;
+  bool stopped_;
+  std::vector<bthread_t> workers_;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_LOGIC_FANOUT_EXECUTOR_H_
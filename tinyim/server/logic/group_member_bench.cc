@@ -0,0 +1,254 @@
+#include "dbproxy/dbproxy.pb.h"
+
+#include <gflags/gflags.h>
+#include <brpc/channel.h>
+#include <brpc/closure_guard.h>
+#include <brpc/controller.h>
+#include <brpc/server.h>
+#include <bthread/bthread.h>
+#include <butil/fast_rand.h>
+#include <butil/logging.h>
+#include <butil/time.h>
+
+#include <sys/resource.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "logic/group_member_cache.h"
+#include "util/initialize.h"
+
+// Member lookups of group sends from -sender_num bthreads to -group_num
+// groups of -group_size members, asking an in-process dbproxy for all
+// members with names on each send (-mode=nocache, like -logic_group_cache
+// =false) or keeping them in a GroupMemberCache (-mode=cache). The dbproxy
+// answers after -db_latency_us and changes -change_per_s members a second.
+// For the whole SendMsg run logic_bench -group_id against logic with
+// -logic_group_cache on and off.
+
+DEFINE_string(mode, "cache", "cache: GroupMemberCache, nocache: GetGroupMembers on each send");
+DEFINE_int32(port, 6100, "Port of the dbproxy under test");
+DEFINE_int32(group_num, 10, "Groups sent to");
+DEFINE_int32(group_size, 10000, "Members of each group");
+DEFINE_int32(sender_num, 16, "Bthreads sending");
+DEFINE_int32(db_latency_us, 1000, "Latency injected by the dbproxy");
+DEFINE_int32(change_per_s, 10, "Joins and leaves of each group a second");
+DEFINE_int32(duration_s, 10, "Seconds to run");
+
+DECLARE_int32(logic_group_cache_refresh_ms);
+
+namespace {
+
+std::atomic<int64_t> g_send_num(0);
+std::atomic<int64_t> g_fail_num(0);
+std::atomic<int64_t> g_latency_us(0);
+std::atomic<bool> g_stop(false);
+
+int64_t CpuUs(){
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000L
+         + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+// group_id is the index of the group, its members are
+// [group_id * group_size, (group_id + 1) * group_size), a change flips one
+struct Group {
+  std::mutex mutex;
+  std::vector<bool> joined;
+  std::vector<std::pair<tinyim::user_id_t, bool>> changes;  // version is index + 1
+};
+
+class FakeDbproxyService : public tinyim::DbproxyService {
+ public:
+  FakeDbproxyService(): groups_(FLAGS_group_num) {
+    for (auto& group : groups_){
+      group.joined.assign(FLAGS_group_size, true);
+    }
+  }
+
+  void Change(){
+    for (size_t i = 0; i < groups_.size(); ++i){
+      Group& group = groups_[i];
+      std::unique_lock<std::mutex> lck(group.mutex);
+      // never the first member, who sends
+      const size_t index = butil::fast_rand_less_than(FLAGS_group_size - 1) + 1;
+      group.joined[index] = !group.joined[index];
+      group.changes.emplace_back(i * FLAGS_group_size + index, group.joined[index]);
+    }
+  }
+
+  void GetGroupMembers(google::protobuf::RpcController* controller,
+                       const tinyim::GroupId* group_id,
+                       tinyim::UserInfos* user_infos,
+                       google::protobuf::Closure* done) override {
+    brpc::ClosureGuard done_guard(done);
+    bthread_usleep(FLAGS_db_latency_us);
+    Group& group = groups_[group_id->group_id()];
+    std::unique_lock<std::mutex> lck(group.mutex);
+    for (int i = 0; i < FLAGS_group_size; ++i){
+      if (group.joined[i]){
+        const tinyim::user_id_t user_id = group_id->group_id() * FLAGS_group_size + i;
+        auto user_info = user_infos->add_user_info();
+        user_info->set_user_id(user_id);
+        user_info->set_name(std::to_string(user_id));
+      }
+    }
+  }
+
+  void GetGroupMemberDelta(google::protobuf::RpcController* controller,
+                           const tinyim::GroupMemberVersion* request,
+                           tinyim::GroupMemberDelta* delta,
+                           google::protobuf::Closure* done) override {
+    brpc::ClosureGuard done_guard(done);
+    bthread_usleep(FLAGS_db_latency_us);
+    const tinyim::group_id_t group_id = request->group_id();
+    Group& group = groups_[group_id];
+    std::unique_lock<std::mutex> lck(group.mutex);
+    delta->set_group_id(group_id);
+    delta->set_version(group.changes.size());
+    if (request->full()){
+      delta->set_full(true);
+      for (int i = 0; i < FLAGS_group_size; ++i){
+        if (group.joined[i]){
+          delta->add_added(group_id * FLAGS_group_size + i);
+        }
+      }
+      return;
+    }
+    // replay in order so each user ends up in one list
+    std::unordered_map<tinyim::user_id_t, bool> joined;
+    for (size_t i = request->version(); i < group.changes.size(); ++i){
+      joined[group.changes[i].first] = group.changes[i].second;
+    }
+    for (const auto& user_and_joined : joined){
+      if (user_and_joined.second){
+        delta->add_added(user_and_joined.first);
+      }
+      else {
+        delta->add_removed(user_and_joined.first);
+      }
+    }
+  }
+
+ private:
+  std::vector<Group> groups_;
+};
+
+struct SenderArgs {
+  brpc::Channel* channel;
+  tinyim::GroupMemberCache* cache;
+};
+
+// What SendMsg does to get the receivers of a group msg
+void* Send(void* arg){
+  auto args = static_cast<SenderArgs*>(arg);
+  tinyim::DbproxyService_Stub stub(args->channel);
+  size_t receiver_num = 0;
+  while (!g_stop.load(std::memory_order_relaxed)){
+    const tinyim::group_id_t group_id = butil::fast_rand_less_than(FLAGS_group_num);
+    const tinyim::user_id_t sender = group_id * FLAGS_group_size;
+    const int64_t start_us = butil::gettimeofday_us();
+    brpc::Controller cntl;
+    if (FLAGS_mode == "nocache"){
+      tinyim::GroupId request;
+      request.set_group_id(group_id);
+      tinyim::UserInfos user_infos;
+      stub.GetGroupMembers(&cntl, &request, &user_infos, nullptr);
+      if (!cntl.Failed()){
+        receiver_num += user_infos.user_info_size();
+      }
+    }
+    else {
+      tinyim::GroupMemberVersion request;
+      bool refresh = false;
+      auto members = args->cache->Find(group_id, &request, &refresh);
+      if (refresh || !members->Contains(sender)){
+        tinyim::GroupMemberDelta delta;
+        stub.GetGroupMemberDelta(&cntl, &request, &delta, nullptr);
+        if (!cntl.Failed()){
+          members = args->cache->Apply(members, delta);
+        }
+      }
+      if (!cntl.Failed()){
+        receiver_num += members->user_ids.size();
+      }
+    }
+    if (cntl.Failed()){
+      g_fail_num.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    g_latency_us.fetch_add(butil::gettimeofday_us() - start_us, std::memory_order_relaxed);
+    g_send_num.fetch_add(1, std::memory_order_relaxed);
+  }
+  LOG_IF(INFO, receiver_num == 0) << "No receiver";
+  return nullptr;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  FakeDbproxyService dbproxy_service;
+  brpc::Server server;
+  server.AddService(&dbproxy_service, brpc::SERVER_DOESNT_OWN_SERVICE);
+  if (server.Start(FLAGS_port, nullptr) != 0){
+    LOG(ERROR) << "Fail to start dbproxy";
+    return -1;
+  }
+
+  brpc::ChannelOptions options;
+  options.protocol = brpc::PROTOCOL_BAIDU_STD;
+  options.timeout_ms = FLAGS_db_latency_us / 1000 * 10 + 1000;
+  brpc::Channel channel;
+  const std::string addr = "127.0.0.1:" + std::to_string(FLAGS_port);
+  if (channel.Init(addr.c_str(), &options) != 0){
+    LOG(ERROR) << "Fail to initialize channel";
+    return -1;
+  }
+
+  tinyim::GroupMemberCache cache;
+  SenderArgs args{&channel, &cache};
+  std::vector<bthread_t> senders(FLAGS_sender_num);
+  const int64_t start_cpu_us = CpuUs();
+  const int64_t start_us = butil::gettimeofday_us();
+  for (auto& tid : senders){
+    bthread_start_background(&tid, nullptr, Send, &args);
+  }
+  const int64_t change_interval_us = FLAGS_change_per_s > 0 ? 1000000L / FLAGS_change_per_s : 0;
+  while (butil::gettimeofday_us() - start_us < FLAGS_duration_s * 1000000L){
+    if (change_interval_us == 0){
+      bthread_usleep(100000L);
+      continue;
+    }
+    bthread_usleep(change_interval_us);
+    dbproxy_service.Change();
+  }
+  const int64_t send_num = g_send_num.load();
+  const int64_t latency_us = g_latency_us.load();
+  const int64_t cpu_us = CpuUs() - start_cpu_us;
+  const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+
+  g_stop.store(true);
+  for (auto tid : senders){
+    bthread_join(tid, nullptr);
+  }
+
+  // CPU is of both ends, dbproxy included
+  LOG(INFO) << FLAGS_mode << ": group_size=" << FLAGS_group_size
+            << " refresh_ms=" << FLAGS_logic_group_cache_refresh_ms
+            << " sends=" << send_num
+            << " qps=" << send_num * 1000000 / elapsed_us
+            << " avg_latency_us=" << (send_num == 0 ? 0 : latency_us / send_num)
+            << " failed=" << g_fail_num.load()
+            << " cpu_ns_per_send=" << (send_num == 0 ? 0 : cpu_us * 1000 / send_num);
+
+  server.Stop(0);
+  server.Join();
+  return 0;
+}
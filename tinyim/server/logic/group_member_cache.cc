@@ -0,0 +1,108 @@
+#include "logic/group_member_cache.h"
+
+#include <iterator>
+#include <mutex>
+
+#include <gflags/gflags.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+
+DEFINE_int32(logic_group_cache_refresh_ms, 1000, "Ask dbproxy for the member changes of a "
+             "cached group at most this often, the time a join or leave may go unseen");
+DEFINE_int32(logic_group_cache_reload_s, 300, "Load all members of a cached group again after this");
+DEFINE_int64(logic_group_cache_max_groups, 100000, "Max groups whose members are cached");
+
+namespace {
+
+bvar::Adder<int64_t> g_group_hit_count("logic_group_cache_hit_count");
+bvar::Adder<int64_t> g_group_miss_count("logic_group_cache_miss_count");
+bvar::Adder<int64_t> g_group_evict_count("logic_group_cache_evict_count");
+
+}  // namespace
+
+namespace tinyim {
+
+GroupMemberCache::MembersPtr GroupMemberCache::Find(group_id_t group_id,
+                                                    GroupMemberVersion* request,
+                                                    bool* refresh){
+  request->set_group_id(group_id);
+  MembersPtr members;
+  {
+    Shard& s = shard(group_id);
+    std::unique_lock<butil::Mutex> ul(s.mutex);
+    auto iter = s.groups.find(group_id);
+    if (iter != s.groups.end()){
+      members = iter->second;
+    }
+  }
+  if (!members){
+    g_group_miss_count << 1;
+    request->set_full(true);
+    *refresh = true;
+    return members;
+  }
+  g_group_hit_count << 1;
+
+  const int64_t now_ms = butil::gettimeofday_ms();
+  int64_t check_ms = members->check_ms.load(std::memory_order_relaxed);
+  *refresh = now_ms - check_ms >= FLAGS_logic_group_cache_refresh_ms
+             && members->check_ms.compare_exchange_strong(check_ms, now_ms,
+                                                          std::memory_order_relaxed);
+  request->set_version(members->version);
+  request->set_full(now_ms - members->load_ms >= FLAGS_logic_group_cache_reload_s * 1000L);
+  return members;
+}
+
+GroupMemberCache::MembersPtr GroupMemberCache::Apply(const MembersPtr& base,
+                                                     const GroupMemberDelta& delta){
+  const int64_t now_ms = butil::gettimeofday_ms();
+  if (!delta.full() && base && delta.version() == base->version){
+    // nothing changed
+    base->check_ms.store(now_ms, std::memory_order_relaxed);
+    return base;
+  }
+
+  auto members = std::make_shared<Members>();
+  members->version = delta.version();
+  members->check_ms.store(now_ms, std::memory_order_relaxed);
+  std::vector<user_id_t> added(delta.added().begin(), delta.added().end());
+  std::sort(added.begin(), added.end());
+  if (delta.full() || !base){
+    members->load_ms = now_ms;
+    members->user_ids.swap(added);
+    members->user_ids.erase(std::unique(members->user_ids.begin(), members->user_ids.end()),
+                            members->user_ids.end());
+  }
+  else {
+    // each user is in one of the lists, so the order they apply in does not matter
+    members->load_ms = base->load_ms;
+    std::vector<user_id_t> removed(delta.removed().begin(), delta.removed().end());
+    std::sort(removed.begin(), removed.end());
+    std::vector<user_id_t> kept;
+    kept.reserve(base->user_ids.size());
+    std::set_difference(base->user_ids.begin(), base->user_ids.end(),
+                        removed.begin(), removed.end(), std::back_inserter(kept));
+    members->user_ids.reserve(kept.size() + added.size());
+    std::set_union(kept.begin(), kept.end(), added.begin(), added.end(),
+                   std::back_inserter(members->user_ids));
+  }
+
+  Shard& s = shard(delta.group_id());
+  std::unique_lock<butil::Mutex> ul(s.mutex);
+  auto iter = s.groups.find(delta.group_id());
+  if (iter == s.groups.end()){
+    if (static_cast<int64_t>(s.groups.size()) * kShardNum >= FLAGS_logic_group_cache_max_groups
+        && !s.groups.empty()){
+      g_group_evict_count << 1;
+      s.groups.erase(s.groups.begin());
+    }
+    s.groups.emplace(delta.group_id(), members);
+  }
+  else if (iter->second->version <= members->version){
+    // a slower answer must not roll back a newer one
+    iter->second = members;
+  }
+  return members;
+}
+
+}  // namespace tinyim
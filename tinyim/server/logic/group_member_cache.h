@@ -0,0 +1,68 @@
+#ifndef TINYIM_LOGIC_GROUP_MEMBER_CACHE_H_
+#define TINYIM_LOGIC_GROUP_MEMBER_CACHE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <butil/synchronization/lock.h>
+
+#include "dbproxy/dbproxy.pb.h"
+#include "type.h"
+
+namespace tinyim {
+
+// Member ids of groups as sorted arrays, each at the version of the last
+// change of group_member_changes applied, versions of a group are committed
+// in order. A group is brought up to date by GetGroupMemberDelta at most every
+// -logic_group_cache_refresh_ms, and reloaded whole every
+// -logic_group_cache_reload_s.
+class GroupMemberCache {
+ public:
+  // Immutable once cached, a delta makes a new one
+  struct Members {
+    int64_t version = 0;
+    int64_t load_ms = 0;
+    mutable std::atomic<int64_t> check_ms{0};
+    std::vector<user_id_t> user_ids;  // sorted
+
+    bool Contains(user_id_t user_id) const {
+      return std::binary_search(user_ids.begin(), user_ids.end(), user_id);
+    }
+  };
+  using MembersPtr = std::shared_ptr<const Members>;
+
+  GroupMemberCache() = default;
+
+  GroupMemberCache(const GroupMemberCache&) = delete;
+  GroupMemberCache& operator=(const GroupMemberCache&) = delete;
+
+  // Cached members of `group_id', nullptr if none. Fills `request' and sets
+  // `refresh' if dbproxy should be asked what changed, only one of the
+  // callers seeing the same stale members is told to.
+  MembersPtr Find(group_id_t group_id, GroupMemberVersion* request, bool* refresh);
+
+  // Members after applying `delta', the answer to a request made from
+  // `base', which may be nullptr if the request was full.
+  MembersPtr Apply(const MembersPtr& base, const GroupMemberDelta& delta);
+
+ private:
+  struct Shard {
+    butil::Mutex mutex;
+    std::unordered_map<group_id_t, MembersPtr> groups;
+  };
+
+  Shard& shard(group_id_t group_id) {
+    return shards_[static_cast<uint64_t>(group_id) % kShardNum];
+  }
+
+  enum { kShardNum = 64 };
+  Shard shards_[kShardNum];
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_LOGIC_GROUP_MEMBER_CACHE_H_
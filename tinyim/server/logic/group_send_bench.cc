@@ -0,0 +1,193 @@
+#include "dbproxy/dbproxy.pb.h"
+#include "idgen/idgen.pb.h"
+
+#include <gflags/gflags.h>
+#include <brpc/channel.h>
+#include <brpc/controller.h>
+#include <bthread/bthread.h>
+#include <butil/logging.h>
+#include <butil/strings/string_number_conversions.h>
+#include <butil/strings/string_split.h>
+#include <butil/time.h>
+
+#include <ctime>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "util/initialize.h"
+
+// The storage of a group msg as SendMsg does it, against running idgen and
+// dbproxy: an id for each member and a row in each inbox (-mode=write), or
+// an id and an inbox row for the sender and the msg once in the group
+// timeline (-mode=read, -logic_read_diffusion_group_size). Each size of
+// -group_sizes gets -msg_num msgs from -sender_num members. Ids are asked of
+// idgen directly, without the leases of logic. Members need not exist,
+// SaveGroupMsg does not look them up.
+
+DEFINE_string(mode, "read", "write: write diffusion, read: read diffusion");
+DEFINE_string(dbproxy_server, "127.0.0.1:7000", "IP Address of dbproxy");
+DEFINE_string(idgen_server, "127.0.0.1:8000", "IP Address of idgen");
+DEFINE_string(group_sizes, "100,1000,10000", "Members of the groups sent to, one run each");
+DEFINE_int64(group_id_base, 900000000, "Groups of the runs are this plus twice the size, plus 1 "
+             "for read, users of a group are group_id * 100000 plus index");
+DEFINE_int32(sender_num, 8, "Bthreads sending, each as another member");
+DEFINE_int32(msg_num, 200, "Msgs sent to each group");
+DEFINE_int32(timeout_ms, 10000, "RPC timeout in milliseconds");
+
+namespace {
+
+struct Run {
+  brpc::Channel* db_channel;
+  brpc::Channel* idgen_channel;
+  int64_t group_id;
+  int group_size;
+  bool read_diffusion;
+  int32_t client_time_base;
+
+  std::atomic<int> next_msg{0};
+  std::atomic<int64_t> sent_num{0};
+  std::atomic<int64_t> fail_num{0};
+  std::atomic<int64_t> id_num{0};
+  std::atomic<int64_t> inbox_row_num{0};
+  std::atomic<int64_t> timeline_row_num{0};
+  std::atomic<int64_t> ids_us{0};
+  std::atomic<int64_t> save_us{0};
+};
+
+struct SenderArgs {
+  Run* run;
+  int index;  // of the sender in the group
+};
+
+void* Send(void* arg){
+  auto args = static_cast<SenderArgs*>(arg);
+  Run* run = args->run;
+  tinyim::IdGenService_Stub idgen_stub(run->idgen_channel);
+  tinyim::DbproxyService_Stub db_stub(run->db_channel);
+  const tinyim::user_id_t sender = run->group_id * 100000 + args->index;
+  int32_t client_time = run->client_time_base;
+  while (run->next_msg.fetch_add(1, std::memory_order_relaxed) < FLAGS_msg_num){
+    // sender first, as AllocateIds
+    tinyim::MsgIdRequest id_request;
+    auto sender_and_id_num = id_request.add_user_ids();
+    sender_and_id_num->set_user_id(sender);
+    sender_and_id_num->set_need_msgid_num(1);
+    if (!run->read_diffusion){
+      for (int i = 0; i < run->group_size; ++i){
+        if (i == args->index){
+          continue;
+        }
+        auto user_and_id_num = id_request.add_user_ids();
+        user_and_id_num->set_user_id(run->group_id * 100000 + i);
+        user_and_id_num->set_need_msgid_num(1);
+      }
+    }
+    tinyim::MsgIdReply id_reply;
+    brpc::Controller id_cntl;
+    idgen_stub.IdGenerate(&id_cntl, &id_request, &id_reply, nullptr);
+    if (id_cntl.Failed()){
+      LOG(ERROR) << "Fail to call IdGenerate. " << id_cntl.ErrorText();
+      run->fail_num.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    tinyim::NewGroupMsg new_group_msg;
+    new_group_msg.set_group_id(run->group_id);
+    new_group_msg.set_sender_user_id(sender);
+    new_group_msg.set_message("group_send_bench");
+    new_group_msg.set_client_time(client_time++);
+    new_group_msg.set_msg_time(std::time(nullptr));
+    new_group_msg.set_read_diffusion(run->read_diffusion);
+    for (const tinyim::MsgIds& msg_ids : id_reply.msg_ids()){
+      auto user_and_msgid = new_group_msg.add_user_and_msgids();
+      user_and_msgid->set_user_id(msg_ids.user_id());
+      user_and_msgid->set_msg_id(msg_ids.start_msg_id());
+      new_group_msg.mutable_skipped_ranges()->MergeFrom(msg_ids.skipped_ranges());
+    }
+    new_group_msg.set_sender_msg_id(id_reply.msg_ids(0).start_msg_id());
+    tinyim::Reply db_reply;
+    brpc::Controller db_cntl;
+    db_stub.SaveGroupMsg(&db_cntl, &new_group_msg, &db_reply, nullptr);
+    if (db_cntl.Failed()){
+      LOG(ERROR) << "Fail to call SaveGroupMsg. " << db_cntl.ErrorText();
+      run->fail_num.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+
+    run->sent_num.fetch_add(1, std::memory_order_relaxed);
+    run->id_num.fetch_add(id_reply.msg_ids_size(), std::memory_order_relaxed);
+    run->inbox_row_num.fetch_add(new_group_msg.user_and_msgids_size(), std::memory_order_relaxed);
+    run->timeline_row_num.fetch_add(run->read_diffusion ? 1 : 0, std::memory_order_relaxed);
+    run->ids_us.fetch_add(id_cntl.latency_us(), std::memory_order_relaxed);
+    run->save_us.fetch_add(db_cntl.latency_us(), std::memory_order_relaxed);
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  brpc::ChannelOptions options;
+  options.protocol = brpc::PROTOCOL_BAIDU_STD;
+  options.timeout_ms = FLAGS_timeout_ms;
+  brpc::Channel db_channel;
+  if (db_channel.Init(FLAGS_dbproxy_server.c_str(), &options) != 0){
+    LOG(ERROR) << "Fail to initialize dbproxy channel";
+    return -1;
+  }
+  brpc::Channel idgen_channel;
+  if (idgen_channel.Init(FLAGS_idgen_server.c_str(), &options) != 0){
+    LOG(ERROR) << "Fail to initialize idgen channel";
+    return -1;
+  }
+
+  const bool read_diffusion = FLAGS_mode == "read";
+  std::vector<std::string> sizes;
+  butil::SplitString(FLAGS_group_sizes, ',', &sizes);
+  for (const std::string& size : sizes){
+    Run run;
+    run.db_channel = &db_channel;
+    run.idgen_channel = &idgen_channel;
+    if (!butil::StringToInt(size, &run.group_size) || run.group_size <= 0 || run.group_size > 100000){
+      LOG(ERROR) << "Bad group size " << size;
+      return -1;
+    }
+    // the modes in groups of their own, a timeline is never mixed with inboxes
+    run.group_id = FLAGS_group_id_base + run.group_size * 2 + (read_diffusion ? 1 : 0);
+    run.read_diffusion = read_diffusion;
+    // unique with the msgs of earlier runs
+    run.client_time_base = std::time(nullptr);
+
+    const int sender_num = std::min(FLAGS_sender_num, run.group_size);
+    std::vector<SenderArgs> args(sender_num);
+    std::vector<bthread_t> senders(sender_num);
+    const int64_t start_us = butil::gettimeofday_us();
+    for (int i = 0; i < sender_num; ++i){
+      args[i] = SenderArgs{&run, i};
+      bthread_start_background(&senders[i], nullptr, Send, &args[i]);
+    }
+    for (auto tid : senders){
+      bthread_join(tid, nullptr);
+    }
+    const int64_t elapsed_us = butil::gettimeofday_us() - start_us;
+
+    const int64_t sent_num = run.sent_num.load();
+    const int64_t div = sent_num == 0 ? 1 : sent_num;
+    LOG(INFO) << FLAGS_mode << ": group_size=" << run.group_size
+              << " sent=" << sent_num
+              << " failed=" << run.fail_num.load()
+              << " msgs_per_s=" << sent_num * 1000000 / elapsed_us
+              << " ids_per_msg=" << run.id_num.load() / div
+              << " inbox_rows_per_msg=" << run.inbox_row_num.load() / div
+              << " timeline_rows_per_msg=" << run.timeline_row_num.load() / div
+              << " avg_ids_us=" << run.ids_us.load() / div
+              << " avg_save_us=" << run.save_us.load() / div
+              << " avg_send_us=" << (run.ids_us.load() + run.save_us.load()) / div;
+  }
+  return 0;
+}
@@ -0,0 +1,172 @@
+#include "logic/id_lease.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <brpc/controller.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+
+#include "logic/idgen_router.h"
+
+DEFINE_int32(id_lease_block, 0, "Msg ids leased from idgen for each user at a time, "
+             "0 asks idgen for every message");
+DEFINE_int32(id_lease_ttl_ms, 1000, "Unused ids of a lease are skipped after this, it bounds "
+             "how long ids of one user may go out of order across logic nodes");
+DEFINE_int64(id_lease_max_users, 1000000, "Max users holding a lease, new leases are not "
+             "kept when full");
+
+namespace {
+
+bvar::Adder<int64_t> g_lease_hit_count("logic_id_lease_hit_count");
+bvar::Adder<int64_t> g_lease_miss_count("logic_id_lease_miss_count");
+bvar::Adder<int64_t> g_lease_skipped_ids("logic_id_lease_skipped_ids");
+
+void AddSkippedRange(tinyim::user_id_t user_id, tinyim::msg_id_t start_id, tinyim::msg_id_t end_id,
+                     tinyim::MsgIds* msg_ids){
+  g_lease_skipped_ids << end_id - start_id;
+  auto pskipped = msg_ids->add_skipped_ranges();
+  pskipped->set_user_id(user_id);
+  pskipped->set_start_msg_id(start_id);
+  pskipped->set_end_msg_id(end_id - 1);
+}
+
+}  // namespace
+
+namespace tinyim {
+
+void IdLeases::IdGenerate(brpc::Controller* cntl, const MsgIdRequest* request, MsgIdReply* reply){
+  if (FLAGS_id_lease_block <= 0){
+    router_->IdGenerate(cntl, request, reply);
+    return;
+  }
+
+  const int64_t now_ms = butil::gettimeofday_ms();
+  MsgIdRequest miss_request;
+  std::vector<int> miss_indexes;
+  for (int i = 0, size = request->user_ids_size(); i < size; ++i){
+    const user_id_t user_id = request->user_ids(i).user_id();
+    const int64_t need = request->user_ids(i).need_msgid_num();
+    auto pmsg_id = reply->add_msg_ids();
+    pmsg_id->set_user_id(user_id);
+    pmsg_id->set_msg_id_num(need);
+
+    if (Take(user_id, need, now_ms, pmsg_id)){
+      continue;
+    }
+    auto user_and_id_num = miss_request.add_user_ids();
+    user_and_id_num->set_user_id(user_id);
+    user_and_id_num->set_need_msgid_num(std::max<int64_t>(need, FLAGS_id_lease_block));
+    miss_indexes.push_back(i);
+  }
+  g_lease_hit_count << request->user_ids_size() - miss_request.user_ids_size();
+  if (miss_indexes.empty()){
+    return;
+  }
+  g_lease_miss_count << miss_request.user_ids_size();
+
+  MsgIdReply miss_reply;
+  router_->IdGenerate(cntl, &miss_request, &miss_reply);
+  if (cntl->Failed()){
+    return;
+  }
+  if (miss_reply.msg_ids_size() != miss_request.user_ids_size()){
+    cntl->SetFailed(brpc::ERESPONSE, "idgen replied %d ids for %d users",
+                    miss_reply.msg_ids_size(), miss_request.user_ids_size());
+    return;
+  }
+  for (size_t j = 0; j < miss_indexes.size(); ++j){
+    const auto& granted = miss_reply.msg_ids(j);
+    auto pmsg_id = reply->mutable_msg_ids(miss_indexes[j]);
+    pmsg_id->set_start_msg_id(granted.start_msg_id());
+    pmsg_id->mutable_skipped_ranges()->MergeFrom(granted.skipped_ranges());
+    const msg_id_t next_id = granted.start_msg_id() + pmsg_id->msg_id_num();
+    const msg_id_t end_id = granted.start_msg_id() + granted.msg_id_num();
+    // even when used up, a lease below it must go
+    Put(granted.user_id(), Lease{next_id, end_id}, now_ms, pmsg_id);
+  }
+}
+
+bool IdLeases::Take(user_id_t user_id, int64_t need, int64_t now_ms, MsgIds* msg_ids){
+  return leases_.Locked(user_id, now_ms, [&](LeaseMap::Slot& slot){
+    Lease* lease = slot.get();
+    if (lease == nullptr){
+      return false;
+    }
+    if (slot.expired() || lease->next_id + need > lease->end_id){
+      AddSkippedRange(user_id, lease->next_id, lease->end_id, msg_ids);
+      slot.Erase();
+      return false;
+    }
+    msg_ids->set_start_msg_id(lease->next_id);
+    lease->next_id += need;
+    if (lease->next_id == lease->end_id){
+      slot.Erase();
+    }
+    return true;
+  });
+}
+
+void IdLeases::Put(user_id_t user_id, const Lease& lease, int64_t now_ms, MsgIds* msg_ids){
+  leases_.Locked(user_id, now_ms, [&](LeaseMap::Slot& slot){
+    const Lease* kept = slot.get();
+    if (kept != nullptr){
+      // a concurrent send leased a block too, keep the one with higher ids,
+      // the other would hand out ids below some already handed out
+      if (kept->end_id >= lease.end_id){
+        if (lease.next_id < lease.end_id){
+          AddSkippedRange(user_id, lease.next_id, lease.end_id, msg_ids);
+        }
+        return;
+      }
+      AddSkippedRange(user_id, kept->next_id, kept->end_id, msg_ids);
+      if (lease.next_id < lease.end_id){
+        slot.Set(lease, FLAGS_id_lease_ttl_ms, FLAGS_id_lease_max_users);
+      }
+      else {
+        slot.Erase();
+      }
+      return;
+    }
+    if (lease.next_id == lease.end_id){
+      return;
+    }
+    if (!slot.Set(lease, FLAGS_id_lease_ttl_ms, FLAGS_id_lease_max_users)){
+      AddSkippedRange(user_id, lease.next_id, lease.end_id, msg_ids);
+    }
+  });
+}
+
+void IdLeases::ReturnAll(){
+  std::vector<MsgIdReply> returns(router_->node_num());
+  leases_.Drain([&](user_id_t user_id, const Lease& lease){
+    auto pmsg_id = returns[router_->NodeOfUser(user_id)].add_msg_ids();
+    pmsg_id->set_user_id(user_id);
+    pmsg_id->set_start_msg_id(lease.next_id);
+    pmsg_id->set_msg_id_num(lease.end_id - lease.next_id);
+  });
+
+  for (int node = 0; node < router_->node_num(); ++node){
+    if (returns[node].msg_ids_size() == 0){
+      continue;
+    }
+    IdGenService_Stub stub(router_->channel(node));
+    brpc::Controller cntl;
+    ReturnIdsReply reply;
+    stub.ReturnIds(&cntl, &returns[node], &reply, nullptr);
+    if (cntl.Failed()){
+      LOG(WARNING) << "Fail to return leased ids to idgen node=" << node << ". " << cntl.ErrorText();
+      continue;
+    }
+    LOG(INFO) << "Returned " << reply.returned_num() << " of " << returns[node].msg_ids_size()
+              << " leases to idgen node=" << node;
+  }
+}
+
+void IdLeases::OnExpire(const user_id_t&, const Lease& lease){
+  g_lease_skipped_ids << lease.end_id - lease.next_id;
+}
+
+}  // namespace tinyim
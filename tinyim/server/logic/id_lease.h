@@ -0,0 +1,60 @@
+#ifndef TINYIM_LOGIC_ID_LEASE_H_
+#define TINYIM_LOGIC_ID_LEASE_H_
+
+#include <cstdint>
+
+#include "idgen/idgen.pb.h"
+#include "type.h"
+#include "util/sharded_ttl_map.h"
+
+namespace brpc {
+class Controller;
+}  // namespace brpc
+
+namespace tinyim {
+
+class IdGenRouter;
+
+// Leases a block of msg ids per user from idgen and hands them out locally,
+// so that most SendMsg skip the idgen round trip. A lease expires after
+// -id_lease_ttl_ms and its unused ids are skipped, as are the leases lost when
+// logic crashes. On a clean stop unused ids are returned to idgen. Skipped ids
+// found while serving a user are added to its skipped_ranges in the reply.
+class IdLeases {
+ public:
+  explicit IdLeases(IdGenRouter* router): router_(router), leases_(&OnExpire) {}
+
+  IdLeases(const IdLeases&) = delete;
+  IdLeases& operator=(const IdLeases&) = delete;
+
+  // Same as IdGenRouter::IdGenerate, only users without enough leased ids
+  // go to idgen.
+  void IdGenerate(brpc::Controller* cntl, const MsgIdRequest* request, MsgIdReply* reply);
+
+  // Return unused ids of every lease to idgen.
+  void ReturnAll();
+
+ private:
+  struct Lease {
+    msg_id_t next_id;
+    msg_id_t end_id;  // exclusive
+  };
+
+  using LeaseMap = ShardedTtlMap<user_id_t, Lease>;
+
+  // Take `need' ids of the lease of `user_id' into `msg_ids', false if it
+  // has not enough.
+  bool Take(user_id_t user_id, int64_t need, int64_t now_ms, MsgIds* msg_ids);
+
+  void Put(user_id_t user_id, const Lease& lease, int64_t now_ms, MsgIds* msg_ids);
+
+  // Leases of idle users are only dropped by a sweep, their ids skipped.
+  static void OnExpire(const user_id_t& user_id, const Lease& lease);
+
+  IdGenRouter* router_;
+  LeaseMap leases_;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_LOGIC_ID_LEASE_H_
@@ -0,0 +1,73 @@
+#include "logic/id_reservation.h"
+
+#include <gflags/gflags.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+
+DEFINE_int32(id_reservation_ttl_ms, 10000, "Ids of a message not saved yet are reused by its "
+             "retries within this, 0 disables");
+DEFINE_int64(id_reservation_max_num, 1000000, "Max messages whose ids are kept for retries");
+
+namespace {
+
+bvar::Adder<int64_t> g_reservation_hit_count("logic_id_reservation_hit_count");
+bvar::Adder<int64_t> g_reservation_expired_count("logic_id_reservation_expired_count");
+
+}  // namespace
+
+namespace tinyim {
+
+bool IdReservations::Find(user_id_t sender, int32_t client_time,
+                          MsgIdRequest* request, MsgIdReply* reply){
+  if (FLAGS_id_reservation_ttl_ms <= 0 || client_time == 0){
+    return false;
+  }
+  const bool found = reservations_.Locked(Key(sender, client_time), butil::gettimeofday_ms(),
+                                          [&](ReservationMap::Slot& slot){
+    const Reservation* reservation = slot.get();
+    if (reservation == nullptr){
+      return false;
+    }
+    if (slot.expired()){
+      g_reservation_expired_count << 1;
+      slot.Erase();
+      return false;
+    }
+    *reply = reservation->reply;
+    return true;
+  });
+  if (!found){
+    return false;
+  }
+
+  for (const auto& msg_ids : reply->msg_ids()){
+    auto user_and_id_num = request->add_user_ids();
+    user_and_id_num->set_user_id(msg_ids.user_id());
+    user_and_id_num->set_need_msgid_num(msg_ids.msg_id_num());
+  }
+  g_reservation_hit_count << 1;
+  return true;
+}
+
+void IdReservations::Keep(user_id_t sender, int32_t client_time, const MsgIdReply& reply){
+  if (FLAGS_id_reservation_ttl_ms <= 0 || client_time == 0){
+    return;
+  }
+  reservations_.Locked(Key(sender, client_time), butil::gettimeofday_ms(),
+                       [&](ReservationMap::Slot& slot){
+    slot.Set(Reservation{reply}, FLAGS_id_reservation_ttl_ms, FLAGS_id_reservation_max_num);
+  });
+}
+
+void IdReservations::Erase(user_id_t sender, int32_t client_time){
+  if (FLAGS_id_reservation_ttl_ms <= 0 || client_time == 0){
+    return;
+  }
+  reservations_.Erase(Key(sender, client_time));
+}
+
+void IdReservations::OnExpire(const Key&, const Reservation&){
+  g_reservation_expired_count << 1;
+}
+
+}  // namespace tinyim
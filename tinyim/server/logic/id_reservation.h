@@ -0,0 +1,58 @@
+#ifndef TINYIM_LOGIC_ID_RESERVATION_H_
+#define TINYIM_LOGIC_ID_RESERVATION_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+#include "idgen/idgen.pb.h"
+#include "type.h"
+#include "util/sharded_ttl_map.h"
+
+namespace tinyim {
+
+// Ids allocated for a message, keyed by (sender, client_time), kept for
+// -id_reservation_ttl_ms until the message is saved. A retried SendMsg gets
+// the same ids and receivers back, so it neither asks idgen again nor leaves
+// the ids of the failed try unused.
+class IdReservations {
+ public:
+  IdReservations(): reservations_(&OnExpire) {}
+
+  IdReservations(const IdReservations&) = delete;
+  IdReservations& operator=(const IdReservations&) = delete;
+
+  // Fill `request' and `reply' with the ids kept for the message, false if
+  // none are kept.
+  bool Find(user_id_t sender, int32_t client_time, MsgIdRequest* request, MsgIdReply* reply);
+
+  void Keep(user_id_t sender, int32_t client_time, const MsgIdReply& reply);
+
+  // The message is saved, retries are answered by the last send data now.
+  void Erase(user_id_t sender, int32_t client_time);
+
+ private:
+  using Key = std::pair<user_id_t, int32_t>;
+
+  struct KeyHash {
+    size_t operator()(const Key& key) const {
+      return std::hash<user_id_t>()(key.first) * 31 + key.second;
+    }
+  };
+
+  struct Reservation {
+    MsgIdReply reply;
+  };
+
+  using ReservationMap = ShardedTtlMap<Key, Reservation, KeyHash>;
+
+  // Reservations of abandoned messages are only dropped by a sweep.
+  static void OnExpire(const Key& key, const Reservation& reservation);
+
+  ReservationMap reservations_;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_LOGIC_ID_RESERVATION_H_
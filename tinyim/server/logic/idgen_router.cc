@@ -0,0 +1,105 @@
+#include "logic/idgen_router.h"
+
+#include <gflags/gflags.h>
+#include <glog/logging.h>
+#include <brpc/controller.h>
+#include <butil/strings/string_split.h>
+
+DEFINE_string(idgen_servers, "", "Comma separated addresses of all idgen nodes, node id is "
+              "the index. Empty means -id_server_addr serves every user");
+DEFINE_int32(idgen_partition_num, 1024, "Users are split into this many partitions, must be "
+             "the same on logic and every idgen");
+DEFINE_int32(idgen_vnode_num, 64, "Virtual nodes of each idgen node on the hash ring");
+DEFINE_string(idgen_partition_moves, "", "Partitions placed off the hash ring after being "
+              "moved, \"partition:node,...\"");
+
+namespace tinyim {
+
+int IdGenRouter::Init(const std::string& id_server_addr, const brpc::ChannelOptions& options){
+  std::vector<std::string> servers;
+  butil::SplitString(FLAGS_idgen_servers, ',', &servers);
+  if (servers.empty()){
+    servers.push_back(id_server_addr);
+  }
+  for (const auto& server : servers){
+    channels_.emplace_back(new brpc::Channel);
+    if (channels_.back()->Init(server.c_str(), &options) != 0){
+      LOG(ERROR) << "Fail to initialize channel to idgen " << server;
+      return -1;
+    }
+  }
+
+  partition_map_.reset(new PartitionMap(FLAGS_idgen_partition_num, servers.size(),
+                                        FLAGS_idgen_vnode_num));
+  if (!partition_map_->ParseMoves(FLAGS_idgen_partition_moves)){
+    LOG(ERROR) << "Invalid idgen_partition_moves=" << FLAGS_idgen_partition_moves;
+    return -1;
+  }
+  return 0;
+}
+
+void IdGenRouter::IdGenerate(brpc::Controller* cntl, const MsgIdRequest* request, MsgIdReply* reply){
+  if (channels_.size() == 1){
+    IdGenService_Stub stub(channels_[0].get());
+    stub.IdGenerate(cntl, request, reply, nullptr);
+    return;
+  }
+
+  struct SubCall {
+    brpc::Controller cntl;
+    MsgIdRequest request;
+    MsgIdReply reply;
+    std::vector<int> indexes;  // positions in `request'
+  };
+  std::vector<SubCall> sub_calls(channels_.size());
+  for (int i = 0, size = request->user_ids_size(); i < size; ++i){
+    const int node = NodeOfUser(request->user_ids(i).user_id());
+    if (node < 0 || node >= static_cast<int>(channels_.size())){
+      cntl->SetFailed(EINVAL, "No idgen node=%d", node);
+      return;
+    }
+    *sub_calls[node].request.add_user_ids() = request->user_ids(i);
+    sub_calls[node].indexes.push_back(i);
+  }
+
+  for (size_t node = 0; node < channels_.size(); ++node){
+    SubCall& sub_call = sub_calls[node];
+    if (sub_call.indexes.empty()){
+      continue;
+    }
+    sub_call.cntl.set_log_id(cntl->log_id());
+    IdGenService_Stub stub(channels_[node].get());
+    stub.IdGenerate(&sub_call.cntl, &sub_call.request, &sub_call.reply, brpc::DoNothing());
+  }
+  for (auto& sub_call : sub_calls){
+    if (!sub_call.indexes.empty()){
+      brpc::Join(sub_call.cntl.call_id());
+    }
+  }
+
+  for (int i = 0, size = request->user_ids_size(); i < size; ++i){
+    reply->add_msg_ids();
+  }
+  for (size_t node = 0; node < channels_.size(); ++node){
+    SubCall& sub_call = sub_calls[node];
+    if (sub_call.indexes.empty()){
+      continue;
+    }
+    if (sub_call.cntl.Failed()){
+      DLOG(ERROR) << "Fail to call IdGenerate of idgen node=" << node << ". " << sub_call.cntl.ErrorText();
+      cntl->SetFailed(sub_call.cntl.ErrorCode(), "idgen node=%zu: %s", node,
+                      sub_call.cntl.ErrorText().c_str());
+      return;
+    }
+    if (sub_call.reply.msg_ids_size() != static_cast<int>(sub_call.indexes.size())){
+      cntl->SetFailed(brpc::ERESPONSE, "idgen node=%zu replied %d ids for %zu users", node,
+                      sub_call.reply.msg_ids_size(), sub_call.indexes.size());
+      return;
+    }
+    for (size_t j = 0; j < sub_call.indexes.size(); ++j){
+      reply->mutable_msg_ids(sub_call.indexes[j])->Swap(sub_call.reply.mutable_msg_ids(j));
+    }
+  }
+}
+
+}  // namespace tinyim
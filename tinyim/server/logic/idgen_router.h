@@ -0,0 +1,55 @@
+#ifndef TINYIM_LOGIC_IDGEN_ROUTER_H_
+#define TINYIM_LOGIC_IDGEN_ROUTER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <brpc/channel.h>
+
+#include "idgen/idgen.pb.h"
+#include "util/partition_map.h"
+
+namespace brpc {
+class Controller;
+}  // namespace brpc
+
+namespace tinyim {
+
+// Routes each user of a MsgIdRequest to the idgen node owning its partition.
+class IdGenRouter {
+ public:
+  IdGenRouter() = default;
+
+  IdGenRouter(const IdGenRouter&) = delete;
+  IdGenRouter& operator=(const IdGenRouter&) = delete;
+
+  // Connect to -idgen_servers, or to `id_server_addr' alone if it is empty.
+  // Return 0 on success.
+  int Init(const std::string& id_server_addr, const brpc::ChannelOptions& options);
+
+  // Split `request' by owner node, call the nodes in parallel and merge the
+  // replies in the order of `request'. `cntl' fails if any node fails.
+  void IdGenerate(brpc::Controller* cntl, const MsgIdRequest* request, MsgIdReply* reply);
+
+  // Index of the idgen node owning `user_id'
+  int NodeOfUser(user_id_t user_id) const {
+    return channels_.size() == 1 ? 0 : partition_map_->NodeOfUser(user_id);
+  }
+
+  brpc::Channel* channel(int node) const {
+    return channels_[node].get();
+  }
+
+  int node_num() const {
+    return channels_.size();
+  }
+
+ private:
+  std::vector<std::unique_ptr<brpc::Channel>> channels_;  // indexed by node id
+  std::unique_ptr<PartitionMap> partition_map_;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_LOGIC_IDGEN_ROUTER_H_
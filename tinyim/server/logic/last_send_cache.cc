@@ -0,0 +1,63 @@
+#include "logic/last_send_cache.h"
+
+#include <gflags/gflags.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+
+DEFINE_int32(logic_last_send_cache_ttl_s, 60, "Last sends of senders are kept in logic for this "
+             "long and written to redis in the background, 0 reads redis on each SendMsg");
+DEFINE_int64(logic_last_send_cache_max_num, 10000000, "Max senders whose last sends are cached");
+
+namespace {
+
+bvar::Adder<int64_t> g_last_send_hit_count("logic_last_send_cache_hit_count");
+bvar::Adder<int64_t> g_last_send_miss_count("logic_last_send_cache_miss_count");
+
+}  // namespace
+
+namespace tinyim {
+
+bool LastSendCache::enabled(){
+  return FLAGS_logic_last_send_cache_ttl_s > 0;
+}
+
+bool LastSendCache::Find(user_id_t user_id, UserLastSendData* data){
+  if (!enabled()){
+    return false;
+  }
+  const bool hit = entries_.Locked(user_id, butil::gettimeofday_ms(), [&](EntryMap::Slot& slot){
+    const Entry* entry = slot.get();
+    if (entry == nullptr || slot.expired()){
+      return false;
+    }
+    data->set_user_id(user_id);
+    data->set_msg_id(entry->msg_id);
+    data->set_client_time(entry->client_time);
+    data->set_msg_time(entry->msg_time);
+    return true;
+  });
+  if (hit){
+    g_last_send_hit_count << 1;
+  }
+  else {
+    g_last_send_miss_count << 1;
+  }
+  return hit;
+}
+
+void LastSendCache::Store(const UserLastSendData& data){
+  if (!enabled()){
+    return;
+  }
+  entries_.Locked(data.user_id(), butil::gettimeofday_ms(), [&](EntryMap::Slot& slot){
+    const Entry* entry = slot.get();
+    // compared like the script writing redis
+    if (entry != nullptr && entry->client_time > data.client_time() && !slot.expired()){
+      return;
+    }
+    slot.Set(Entry{data.msg_id(), data.client_time(), data.msg_time()},
+             FLAGS_logic_last_send_cache_ttl_s * 1000L, FLAGS_logic_last_send_cache_max_num);
+  });
+}
+
+}  // namespace tinyim
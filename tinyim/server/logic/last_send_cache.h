@@ -0,0 +1,47 @@
+#ifndef TINYIM_LOGIC_LAST_SEND_CACHE_H_
+#define TINYIM_LOGIC_LAST_SEND_CACHE_H_
+
+#include <cstdint>
+
+#include "common/messages.pb.h"
+#include "type.h"
+#include "util/sharded_ttl_map.h"
+
+namespace tinyim {
+
+// The last msg saved of each sender, so that SendMsg tells a retry without
+// reading redis. Only right while access sends all msgs of a sender to this
+// logic (-logic_route_by_sender), a sender moves only when logics come or
+// go, -logic_last_send_cache_ttl_s bounds how long a record from before that
+// is trusted.
+class LastSendCache {
+ public:
+  LastSendCache() = default;
+
+  LastSendCache(const LastSendCache&) = delete;
+  LastSendCache& operator=(const LastSendCache&) = delete;
+
+  static bool enabled();
+
+  // False if `user_id' is not cached.
+  bool Find(user_id_t user_id, UserLastSendData* data);
+
+  // Keep `data' unless a later msg of the user is kept, the last send read
+  // from redis may be older than a save finished meanwhile.
+  void Store(const UserLastSendData& data);
+
+ private:
+  struct Entry {
+    msg_id_t msg_id;
+    int32_t client_time;
+    int32_t msg_time;
+  };
+
+  using EntryMap = ShardedTtlMap<user_id_t, Entry>;
+
+  EntryMap entries_;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_LOGIC_LAST_SEND_CACHE_H_
@@ -1,4 +1,6 @@
 #include "logic/logic_service.h"
+#include "logic/id_lease.h"
+#include "logic/idgen_router.h"
 
 #include <gflags/gflags.h>
 #include <glog/logging.h>
@@ -31,13 +33,16 @@ DEFINE_string(db_addr, "127.0.0.1:7000", "Id server address");
 int main(int argc, char* argv[]) {
   tinyim::Initialize init(argc, &argv);
 
-  brpc::Channel id_channel;
+  tinyim::IdGenRouter id_router;
   brpc::ChannelOptions options;
   options.protocol = brpc::PROTOCOL_BAIDU_STD;
   options.connection_type = FLAGS_connection_type;
   options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
   options.max_retry = FLAGS_max_retry;
-  id_channel.Init(FLAGS_id_server_addr.c_str(), &options);
+  if (id_router.Init(FLAGS_id_server_addr, options) != 0) {
+    LOG(ERROR) << "Fail to initialize idgen router";
+    return -1;
+  }
 
   brpc::Channel db_channel;
   brpc::ChannelOptions db_options;
@@ -46,7 +51,8 @@ int main(int argc, char* argv[]) {
   db_options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
   db_options.max_retry = FLAGS_max_retry;
   db_channel.Init(FLAGS_db_addr.c_str(), &db_options);
-  tinyim::LogicServiceImpl logic_service_impl(&id_channel, &db_channel);
+  tinyim::IdLeases id_leases(&id_router);
+  tinyim::LogicServiceImpl logic_service_impl(&id_leases, &db_channel);
   brpc::Server server;
   if (server.AddService(&logic_service_impl, brpc::SERVER_DOESNT_OWN_SERVICE) != 0) {
     LOG(ERROR) << "Fail to add service";
@@ -68,6 +74,7 @@ int main(int argc, char* argv[]) {
   DLOG(INFO) << "Stopping";
   server.RunUntilAskedToQuit();
   DLOG(INFO) << "Stopping";
+  id_leases.ReturnAll();
 
   return 0;
 }
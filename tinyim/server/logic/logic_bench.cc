@@ -0,0 +1,116 @@
+#include <gflags/gflags.h>
+#include <butil/fast_rand.h>
+#include <butil/logging.h>
+#include <brpc/channel.h>
+#include <brpc/server.h>
+#include <bthread/bthread.h>
+#include <bvar/bvar.h>
+
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+
+#include "logic/logic.pb.h"
+#include "util/initialize.h"
+
+// End-to-end SendMsg load against a logic server. Run it with logic started
+// with -id_lease_block=0 and with leases on to compare the latency.
+
+DEFINE_string(server, "127.0.0.1:6000", "IP Address of logic server");
+DEFINE_string(connection_type, "", "Connection type. Available values: single, pooled, short");
+DEFINE_int32(timeout_ms, 1000, "RPC timeout in milliseconds");
+DEFINE_int32(thread_num, 50, "Number of bthreads sending messages");
+DEFINE_int32(user_num, 10000, "Senders and receivers are picked from [1, user_num]");
+DEFINE_int32(group_id, 0, "Send to this group if not 0, else private messages");
+DEFINE_int32(duration_s, 30, "Seconds to run, 0 means until asked to quit");
+
+namespace {
+
+bvar::LatencyRecorder g_latency_recorder("logic_bench_send_msg");
+bvar::Adder<int64_t> g_error_count("logic_bench_error_count");
+// distinct for every message so that none is taken as a retry
+std::atomic<int32_t> g_client_time(1);
+
+void* Sender(void* arg){
+  auto channel = static_cast<brpc::Channel*>(arg);
+  tinyim::LogicService_Stub stub(channel);
+
+  while (!brpc::IsAskedToQuit()) {
+    tinyim::NewMsg new_msg;
+    tinyim::MsgReply reply;
+    brpc::Controller cntl;
+
+    new_msg.set_user_id(butil::fast_rand_less_than(FLAGS_user_num) + 1);
+    if (FLAGS_group_id != 0){
+      new_msg.set_peer_id(FLAGS_group_id);
+      new_msg.set_msg_type(tinyim::MsgType::GROUP);
+    }
+    else {
+      new_msg.set_peer_id(butil::fast_rand_less_than(FLAGS_user_num) + 1);
+      new_msg.set_msg_type(tinyim::MsgType::PRIVATE);
+    }
+    new_msg.set_client_time(g_client_time.fetch_add(1, std::memory_order_relaxed));
+    new_msg.set_message("logic_bench");
+
+    stub.SendMsg(&cntl, &new_msg, &reply, nullptr);
+    if (!cntl.Failed()) {
+      g_latency_recorder << cntl.latency_us();
+    } else {
+      g_error_count << 1;
+      LOG_EVERY_SECOND(WARNING) << cntl.ErrorText();
+      bthread_usleep(50000);
+    }
+  }
+  return nullptr;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  tinyim::Initialize init(argc, &argv);
+
+  brpc::ChannelOptions options;
+  options.protocol = brpc::PROTOCOL_BAIDU_STD;
+  options.connection_type = FLAGS_connection_type;
+  options.timeout_ms = FLAGS_timeout_ms/*milliseconds*/;
+  options.max_retry = 0;
+  brpc::Channel channel;
+  if (channel.Init(FLAGS_server.c_str(), &options) != 0) {
+      LOG(ERROR) << "Fail to initialize channel";
+      return -1;
+  }
+
+  std::vector<bthread_t> bids(FLAGS_thread_num);
+  for (int i = 0; i < FLAGS_thread_num; ++i){
+    if (bthread_start_background(&bids[i], nullptr, Sender, &channel) != 0){
+      LOG(ERROR) << "Fail to create bthread";
+      return -1;
+    }
+  }
+
+  for (int second = 1; !brpc::IsAskedToQuit(); ++second){
+    sleep(1);
+    LOG(INFO) << "Sending SendMsg qps=" << g_latency_recorder.qps(1)
+              << " latency=" << g_latency_recorder.latency(1) << "us"
+              << " p99=" << g_latency_recorder.latency_percentile(0.99) << "us"
+              << " error=" << g_error_count.get_value();
+    if (FLAGS_duration_s > 0 && second >= FLAGS_duration_s){
+      break;
+    }
+  }
+
+  LOG(INFO) << "SendMsg summary thread_num=" << FLAGS_thread_num
+            << " qps=" << g_latency_recorder.qps()
+            << " avg=" << g_latency_recorder.latency() << "us"
+            << " p50=" << g_latency_recorder.latency_percentile(0.5) << "us"
+            << " p99=" << g_latency_recorder.latency_percentile(0.99) << "us"
+            << " p999=" << g_latency_recorder.latency_percentile(0.999) << "us"
+            << " max=" << g_latency_recorder.max_latency() << "us"
+            << " error=" << g_error_count.get_value();
+  brpc::AskToQuit();
+  for (int i = 0; i < FLAGS_thread_num; ++i){
+    bthread_join(bids[i], nullptr);
+  }
+  return 0;
+}
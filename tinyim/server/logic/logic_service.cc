@@ -5,6 +5,11 @@
 #include "logic/logic_service.h"
 #include "idgen/idgen.pb.h"
 
+#include <errno.h>
+
+#include <algorithm>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 
 #include <gflags/gflags.h>
@@ -13,24 +18,72 @@
 #include <brpc/closure_guard.h>
 #include <brpc/controller.h>
 #include <brpc/options.pb.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
 
 DEFINE_int32(access_max_retry, 3, "Max retries(not including the first RPC)");
 DEFINE_string(access_connection_type, "single", "Connection type. Available values: single, pooled, short");
 DEFINE_int32(access_timeout_ms, 100, "RPC timeout in milliseconds");
+DEFINE_bool(access_batch_push, true, "Send a message once to each access with all its receivers, "
+            "false to call SendtoAccess per receiver for old access");
+DEFINE_bool(logic_group_cache, true, "Keep group members in logic, updated by the changes "
+            "from dbproxy, false to ask dbproxy for all members on each send");
+DEFINE_bool(logic_speculative_ids, true, "Allocate the ids of a private msg while checking "
+            "whether it is a duplicate");
+DEFINE_int32(logic_read_diffusion_group_size, 500, "Groups of this many members or more keep a msg "
+             "once in the group timeline instead of in each member's inbox, 0 never");
 
 namespace {
-struct SendtoPeersArgs {
-  tinyim::MsgIdRequest id_request;
-  tinyim::MsgIdReply id_reply;
-  tinyim::NewMsg new_msg;
-  tinyim::user_id_t sender;
-  tinyim::LogicServiceImpl* this_;
-};
+
+bvar::IntRecorder g_access_batch_size("logic_access_batch_size");
+// stages of SendMsg, dedup and members or ids overlap
+bvar::LatencyRecorder g_sendmsg_latency("logic_sendmsg");
+bvar::LatencyRecorder g_dedup_latency("logic_sendmsg_dedup");
+bvar::LatencyRecorder g_members_latency("logic_sendmsg_members");
+bvar::LatencyRecorder g_ids_latency("logic_sendmsg_ids");
+bvar::LatencyRecorder g_save_latency("logic_sendmsg_save");
+bvar::Adder<int64_t> g_wasted_ids_count("logic_sendmsg_wasted_ids_count");
+bvar::Adder<int64_t> g_read_diffusion_count("logic_sendmsg_read_diffusion_count");
+bvar::Adder<int64_t> g_last_send_write_fail_count("logic_last_send_write_fail_count");
+// where the receivers of a msg are, and the part of it read from redis
+bvar::LatencyRecorder g_sessions_latency("logic_fanout_sessions");
+bvar::LatencyRecorder g_get_sessions_latency("logic_get_sessions");
+bvar::Adder<int64_t> g_unknown_access_skipped_count("logic_fanout_unknown_access_skipped_count");
+
+brpc::ChannelOptions AccessChannelOptions(){
+  brpc::ChannelOptions options;
+  options.protocol = brpc::PROTOCOL_BAIDU_STD;
+  options.connection_type = FLAGS_access_connection_type;
+  options.timeout_ms = FLAGS_access_timeout_ms/*milliseconds*/;
+  options.max_retry = FLAGS_access_max_retry;
+  return options;
+}
 
 }  // namespace
 
 
 namespace tinyim {
+
+// A saved msg pushed by the fan-out workers, left as is while they run
+class LogicServiceImpl::PushJob : public FanoutJob {
+ public:
+  explicit PushJob(LogicServiceImpl* service): service_(service) {}
+
+  int size() const override {
+    return receivers.user_id_size();
+  }
+
+  void Run(int begin, int end) const override {
+    service_->PushChunk(*this, begin, end);
+  }
+
+  Msg msg;  // fields of all receivers, the body is copied once per access
+  UserIds receivers;
+  MsgIdReply id_reply;  // receiver i has msg_ids(i + 1), empty by read diffusion
+
+ private:
+  LogicServiceImpl* service_;
+};
 class SendtoAccessClosure: public ::google::protobuf::Closure {
  public:
   SendtoAccessClosure(brpc::Controller* cntl, Pong* pong): cntl_(cntl), pong_(pong){}
@@ -53,9 +106,29 @@ class SendtoAccessClosure: public ::google::protobuf::Closure {
   Pong* pong_;
 };
 
-LogicServiceImpl::LogicServiceImpl(brpc::Channel *id_channel,
-                                   brpc::Channel *db_channel): id_channel_(id_channel),
-                                                               db_channel_(db_channel) {}
+// Written to redis after the reply, the cache has it already
+class SetLastSendClosure: public ::google::protobuf::Closure {
+ public:
+  void Run() override {
+    if (cntl.Failed()){
+      g_last_send_write_fail_count << 1;
+      LOG(WARNING) << "Fail to call SetUserLastSendData user_id=" << request.user_id()
+                   << ". " << cntl.ErrorText();
+    }
+    delete this;
+  }
+
+  brpc::Controller cntl;
+  UserLastSendData request;
+  Pong pong;
+};
+
+LogicServiceImpl::LogicServiceImpl(IdLeases *id_leases,
+                                   brpc::Channel *db_channel): id_leases_(id_leases),
+                                                               db_channel_(db_channel),
+                                                               accesses_(AccessChannelOptions()) {
+  CHECK_EQ(0, fanouts_.Start()) << "Fail to start fan-out workers";
+}
 
 LogicServiceImpl::~LogicServiceImpl() {
   DLOG(INFO) << "Calling AccessServiceImpl dtor";
@@ -73,8 +146,15 @@ void LogicServiceImpl::SendMsg(google::protobuf::RpcController* controller,
                                const NewMsg* new_msg,
                                MsgReply* reply,
                                google::protobuf::Closure* done) {
+  SendMsgAsync(static_cast<brpc::Controller*>(controller), new_msg, reply, done);
+}
+
+RpcTask LogicServiceImpl::SendMsgAsync(brpc::Controller* cntl,
+                                       const NewMsg* new_msg,
+                                       MsgReply* reply,
+                                       google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
+  const int64_t start_us = butil::gettimeofday_us();
   const tinyim::user_id_t user_id = new_msg->user_id();
   DLOG(INFO) << "Received request[log_id=" << cntl->log_id()
             << "] from " << cntl->remote_side()
@@ -86,80 +166,135 @@ void LogicServiceImpl::SendMsg(google::protobuf::RpcController* controller,
             << " message=" << new_msg->message()
             << " (attached=" << cntl->request_attachment() << ")";
 
-  // 1. check duplicate
+  // 1. check duplicate, meanwhile get the group members or the ids of a
+  // private msg, which do not depend on it
+  MsgIdRequest id_request;
+  MsgIdReply id_reply;
+  // a retry reuses the ids and receivers of its earlier try
+  const bool reserved = id_reservations_.Find(user_id, new_msg->client_time(),
+                                              &id_request, &id_reply);
+  const bool is_private = new_msg->msg_type() == MsgType::PRIVATE;
+
   DbproxyService_Stub db_stub(db_channel_);
+  CallGroup group;
   brpc::Controller db_cntl;
+  db_cntl.set_log_id(cntl->log_id());
   UserId cur_user_id;
   cur_user_id.set_user_id(user_id);
   UserLastSendData last_send_data;
-  db_stub.GetUserLastSendData(&db_cntl, &cur_user_id, &last_send_data, nullptr);
+  // the common case with access routing by sender, redis is read when the
+  // sender is new to this logic
+  const bool cache_last_send = LastSendCache::enabled();
+  const bool last_send_cached = cache_last_send && last_sends_.Find(user_id, &last_send_data);
+  if (!last_send_cached){
+    db_stub.GetUserLastSendData(&db_cntl, &cur_user_id, &last_send_data, group.Add());
+  }
+
+  brpc::Controller members_cntl;
+  members_cntl.set_log_id(cntl->log_id());
+  GroupId group_id;
+  UserInfos member_infos;
+  GroupMemberVersion member_version;
+  GroupMemberDelta member_delta;
+  GroupMemberCache::MembersPtr members;
+  bool ask_members = false;
+  if (!reserved && !is_private){
+    if (FLAGS_logic_group_cache){
+      members = group_members_.Find(new_msg->peer_id(), &member_version, &ask_members);
+      // or the sender has just joined, nothing is cached when asked already
+      ask_members = ask_members || !members->Contains(user_id);
+      if (ask_members){
+        db_stub.GetGroupMemberDelta(&members_cntl, &member_version, &member_delta, group.Add());
+      }
+    }
+    else {
+      ask_members = true;
+      group_id.set_group_id(new_msg->peer_id());
+      db_stub.GetGroupMembers(&members_cntl, &group_id, &member_infos, group.Add());
+    }
+  }
+
+  // ids allocated before the check are lost if it is a duplicate, clients
+  // find nothing in such a gap
+  brpc::Controller ids_cntl;
+  ids_cntl.set_log_id(cntl->log_id());
+  const bool speculative = !reserved && is_private && FLAGS_logic_speculative_ids;
+  if (speculative){
+    const int64_t ids_start_us = butil::gettimeofday_us();
+    AllocateIds(&ids_cntl, new_msg, nullptr, &id_request, &id_reply);
+    g_ids_latency << butil::gettimeofday_us() - ids_start_us;
+  }
+  co_await group.Wait();
+
+  if (!last_send_cached){
+    g_dedup_latency << db_cntl.latency_us();
+  }
   if (db_cntl.Failed()){
     DLOG(ERROR) << "Fail to call GetUserLastSendData. " << db_cntl.ErrorText();
     cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
-    return;
+    co_return;
   }
   else {
+    if (!last_send_cached){
+      last_send_data.set_user_id(user_id);
+      last_sends_.Store(last_send_data);
+    }
     // TODO when last_send_data.client_time() = 0
     if (last_send_data.client_time() == new_msg->client_time()) {
+      if (speculative && !ids_cntl.Failed()){
+        g_wasted_ids_count << id_reply.msg_ids_size();
+      }
       reply->set_msg_id(last_send_data.msg_id());
       reply->set_msg_time(last_send_data.msg_time());
-      return;
+      co_return;
     }
   }
 
-  // 2. Get id for this msg
-  std::unique_ptr<SendtoPeersArgs> sendto_peers_args(new SendtoPeersArgs);
-  sendto_peers_args->sender = user_id;
-  // sendto_peers_args->new_msg;
-
-  IdGenService_Stub id_stub(id_channel_);
-  MsgIdRequest &id_request = sendto_peers_args->id_request;
-  MsgIdReply &id_reply = sendto_peers_args->id_reply;
-  brpc::Controller id_cntl;
-  id_cntl.set_log_id(cntl->log_id());
-  {
-    auto user_and_id_num = id_request.add_user_ids();
-    user_and_id_num->set_user_id(user_id);
-    user_and_id_num->set_need_msgid_num(1);
-  }
-  if (new_msg->msg_type() == MsgType::PRIVATE){
-    auto peer_and_id_num = id_request.add_user_ids();
-    peer_and_id_num->set_user_id(new_msg->peer_id());
-    peer_and_id_num->set_need_msgid_num(1);
-  }
-  else {
-    DbproxyService_Stub db_stub(db_channel_);
-    GroupId group_id;
-    group_id.set_group_id(new_msg->peer_id());
-    brpc::Controller db_cntl;
-    UserInfos user_infos;
-    // UserIds user_ids;
-    db_cntl.set_log_id(cntl->log_id());
-    db_stub.GetGroupMembers(&db_cntl, &group_id, &user_infos, nullptr);
-    if (db_cntl.Failed()){
-      DLOG(ERROR) << "Fail to call GetGroupMember. " << db_cntl.ErrorText();
-      cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
-      return;
-    }
-    else {
-      for (int i = 0; i < user_infos.user_info_size(); ++i){
-        const user_id_t cur_user_id = user_infos.user_info(i).user_id();
-        if (cur_user_id == user_id){
-          continue;
+  // 2. Get id for this msg if not yet, blocks this bthread when the leases miss
+  bool read_diffusion = false;
+  if (!reserved){
+    if (ask_members){
+      g_members_latency << members_cntl.latency_us();
+      if (members_cntl.Failed()){
+        DLOG(ERROR) << "Fail to get members of group. " << members_cntl.ErrorText();
+        cntl->SetFailed(members_cntl.ErrorCode(), members_cntl.ErrorText().c_str());
+        co_return;
+      }
+      if (FLAGS_logic_group_cache){
+        members = group_members_.Apply(members, member_delta);
+      }
+      else {
+        auto infos_members = std::make_shared<GroupMemberCache::Members>();
+        for (const auto& user_info : member_infos.user_info()){
+          infos_members->user_ids.push_back(user_info.user_id());
         }
-        auto user_and_id_num = id_request.add_user_ids();
-        user_and_id_num->set_user_id(cur_user_id);
-        user_and_id_num->set_need_msgid_num(1);
+        std::sort(infos_members->user_ids.begin(), infos_members->user_ids.end());
+        members = std::move(infos_members);
       }
     }
-  }
-
-
-  id_stub.IdGenerate(&id_cntl, &id_request, &id_reply, nullptr);
-  if (id_cntl.Failed()){
-      DLOG(ERROR) << "Fail to call IdGenerate. " << id_cntl.ErrorText();
-      cntl->SetFailed(id_cntl.ErrorCode(), id_cntl.ErrorText().c_str());
-      return;
+    if (!is_private && !members->Contains(user_id)){
+      cntl->SetFailed(EPERM, "user_id=%ld is not a member of group_id=%ld",
+                      user_id, new_msg->peer_id());
+      co_return;
+    }
+    // members read from the group timeline, only the sender takes an id
+    read_diffusion = !is_private && FLAGS_logic_read_diffusion_group_size > 0
+        && members->user_ids.size() >= static_cast<size_t>(FLAGS_logic_read_diffusion_group_size);
+    if (!speculative){
+      const int64_t ids_start_us = butil::gettimeofday_us();
+      AllocateIds(&ids_cntl, new_msg, is_private || read_diffusion ? nullptr : &members->user_ids,
+                  &id_request, &id_reply);
+      g_ids_latency << butil::gettimeofday_us() - ids_start_us;
+    }
+    if (ids_cntl.Failed()){
+      cntl->SetFailed(ids_cntl.ErrorCode(), ids_cntl.ErrorText().c_str());
+      co_return;
+    }
+    // a retry of a read diffusion msg wastes one id at most, and needs the
+    // members anyway
+    if (!read_diffusion){
+      id_reservations_.Keep(user_id, new_msg->client_time(), id_reply);
+    }
   }
 
   // 3. save user last send data
@@ -175,6 +310,7 @@ void LogicServiceImpl::SendMsg(google::protobuf::RpcController* controller,
   // }
 
   // 4. Save this msg to db
+  int64_t group_seq = 0;
   if (new_msg->msg_type() == MsgType::PRIVATE) {
     const msg_id_t sender_msg_id = id_reply.msg_ids(0).start_msg_id();
     const msg_id_t receiver_msg_id = id_reply.msg_ids(1).start_msg_id();
@@ -186,14 +322,21 @@ void LogicServiceImpl::SendMsg(google::protobuf::RpcController* controller,
     new_private_msg.set_message(new_msg->message());
     new_private_msg.set_sender_msg_id(sender_msg_id);
     new_private_msg.set_receiver_msg_id(receiver_msg_id);
+    new_private_msg.set_skip_last_send(cache_last_send);
+    for (const auto& msg_ids : id_reply.msg_ids()){
+      new_private_msg.mutable_skipped_ranges()->MergeFrom(msg_ids.skipped_ranges());
+    }
     DbproxyService_Stub db_stub2(db_channel_);
     brpc::Controller db_cntl;
     Reply db_reply;
-    db_stub2.SavePrivateMsg(&db_cntl, &new_private_msg, &db_reply, nullptr);
+    co_await AsyncCall([&](google::protobuf::Closure* resume){
+      db_stub2.SavePrivateMsg(&db_cntl, &new_private_msg, &db_reply, resume);
+    });
+    g_save_latency << db_cntl.latency_us();
     if (db_cntl.Failed()){
       DLOG(ERROR) << "Fail to call SavePrivateMsg. " << db_cntl.ErrorText();
       cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
-      return;
+      co_return;
     }
     else{
       reply->set_msg_id(sender_msg_id);
@@ -209,6 +352,8 @@ void LogicServiceImpl::SendMsg(google::protobuf::RpcController* controller,
     new_group_msg.set_client_time(new_msg->client_time());
     new_group_msg.set_msg_time(msg_time);
     new_group_msg.set_sender_user_id(user_id);
+    new_group_msg.set_read_diffusion(read_diffusion);
+    new_group_msg.set_skip_last_send(cache_last_send);
     msg_id_t msg_id = 0;
     for (int i = 0, size = id_reply.msg_ids_size(); i < size; ++i){
       auto puser_and_msgid = new_group_msg.add_user_and_msgids();
@@ -218,125 +363,240 @@ void LogicServiceImpl::SendMsg(google::protobuf::RpcController* controller,
       }
       puser_and_msgid->set_user_id(id_reply.msg_ids(i).user_id());
       puser_and_msgid->set_msg_id(id_reply.msg_ids(i).start_msg_id());
+      new_group_msg.mutable_skipped_ranges()->MergeFrom(id_reply.msg_ids(i).skipped_ranges());
     }
     DLOG_IF(INFO, msg_id == 0) << "Fail to get id from idgen msg_id=" << msg_id << " user_id=" << user_id;
     new_group_msg.set_sender_msg_id(msg_id);
     DbproxyService_Stub db_stub2(db_channel_);
     brpc::Controller db_cntl;
     Reply db_reply;
-    db_stub2.SaveGroupMsg(&db_cntl, &new_group_msg, &db_reply, nullptr);
+    co_await AsyncCall([&](google::protobuf::Closure* resume){
+      db_stub2.SaveGroupMsg(&db_cntl, &new_group_msg, &db_reply, resume);
+    });
+    g_save_latency << db_cntl.latency_us();
     if (db_cntl.Failed()){
-      DLOG(ERROR) << "Fail to call SaveGroupMsg. " << id_cntl.ErrorText();
-      cntl->SetFailed(id_cntl.ErrorCode(), id_cntl.ErrorText().c_str());
-      return;
+      DLOG(ERROR) << "Fail to call SaveGroupMsg. " << db_cntl.ErrorText();
+      cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
+      co_return;
     }
     else {
       CHECK_NE(msg_id, 0) << "Id is wrong. user_id=" << user_id;
       reply->set_msg_id(msg_id);
       // reply->set_timestamp(timestamp);
     }
+    if (read_diffusion){
+      g_read_diffusion_count << 1;
+      group_seq = db_reply.group_seq();
+    }
     reply->set_msg_id(msg_id);
     reply->set_last_msg_id(msg_id);
     reply->set_msg_time(msg_time);
   }
 
-  sendto_peers_args->new_msg = *new_msg;
-
-  sendto_peers_args->new_msg.set_msg_time(msg_time);
-  sendto_peers_args->this_ = this;
+  // so that clients need not pull the gaps before their new msg_id
+  reply->mutable_skipped_ranges()->CopyFrom(id_reply.msg_ids(0).skipped_ranges());
+
+  id_reservations_.Erase(user_id, new_msg->client_time());
+
+  if (cache_last_send){
+    last_send_data.set_user_id(user_id);
+    last_send_data.set_msg_id(reply->msg_id());
+    last_send_data.set_client_time(new_msg->client_time());
+    last_send_data.set_msg_time(msg_time);
+    last_sends_.Store(last_send_data);
+    // dbproxy left it to us, a sender moving to another logic reads it
+    auto set_done = new SetLastSendClosure;
+    set_done->cntl.set_log_id(cntl->log_id());
+    set_done->request = last_send_data;
+    db_stub.SetUserLastSendData(&set_done->cntl, &set_done->request, &set_done->pong, set_done);
+  }
 
-  bthread_t bt;
-  bthread_start_background(&bt, nullptr, SendtoPeers, sendto_peers_args.release());
+  // 5. Push to the receivers, waits here when too many msgs are being pushed
+  const int64_t persisted_us = butil::gettimeofday_us();
+  auto job = std::make_shared<PushJob>(this);
+  job->msg.set_sender(user_id);
+  job->msg.set_message(new_msg->message());
+  job->msg.set_client_time(new_msg->client_time());
+  job->msg.set_msg_time(msg_time);
+  job->msg.set_group_id(is_private ? 0 : new_msg->peer_id());
+  job->msg.set_group_seq(group_seq);
+  if (read_diffusion){
+    // no ids of receivers
+    for (const user_id_t member : members->user_ids){
+      if (member != user_id){
+        job->receivers.add_user_id(member);
+      }
+    }
+  }
+  else {
+    for (int i = 1, size = id_request.user_ids_size(); i < size; ++i){
+      // i = 0 is sender
+      job->receivers.add_user_id(id_request.user_ids(i).user_id());
+    }
+    job->id_reply.Swap(&id_reply);
+  }
+  fanouts_.Submit(std::move(job), persisted_us);
+  g_sendmsg_latency << butil::gettimeofday_us() - start_us;
 }
 
-void* LogicServiceImpl::SendtoPeers(void* args) {
-  std::unique_ptr<SendtoPeersArgs> lazy_delete(static_cast<SendtoPeersArgs*>(args));
-
-  tinyim::MsgIdRequest& id_request = (static_cast<SendtoPeersArgs*>(args))->id_request;
-  tinyim::MsgIdReply& id_reply = (static_cast<SendtoPeersArgs*>(args))->id_reply;
-  tinyim::user_id_t sender = static_cast<SendtoPeersArgs*>(args)->sender;
-  tinyim::NewMsg& new_msg = static_cast<SendtoPeersArgs*>(args)->new_msg;
-  tinyim::LogicServiceImpl* this_ = static_cast<SendtoPeersArgs*>(args)->this_;
+void LogicServiceImpl::AllocateIds(brpc::Controller* cntl, const NewMsg* new_msg,
+                                   const std::vector<user_id_t>* members,
+                                   MsgIdRequest* id_request, MsgIdReply* id_reply){
+  brpc::Controller id_cntl;
+  id_cntl.set_log_id(cntl->log_id());
+  {
+    auto user_and_id_num = id_request->add_user_ids();
+    user_and_id_num->set_user_id(new_msg->user_id());
+    user_and_id_num->set_need_msgid_num(1);
+  }
+  if (new_msg->msg_type() == MsgType::PRIVATE){
+    auto peer_and_id_num = id_request->add_user_ids();
+    peer_and_id_num->set_user_id(new_msg->peer_id());
+    peer_and_id_num->set_need_msgid_num(1);
+  }
+  else if (members != nullptr){
+    for (const user_id_t cur_user_id : *members){
+      if (cur_user_id == new_msg->user_id()){
+        continue;
+      }
+      auto user_and_id_num = id_request->add_user_ids();
+      user_and_id_num->set_user_id(cur_user_id);
+      user_and_id_num->set_need_msgid_num(1);
+    }
+  }
 
-  tinyim::DbproxyService_Stub session_stub(this_->db_channel_);
-  brpc::Controller session_cntl;
-  tinyim::Sessions sessions;
-  tinyim::UserIds user_ids;
+  // leased ids first, the rest split by idgen partition and merged back in
+  // order, sender stays first
+  id_leases_->IdGenerate(&id_cntl, id_request, id_reply);
+  if (id_cntl.Failed()){
+      DLOG(ERROR) << "Fail to call IdGenerate. " << id_cntl.ErrorText();
+      cntl->SetFailed(id_cntl.ErrorCode(), id_cntl.ErrorText().c_str());
+  }
+}
 
-  for (int i = 1, size = id_request.user_ids_size(); i < size; ++i){
-    // i = 0 is sender
-    user_ids.add_user_id(id_request.user_ids(i).user_id());
+void LogicServiceImpl::SessionChanged(google::protobuf::RpcController* controller,
+                                      const Session* session,
+                                      Pong* pong,
+                                      google::protobuf::Closure* done){
+  brpc::ClosureGuard done_guard(done);
+  DLOG(INFO) << "Session changed user_id=" << session->user_id()
+             << " has_session=" << session->has_session()
+             << " addr=" << session->addr();
+  // a new access gets its channel here rather than in a fan-out
+  int32_t node = SessionCache::kOffline;
+  if (session->has_session()){
+    node = accesses_.Register(session->addr());
+    if (node == AccessRegistry::kNoAccess){
+      return;
+    }
   }
+  sessions_.Notify(session->user_id(), node);
+}
+
+void LogicServiceImpl::PushChunk(const PushJob& job, int begin, int end) {
+  const MsgIdReply& id_reply = job.id_reply;
+  const bool has_ids = id_reply.msg_ids_size() > 0;
 
-  session_stub.GetSessions(&session_cntl, &user_ids, &sessions, nullptr);
-  if (session_cntl.Failed()){
-    DLOG(ERROR) << "Fail to call GetSessions. " << session_cntl.ErrorText();
-    return nullptr;
+  tinyim::UserIds user_ids;
+  for (int i = begin; i < end; ++i){
+    user_ids.add_user_id(job.receivers.user_id(i));
   }
-  DLOG(INFO) << "GetSessions. response size=" << sessions.session_size();
-  for (int i = 0; i < user_ids.user_id_size(); ++i){
-    DLOG(INFO) << "i= " << i
-               << "user_id=" << user_ids.user_id(i)
-               << " session addr=" << sessions.session(i).addr()
-               << ". " << sessions.session(i).user_id();
 
+  // only the users not cached are read from redis
+  const int64_t lookup_us = butil::gettimeofday_us();
+  std::vector<int32_t> nodes;
+  tinyim::UserIds missed;
+  std::vector<int> missed_index;
+  sessions_.Lookup(user_ids, &nodes, &missed, &missed_index);
+  if (missed.user_id_size() > 0){
+    tinyim::DbproxyService_Stub session_stub(db_channel_);
+    brpc::Controller session_cntl;
+    tinyim::Sessions sessions;
+    session_stub.GetSessions(&session_cntl, &missed, &sessions, nullptr);
+    if (session_cntl.Failed()){
+      DLOG(ERROR) << "Fail to call GetSessions. " << session_cntl.ErrorText();
+      return;
+    }
+    g_get_sessions_latency << session_cntl.latency_us();
+    for (int i = 0, size = sessions.session_size(); i < size; ++i){
+      const Session& session = sessions.session(i);
+      DLOG(INFO) << "user_id=" << session.user_id()
+                 << " has_session=" << session.has_session()
+                 << " addr=" << session.addr();
+      int32_t node = SessionCache::kOffline;
+      if (session.has_session()){
+        // no channel is made here, the receiver pulls this msg from its inbox
+        node = accesses_.Find(session.addr());
+        if (node == AccessRegistry::kNoAccess){
+          accesses_.RegisterInBackground(session.addr());
+          g_unknown_access_skipped_count << 1;
+          continue;
+        }
+      }
+      nodes[missed_index[i]] = node;
+      sessions_.Store(session.user_id(), node, lookup_us);
+    }
   }
-  // CHECK_NE(msg_id, 0) << "Id is wrong. user_id=" << user_id;
-  // reply->set_msg_id(msg_id);
+  g_sessions_latency << butil::gettimeofday_us() - lookup_us;
 
+  // nullptr for the receivers without session
   std::vector<brpc::Channel*> channel_vec;
-  channel_vec.reserve(sessions.session_size());
-  {
-    std::unique_lock<std::mutex> lck(this_->access_map_mtx_);
-    for (int i = 0, size = sessions.session_size(); i < size; ++i){
-      if (!sessions.session(i).has_session()){
-        DLOG(INFO) << "user_id=" << sessions.session(i).user_id() << " has no session";
+  accesses_.GetChannels(nodes, &channel_vec);
+  DLOG(INFO) << "channel_vec size=" << channel_vec.size();
+  if (FLAGS_access_batch_push){
+    // receivers grouped by their access
+    std::unordered_map<brpc::Channel*, MsgBatch> batches;
+    for (int i = 0, size = user_ids.user_id_size(); i < size; ++i){
+      if (channel_vec[i] == nullptr){
         continue;
       }
-      if (this_->access_map_.count(sessions.session(i).addr()) == 0) {
-        brpc::ChannelOptions options;
-        options.protocol = brpc::PROTOCOL_BAIDU_STD;
-        options.connection_type = FLAGS_access_connection_type;
-        options.timeout_ms = FLAGS_access_timeout_ms/*milliseconds*/;
-        options.max_retry = FLAGS_access_max_retry;
-        DLOG(INFO) << "Insert access_map. key" << sessions.session(i).addr();
-        this_->access_map_[sessions.session(i).addr()].Init(sessions.session(i).addr().c_str(), &options);
+      MsgBatch& batch = batches[channel_vec[i]];
+      if (!batch.has_msg()){
+        *batch.mutable_msg() = job.msg;
+      }
+      UserAndMsgId* user_and_msgid = batch.add_user_and_msgids();
+      user_and_msgid->set_user_id(user_ids.user_id(i));
+      if (!has_ids){
+        continue;
+      }
+      const MsgIds& msg_ids = id_reply.msg_ids(begin + i + 1);
+      user_and_msgid->set_msg_id(msg_ids.start_msg_id());
+      for (const MsgIdRange& range : msg_ids.skipped_ranges()){
+        *batch.add_skipped_ranges() = range;
       }
-      channel_vec.push_back(&(this_->access_map_[sessions.session(i).addr()]));
-      DLOG(INFO) << "channel_vec idx=" << channel_vec.size() - 1 << "session addr=" << sessions.session(i).addr();
     }
+    for (auto& channel_and_batch : batches){
+      auto cntl = new brpc::Controller;
+      auto pong = new Pong;
+      auto send_to_access_closure = new SendtoAccessClosure(cntl, pong);
+      tinyim::AccessService_Stub stub(channel_and_batch.first);
+      DLOG(INFO) << "Calling SendtoAccessBatch. receiver num="
+                 << channel_and_batch.second.user_and_msgids_size();
+      g_access_batch_size << channel_and_batch.second.user_and_msgids_size();
+      stub.SendtoAccessBatch(cntl, &channel_and_batch.second, pong, send_to_access_closure);
+    }
+    return;
   }
-  DLOG(INFO) << "channel_vec size=" << channel_vec.size();
-  for (int i = 0, size = sessions.session_size(), j = 0; i < size; ++i){
-    if (!sessions.session(i).has_session()){
+  for (int i = 0, size = user_ids.user_id_size(); i < size; ++i){
+    if (channel_vec[i] == nullptr){
       continue;
     }
     auto cntl = new brpc::Controller;
-    tinyim::Msg msg;
-    // XXX const char*
+    tinyim::Msg msg(job.msg);
     msg.set_user_id(user_ids.user_id(i));
-    msg.set_sender(sender);
     msg.set_receiver(user_ids.user_id(i));
-    msg.set_message(new_msg.message().c_str());
-    msg.set_msg_id(id_reply.msg_ids(i + 1).start_msg_id());
-    msg.set_client_time(new_msg.client_time());
-    msg.set_msg_time(new_msg.msg_time());
-    if (new_msg.msg_type() == MsgType::PRIVATE){
-      msg.set_group_id(0);
-    }
-    else{
-      msg.set_group_id(new_msg.peer_id());
+    if (has_ids){
+      msg.set_msg_id(id_reply.msg_ids(begin + i + 1).start_msg_id());
+      msg.mutable_skipped_ranges()->CopyFrom(id_reply.msg_ids(begin + i + 1).skipped_ranges());
     }
 
     auto pong = new Pong;
     auto send_to_access_closure = new SendtoAccessClosure(cntl, pong);
 
-    tinyim::AccessService_Stub stub(channel_vec[j]);
-    DLOG(INFO) << "Calling SendtoAccess. receiver=" << user_ids.user_id(i) << " channel_vec idx=" << j;
+    tinyim::AccessService_Stub stub(channel_vec[i]);
+    DLOG(INFO) << "Calling SendtoAccess. receiver=" << user_ids.user_id(i) << " channel_vec idx=" << i;
     stub.SendtoAccess(cntl, &msg, pong, send_to_access_closure);
-    ++j;
   }
-  return nullptr;
 }
 
 void LogicServiceImpl::PullData(google::protobuf::RpcController* controller,
@@ -353,14 +613,22 @@ void LogicServiceImpl::GetMsgs(google::protobuf::RpcController* controller,
                                const MsgIdRange* msg_range,
                                Msgs* msgs,
                                google::protobuf::Closure* done) {
+  GetMsgsAsync(static_cast<brpc::Controller*>(controller), msg_range, msgs, done);
+}
+
+RpcTask LogicServiceImpl::GetMsgsAsync(brpc::Controller* cntl,
+                                       const MsgIdRange* msg_range,
+                                       Msgs* msgs,
+                                       google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   DbproxyService_Stub db_stub(db_channel_);
   brpc::Controller db_cntl;
   db_cntl.set_log_id(cntl->log_id());
 
-  db_stub.GetMsgs(&db_cntl, msg_range, msgs, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    db_stub.GetMsgs(&db_cntl, msg_range, msgs, resume);
+  });
   if (db_cntl.Failed()) {
       DLOG(ERROR) << "Fail to call GetMsgs. " << db_cntl.ErrorText();
       cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
@@ -372,14 +640,22 @@ void LogicServiceImpl::GetFriends(google::protobuf::RpcController* controller,
                                   const UserId* user_id,
                                   UserInfos* user_infos,
                                   google::protobuf::Closure* done) {
+  GetFriendsAsync(static_cast<brpc::Controller*>(controller), user_id, user_infos, done);
+}
+
+RpcTask LogicServiceImpl::GetFriendsAsync(brpc::Controller* cntl,
+                                          const UserId* user_id,
+                                          UserInfos* user_infos,
+                                          google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   DbproxyService_Stub db_stub(db_channel_);
   brpc::Controller db_cntl;
   db_cntl.set_log_id(cntl->log_id());
 
-  db_stub.GetFriends(&db_cntl, user_id, user_infos, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    db_stub.GetFriends(&db_cntl, user_id, user_infos, resume);
+  });
   if (db_cntl.Failed()) {
       DLOG(ERROR) << "Fail to call GetFriends. " << db_cntl.ErrorText();
       cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
@@ -390,14 +666,22 @@ void LogicServiceImpl::GetGroups(google::protobuf::RpcController* controller,
                                  const UserId* user_id,
                                  GroupInfos* group_infos,
                                  google::protobuf::Closure* done) {
+  GetGroupsAsync(static_cast<brpc::Controller*>(controller), user_id, group_infos, done);
+}
+
+RpcTask LogicServiceImpl::GetGroupsAsync(brpc::Controller* cntl,
+                                         const UserId* user_id,
+                                         GroupInfos* group_infos,
+                                         google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   DbproxyService_Stub db_stub(db_channel_);
   brpc::Controller db_cntl;
   db_cntl.set_log_id(cntl->log_id());
 
-  db_stub.GetGroups(&db_cntl, user_id, group_infos, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    db_stub.GetGroups(&db_cntl, user_id, group_infos, resume);
+  });
   if (db_cntl.Failed()) {
       DLOG(ERROR) << "Fail to call GetGroups. " << db_cntl.ErrorText();
       cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
@@ -408,14 +692,22 @@ void LogicServiceImpl::GetGroupMembers(google::protobuf::RpcController* controll
                                        const GroupId* group_id,
                                        UserInfos* user_infos,
                                        google::protobuf::Closure* done) {
+  GetGroupMembersAsync(static_cast<brpc::Controller*>(controller), group_id, user_infos, done);
+}
+
+RpcTask LogicServiceImpl::GetGroupMembersAsync(brpc::Controller* cntl,
+                                               const GroupId* group_id,
+                                               UserInfos* user_infos,
+                                               google::protobuf::Closure* done) {
   brpc::ClosureGuard done_guard(done);
-  brpc::Controller* cntl = static_cast<brpc::Controller*>(controller);
 
   DbproxyService_Stub db_stub(db_channel_);
   brpc::Controller db_cntl;
   db_cntl.set_log_id(cntl->log_id());
 
-  db_stub.GetGroupMembers(&db_cntl, group_id, user_infos, nullptr);
+  co_await AsyncCall([&](google::protobuf::Closure* resume){
+    db_stub.GetGroupMembers(&db_cntl, group_id, user_infos, resume);
+  });
   if (db_cntl.Failed()) {
       DLOG(ERROR) << "Fail to call GetGroupMembers. " << db_cntl.ErrorText();
       cntl->SetFailed(db_cntl.ErrorCode(), db_cntl.ErrorText().c_str());
@@ -4,12 +4,20 @@
 #include "logic.pb.h"
 #include "type.h"
 
-#include <mutex>
-#include <unordered_map>
+#include <vector>
 
 #include <brpc/channel.h>
 #include <bthread/unstable.h>
 
+#include "logic/access_registry.h"
+#include "logic/fanout_executor.h"
+#include "logic/group_member_cache.h"
+#include "logic/id_lease.h"
+#include "logic/id_reservation.h"
+#include "logic/last_send_cache.h"
+#include "logic/session_cache.h"
+#include "util/rpc_coro.h"
+
 namespace brpc {
 class Channel;
 class Controller;
@@ -21,7 +29,7 @@ class Status;
 namespace tinyim {
 class LogicServiceImpl : public tinyim::LogicService {
  public:
-  LogicServiceImpl(brpc::Channel *id_channel, brpc::Channel* db_channel);
+  LogicServiceImpl(IdLeases* id_leases, brpc::Channel* db_channel);
   virtual ~LogicServiceImpl();
 
   void Test(google::protobuf::RpcController* controller,
@@ -58,16 +66,56 @@ class LogicServiceImpl : public tinyim::LogicService {
                        const GroupId* group_id,
                        UserInfos* user_infos,
                        google::protobuf::Closure* done) override;
- private:
 
-  static void* SendtoPeers(void* args);
-
-  brpc::Channel *id_channel_;
+  void SessionChanged(google::protobuf::RpcController* controller,
+                      const Session* session,
+                      Pong* pong,
+                      google::protobuf::Closure* done) override;
+ private:
+  // Handlers waiting on dbproxy without holding a bthread
+  RpcTask SendMsgAsync(brpc::Controller* cntl,
+                       const NewMsg* new_msg,
+                       MsgReply* reply,
+                       google::protobuf::Closure* done);
+  RpcTask GetMsgsAsync(brpc::Controller* cntl,
+                       const MsgIdRange* msg_range,
+                       Msgs* msgs,
+                       google::protobuf::Closure* done);
+  RpcTask GetFriendsAsync(brpc::Controller* cntl,
+                          const UserId* user_id,
+                          UserInfos* user_infos,
+                          google::protobuf::Closure* done);
+  RpcTask GetGroupsAsync(brpc::Controller* cntl,
+                         const UserId* user_id,
+                         GroupInfos* group_infos,
+                         google::protobuf::Closure* done);
+  RpcTask GetGroupMembersAsync(brpc::Controller* cntl,
+                               const GroupId* group_id,
+                               UserInfos* user_infos,
+                               google::protobuf::Closure* done);
+
+  // Ids of the sender and each receiver of `new_msg', sender first.
+  // `members' of its group, nullptr for a private msg or to allocate only
+  // for the sender of a read diffusion one.
+  void AllocateIds(brpc::Controller* cntl, const NewMsg* new_msg,
+                   const std::vector<user_id_t>* members,
+                   MsgIdRequest* id_request, MsgIdReply* id_reply);
+
+  class PushJob;
+
+  // Push `job' to its receivers in [begin, end) on a fan-out worker.
+  void PushChunk(const PushJob& job, int begin, int end);
+
+  IdLeases *id_leases_;
+  IdReservations id_reservations_;
+  LastSendCache last_sends_;
+  GroupMemberCache group_members_;
+  SessionCache sessions_;
   brpc::Channel *db_channel_;
 
-  // TODO enum { kBucketNum = 16 };
-  std::mutex access_map_mtx_;
-  std::unordered_map<std::string, brpc::Channel> access_map_;
+  AccessRegistry accesses_;
+  // last, its workers use the others till stopped
+  FanoutExecutor fanouts_;
 };
 
 }  // namespace tinyim
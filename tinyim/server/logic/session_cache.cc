@@ -0,0 +1,74 @@
+#include "logic/session_cache.h"
+
+#include <gflags/gflags.h>
+#include <butil/time.h>
+#include <bvar/bvar.h>
+
+DEFINE_int32(logic_session_cache_ttl_ms, 5000, "Sessions read from redis are used for this long, "
+             "0 disables the cache");
+DEFINE_int64(logic_session_cache_max_num, 10000000, "Max users whose sessions are cached");
+
+namespace {
+
+bvar::Adder<int64_t> g_session_hit_count("logic_session_cache_hit_count");
+bvar::Adder<int64_t> g_session_miss_count("logic_session_cache_miss_count");
+bvar::Adder<int64_t> g_session_notify_count("logic_session_cache_notify_count");
+
+}  // namespace
+
+namespace tinyim {
+
+void SessionCache::Lookup(const UserIds& user_ids, std::vector<int32_t>* nodes,
+                          UserIds* missed, std::vector<int>* missed_index){
+  const int64_t now_ms = butil::gettimeofday_ms();
+  nodes->assign(user_ids.user_id_size(), kOffline);
+  for (int i = 0, size = user_ids.user_id_size(); i < size; ++i){
+    const user_id_t user_id = user_ids.user_id(i);
+    bool hit = false;
+    if (FLAGS_logic_session_cache_ttl_ms > 0){
+      entries_.Locked(user_id, now_ms, [&](EntryMap::Slot& slot){
+        const Entry* entry = slot.get();
+        if (entry != nullptr && !slot.expired()){
+          (*nodes)[i] = entry->node;
+          hit = true;
+        }
+      });
+    }
+    if (!hit){
+      missed->add_user_id(user_id);
+      missed_index->push_back(i);
+    }
+  }
+  g_session_hit_count << user_ids.user_id_size() - missed->user_id_size();
+  g_session_miss_count << missed->user_id_size();
+}
+
+void SessionCache::Store(user_id_t user_id, int32_t node, int64_t lookup_us){
+  if (FLAGS_logic_session_cache_ttl_ms <= 0){
+    return;
+  }
+  Put(user_id, node, lookup_us, 0);
+}
+
+void SessionCache::Notify(user_id_t user_id, int32_t node){
+  g_session_notify_count << 1;
+  if (FLAGS_logic_session_cache_ttl_ms <= 0){
+    return;
+  }
+  const int64_t now_us = butil::gettimeofday_us();
+  Put(user_id, node, now_us, now_us);
+}
+
+void SessionCache::Put(user_id_t user_id, int32_t node, int64_t lookup_us, int64_t notified_us){
+  entries_.Locked(user_id, butil::gettimeofday_ms(), [&](EntryMap::Slot& slot){
+    const Entry* entry = slot.get();
+    if (entry != nullptr && entry->notified_us >= lookup_us){
+      // changed after redis was read
+      return;
+    }
+    slot.Set(Entry{node, notified_us}, FLAGS_logic_session_cache_ttl_ms,
+             FLAGS_logic_session_cache_max_num);
+  });
+}
+
+}  // namespace tinyim
@@ -0,0 +1,55 @@
+#ifndef TINYIM_LOGIC_SESSION_CACHE_H_
+#define TINYIM_LOGIC_SESSION_CACHE_H_
+
+#include <cstdint>
+#include <vector>
+
+#include "common/messages.pb.h"
+#include "type.h"
+#include "util/sharded_ttl_map.h"
+
+namespace tinyim {
+
+// The access each user is on, read from redis through GetSessions and kept
+// for -logic_session_cache_ttl_ms. Access tells logic at SignIn and SignOut
+// so a user moving to another access is seen at once, the ttl bounds what a
+// lost notification costs. Accesses are kept as their AccessRegistry ids, a
+// user costs a few words.
+class SessionCache {
+ public:
+  enum : int32_t { kOffline = -1 };
+
+  SessionCache() = default;
+
+  SessionCache(const SessionCache&) = delete;
+  SessionCache& operator=(const SessionCache&) = delete;
+
+  // Access ids of `user_ids' into `nodes' in the same order, kOffline if
+  // has no session. The users not cached are left kOffline and appended to
+  // `missed', their indexes to `missed_index'.
+  void Lookup(const UserIds& user_ids, std::vector<int32_t>* nodes,
+              UserIds* missed, std::vector<int>* missed_index);
+
+  // Cache `node' of `user_id' read from redis after `lookup_us', but not if
+  // notified since, redis may have been read before it changed.
+  void Store(user_id_t user_id, int32_t node, int64_t lookup_us);
+
+  // `user_id' is on `node' now by a SignIn, or kOffline by a SignOut.
+  void Notify(user_id_t user_id, int32_t node);
+
+ private:
+  struct Entry {
+    int32_t node;
+    int64_t notified_us;
+  };
+
+  using EntryMap = ShardedTtlMap<user_id_t, Entry>;
+
+  void Put(user_id_t user_id, int32_t node, int64_t lookup_us, int64_t notified_us);
+
+  EntryMap entries_;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_LOGIC_SESSION_CACHE_H_
@@ -1,10 +1,9 @@
 #ifndef TINYIM_UTIL_CONSISTENT_HASH_H_
 #define TINYIM_UTIL_CONSISTENT_HASH_H_
 
-// not use
-
 // reference https://github.com/ioriiod0/consistent_hash
 
+#include <algorithm>
 #include <cassert>
 #include <cstddef>
 #include <cstdint>
@@ -85,9 +84,10 @@ class ConsistentHash {
     return nodes_.erase(std::hash<vnode_t>{}(node));
   }
 
-  int find(uint32_t hash) {
-    assert(nodes_.empty());
-    iterator iter = nodes_.lower_bound(hash);
+  // node_id of the first vnode clockwise from `hash'
+  int find(uint32_t hash) const {
+    assert(!nodes_.empty());
+    auto iter = nodes_.lower_bound(hash);
     if (iter == nodes_.end()) {
         iter = nodes_.begin();
     }
@@ -112,7 +112,7 @@ class ConsistentHash {
       os << "null" << std::endl;
       return;
     }
-    std::unique_ptr<int64_t> ptr(new int64_t[max_node_id + 1]{});
+    std::unique_ptr<int64_t[]> ptr(new int64_t[max_node_id + 1]{});
     int64_t* sums = ptr.get();
 
     std::size_t n = UINT32_MAX - j->first + i->first;
@@ -139,7 +139,7 @@ class ConsistentHash {
   std::map<uint32_t, vnode_t> nodes_;
 };
 
-std::ostream& operator<<(std::ostream& os, const ConsistentHash& consistent_hash){
+inline std::ostream& operator<<(std::ostream& os, const ConsistentHash& consistent_hash){
   consistent_hash.Describe(os);
   return os;
 }
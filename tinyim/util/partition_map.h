@@ -0,0 +1,87 @@
+#ifndef TINYIM_UTIL_PARTITION_MAP_H_
+#define TINYIM_UTIL_PARTITION_MAP_H_
+
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <butil/crc32c.h>  // brpc
+#include <butil/strings/string_split.h>
+
+#include "type.h"
+#include "util/consistent_hash.h"
+
+namespace tinyim {
+
+// Users are split into a fixed number of partitions, each partition is owned
+// by one idgen node. Partitions are placed on nodes by a consistent hash ring,
+// a moved partition overrides its ring placement. Logic and idgen must build
+// it from the same configuration.
+class PartitionMap {
+ public:
+  PartitionMap(int partition_num, int node_num, int vnode_num): partition_num_(partition_num),
+                                                                node_num_(node_num) {
+    for (int node = 0; node < node_num; ++node){
+      for (int vnode = 0; vnode < vnode_num; ++vnode){
+        ring_.insert(vnode_t(node, vnode));
+      }
+    }
+  }
+
+  // `moves' is "partition:node,partition:node,...". Return false if malformed
+  // or a node is not one of the `node_num' nodes.
+  bool ParseMoves(const std::string& moves){
+    std::vector<std::string> items;
+    butil::SplitString(moves, ',', &items);
+    for (const auto& item : items){
+      if (item.empty()){
+        continue;
+      }
+      char* end = nullptr;
+      const long partition = strtol(item.c_str(), &end, 10);
+      if (*end != ':' || partition < 0 || partition >= partition_num_){
+        return false;
+      }
+      const long node = strtol(end + 1, &end, 10);
+      if (*end != '\0' || node < 0 || node >= node_num_){
+        return false;
+      }
+      moves_[partition] = node;
+    }
+    return true;
+  }
+
+  int PartitionOf(user_id_t user_id) const {
+    return butil::crc32c::Value(reinterpret_cast<const char*>(&user_id), sizeof(user_id))
+           % partition_num_;
+  }
+
+  int NodeOf(int partition) const {
+    auto iter = moves_.find(partition);
+    if (iter != moves_.end()){
+      return iter->second;
+    }
+    return ring_.find(butil::crc32c::Value(reinterpret_cast<const char*>(&partition),
+                                           sizeof(partition)));
+  }
+
+  int NodeOfUser(user_id_t user_id) const {
+    return NodeOf(PartitionOf(user_id));
+  }
+
+  int partition_num() const {
+    return partition_num_;
+  }
+
+ private:
+  const int partition_num_;
+  const int node_num_;
+  ConsistentHash ring_;
+  std::unordered_map<int, int> moves_;  // partition -> node
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_UTIL_PARTITION_MAP_H_
@@ -0,0 +1,75 @@
+#ifndef TINYIM_UTIL_RANGE_SET_H_
+#define TINYIM_UTIL_RANGE_SET_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <map>
+
+namespace tinyim {
+
+// Disjoint closed intervals of ids, overlapping and adjacent ones are merged
+// so a run of skipped ranges costs one entry.
+class RangeSet {
+ public:
+  // Add [start, end], ignored if start > end.
+  void Add(int64_t start, int64_t end){
+    if (start > end){
+      return;
+    }
+    auto iter = ranges_.upper_bound(start);
+    if (iter != ranges_.begin() && std::prev(iter)->second >= start - 1){
+      --iter;
+      start = iter->first;
+    }
+    while (iter != ranges_.end() && iter->first <= end + 1){
+      if (iter->second > end){
+        end = iter->second;
+      }
+      iter = ranges_.erase(iter);
+    }
+    ranges_.emplace_hint(iter, start, end);
+  }
+
+  // True if every id of [start, end] is in the set.
+  bool Covers(int64_t start, int64_t end) const {
+    auto iter = ranges_.upper_bound(start);
+    if (iter == ranges_.begin()){
+      return false;
+    }
+    --iter;
+    return iter->second >= end;
+  }
+
+  // Call fn(start, end) for each interval overlapping [start, end], clipped
+  // to it, in ascending order.
+  template <typename Fn>
+  void ForEachIn(int64_t start, int64_t end, Fn fn) const {
+    auto iter = ranges_.upper_bound(start);
+    if (iter != ranges_.begin() && std::prev(iter)->second >= start){
+      --iter;
+    }
+    for (; iter != ranges_.end() && iter->first <= end; ++iter){
+      fn(iter->first < start ? start : iter->first, iter->second > end ? end : iter->second);
+    }
+  }
+
+  // Drop the lowest intervals until at most `max_size' are left, they are the
+  // least likely to be queried.
+  void Truncate(size_t max_size){
+    while (ranges_.size() > max_size){
+      ranges_.erase(ranges_.begin());
+    }
+  }
+
+  size_t size() const {
+    return ranges_.size();
+  }
+
+ private:
+  std::map<int64_t, int64_t> ranges_;  // start -> end
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_UTIL_RANGE_SET_H_
@@ -0,0 +1,146 @@
+#ifndef TINYIM_UTIL_RPC_CORO_H_
+#define TINYIM_UTIL_RPC_CORO_H_
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+#include <google/protobuf/stubs/callback.h>
+
+namespace tinyim {
+
+// Return type of a coroutine rpc handler. It starts at once, returns to the
+// caller at its first co_await so the bthread is free while the next hop is
+// in flight, and frees itself when it finishes. Its server `done' is run by
+// a brpc::ClosureGuard in the coroutine, as in a plain handler.
+struct RpcTask {
+  struct promise_type {
+    RpcTask get_return_object() noexcept {
+      return {};
+    }
+    std::suspend_never initial_suspend() noexcept {
+      return {};
+    }
+    std::suspend_never final_suspend() noexcept {
+      return {};
+    }
+    void return_void() noexcept {}
+    void unhandled_exception() noexcept {
+      std::terminate();
+    }
+  };
+};
+
+// Awaitable of an asynchronous stub call, `start' is given the closure to
+// pass as the call's `done':
+//
+//   co_await AsyncCall([&](google::protobuf::Closure* done){
+//     stub.GetMsgs(&cntl, &request, &response, done);
+//   });
+//
+// The coroutine resumes in the bthread that runs `done', possibly before
+// `start' returns when the call fails at once.
+template <typename Start>
+class AsyncCall {
+ public:
+  explicit AsyncCall(Start start): start_(std::move(start)) {}
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  void await_suspend(std::coroutine_handle<> handle){
+    // the frame holding this awaiter may be gone once the call is started
+    Start start = std::move(start_);
+    start(new ResumeClosure(handle));
+  }
+
+  void await_resume() const noexcept {}
+
+ private:
+  class ResumeClosure : public google::protobuf::Closure {
+   public:
+    explicit ResumeClosure(std::coroutine_handle<> handle): handle_(handle) {}
+
+    void Run() override {
+      const std::coroutine_handle<> handle = handle_;
+      delete this;
+      handle.resume();
+    }
+
+   private:
+    std::coroutine_handle<> handle_;
+  };
+
+  Start start_;
+};
+
+// Independent stub calls in flight together, awaited as a whole:
+//
+//   CallGroup group;
+//   stub.GetUserLastSendData(&cntl1, &request1, &response1, group.Add());
+//   stub.GetGroupMembers(&cntl2, &request2, &response2, group.Add());
+//   co_await group.Wait();
+//
+// Must be awaited once, after every Add.
+class CallGroup {
+ public:
+  CallGroup() = default;
+
+  CallGroup(const CallGroup&) = delete;
+  CallGroup& operator=(const CallGroup&) = delete;
+
+  // The `done' of one more call
+  google::protobuf::Closure* Add(){
+    pending_.fetch_add(1, std::memory_order_relaxed);
+    return &done_;
+  }
+
+  class Awaiter {
+   public:
+    explicit Awaiter(CallGroup* group): group_(group) {}
+
+    bool await_ready() const noexcept {
+      return false;
+    }
+
+    bool await_suspend(std::coroutine_handle<> handle){
+      group_->handle_ = handle;
+      // drop the count held by the waiter, resume at once if all are done
+      return group_->pending_.fetch_sub(1, std::memory_order_acq_rel) != 1;
+    }
+
+    void await_resume() const noexcept {}
+
+   private:
+    CallGroup* group_;
+  };
+
+  Awaiter Wait(){
+    return Awaiter(this);
+  }
+
+ private:
+  class DoneClosure : public google::protobuf::Closure {
+   public:
+    explicit DoneClosure(CallGroup* group): group_(group) {}
+
+    void Run() override {
+      if (group_->pending_.fetch_sub(1, std::memory_order_acq_rel) == 1){
+        group_->handle_.resume();
+      }
+    }
+
+   private:
+    CallGroup* group_;
+  };
+
+  std::atomic<int> pending_{1};  // one for the waiter
+  std::coroutine_handle<> handle_;
+  DoneClosure done_{this};
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_UTIL_RPC_CORO_H_
@@ -0,0 +1,147 @@
+#ifndef TINYIM_UTIL_SHARDED_TTL_MAP_H_
+#define TINYIM_UTIL_SHARDED_TTL_MAP_H_
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+
+#include <butil/synchronization/lock.h>
+
+namespace tinyim {
+
+// Hash map split into shards each under its own mutex, entries expire after
+// a ttl. Expired entries stay until found or until an add meets a full
+// shard, which sweeps it at most once a ttl, so a cache holding up to
+// `max_num' entries costs no timer.
+template <typename K, typename V, typename Hash = std::hash<K>>
+class ShardedTtlMap {
+ private:
+  struct Entry {
+    V value;
+    int64_t expire_ms;
+  };
+
+  struct Shard {
+    butil::Mutex mutex;
+    std::unordered_map<K, Entry, Hash> entries;
+    int64_t next_sweep_ms = 0;
+  };
+
+ public:
+  // Called on each expired entry a sweep drops, under its shard lock.
+  using ExpireFn = void (*)(const K& key, const V& value);
+
+  explicit ShardedTtlMap(ExpireFn on_expire = nullptr): on_expire_(on_expire) {}
+
+  ShardedTtlMap(const ShardedTtlMap&) = delete;
+  ShardedTtlMap& operator=(const ShardedTtlMap&) = delete;
+
+  // The entry of a key while its shard is locked.
+  class Slot {
+   public:
+    // nullptr if there is no entry, expired or not.
+    V* get() const {
+      return iter_ == shard_.entries.end() ? nullptr : &iter_->second.value;
+    }
+
+    // Only for an entry present.
+    bool expired() const {
+      return iter_->second.expire_ms <= now_ms_;
+    }
+
+    void Erase(){
+      if (iter_ != shard_.entries.end()){
+        shard_.entries.erase(iter_);
+        iter_ = shard_.entries.end();
+      }
+    }
+
+    // Replace the entry, or add it unless the shard is full, false if not
+    // added. Expires `ttl_ms' from now.
+    bool Set(V value, int64_t ttl_ms, int64_t max_num){
+      const int64_t expire_ms = now_ms_ + ttl_ms;
+      if (iter_ != shard_.entries.end()){
+        iter_->second = Entry{std::move(value), expire_ms};
+        return true;
+      }
+      if (full(max_num) && now_ms_ >= shard_.next_sweep_ms){
+        for (auto it = shard_.entries.begin(); it != shard_.entries.end();){
+          if (it->second.expire_ms <= now_ms_){
+            if (on_expire_ != nullptr){
+              on_expire_(it->first, it->second.value);
+            }
+            it = shard_.entries.erase(it);
+          }
+          else {
+            ++it;
+          }
+        }
+        shard_.next_sweep_ms = now_ms_ + ttl_ms;
+      }
+      if (full(max_num)){
+        return false;
+      }
+      iter_ = shard_.entries.emplace(key_, Entry{std::move(value), expire_ms}).first;
+      return true;
+    }
+
+   private:
+    friend class ShardedTtlMap;
+
+    Slot(Shard& shard, const K& key, int64_t now_ms, ExpireFn on_expire)
+      : shard_(shard), key_(key), now_ms_(now_ms), on_expire_(on_expire),
+        iter_(shard.entries.find(key)) {}
+
+    bool full(int64_t max_num) const {
+      return static_cast<int64_t>(shard_.entries.size()) * kShardNum >= max_num;
+    }
+
+    Shard& shard_;
+    const K& key_;
+    const int64_t now_ms_;
+    const ExpireFn on_expire_;
+    typename std::unordered_map<K, Entry, Hash>::iterator iter_;
+  };
+
+  // Return fn(slot) with the slot of `key' at `now_ms'.
+  template <typename Fn>
+  auto Locked(const K& key, int64_t now_ms, Fn fn) -> decltype(fn(std::declval<Slot&>())){
+    Shard& s = shard(key);
+    std::unique_lock<butil::Mutex> ul(s.mutex);
+    Slot slot(s, key, now_ms, on_expire_);
+    return fn(slot);
+  }
+
+  void Erase(const K& key){
+    Shard& s = shard(key);
+    std::unique_lock<butil::Mutex> ul(s.mutex);
+    s.entries.erase(key);
+  }
+
+  // Call fn(key, value) on every entry, expired or not, and remove them all.
+  template <typename Fn>
+  void Drain(Fn fn){
+    for (auto& s : shards_){
+      std::unique_lock<butil::Mutex> ul(s.mutex);
+      for (const auto& key_and_entry : s.entries){
+        fn(key_and_entry.first, key_and_entry.second.value);
+      }
+      s.entries.clear();
+    }
+  }
+
+ private:
+  Shard& shard(const K& key){
+    return shards_[static_cast<uint64_t>(Hash()(key)) % kShardNum];
+  }
+
+  enum { kShardNum = 64 };
+  const ExpireFn on_expire_;
+  Shard shards_[kShardNum];
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_UTIL_SHARDED_TTL_MAP_H_
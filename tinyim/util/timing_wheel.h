@@ -0,0 +1,103 @@
+#ifndef TINYIM_UTIL_TIMING_WHEEL_H_
+#define TINYIM_UTIL_TIMING_WHEEL_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace tinyim {
+
+// Hierarchical timing wheel of ids, three levels of 256 slots, so timers up
+// to 2^24 ticks ahead cost one push_back to add and are cascaded to a finer
+// level at most twice before firing. Timers can not be removed, the owner
+// keeps the tick each id is armed for and ignores stale ones when fired.
+// Not thread safe.
+class TimingWheel {
+ public:
+  // Ticks up to `now_tick' are treated as passed.
+  explicit TimingWheel(int64_t now_tick): cur_tick_(now_tick) {}
+
+  TimingWheel(const TimingWheel&) = delete;
+  TimingWheel& operator=(const TimingWheel&) = delete;
+
+  // Fire `id' at `tick', or at the next tick if it is passed already.
+  void Add(int64_t id, int64_t tick){
+    Place(Timer{id, tick}, cur_tick_ + 1);
+  }
+
+  // Move to `now_tick' and call fn(id, tick) for every timer due, in tick
+  // order.
+  template <typename Fn>
+  void Advance(int64_t now_tick, Fn fn){
+    std::vector<Timer> due;
+    while (cur_tick_ < now_tick){
+      const int64_t tick = cur_tick_ + 1;
+      // a new round of a level starts, spread its current slot to finer levels
+      for (int level = kLevelNum - 1; level > 0; --level){
+        if ((tick & ((int64_t{1} << (kSlotBits * level)) - 1)) == 0){
+          due.swap(slots_[level][(tick >> (kSlotBits * level)) & kSlotMask]);
+          size_ -= due.size();
+          for (const Timer& timer : due){
+            Place(timer, tick);
+          }
+          due.clear();
+        }
+      }
+      cur_tick_ = tick;
+      due.swap(slots_[0][tick & kSlotMask]);
+      size_ -= due.size();
+      for (const Timer& timer : due){
+        fn(timer.id, timer.tick);
+      }
+      due.clear();
+    }
+  }
+
+  int64_t cur_tick() const {
+    return cur_tick_;
+  }
+
+  size_t size() const {
+    return size_;
+  }
+
+  // Memory held by the slots
+  size_t ResidentBytes() const {
+    size_t bytes = sizeof(*this);
+    for (const auto& level : slots_){
+      for (const auto& slot : level){
+        bytes += slot.capacity() * sizeof(Timer);
+      }
+    }
+    return bytes;
+  }
+
+ private:
+  struct Timer {
+    int64_t id;
+    int64_t tick;
+  };
+
+  // Put `timer' in the finest level whose round starting at `next_tick'
+  // covers it, timers farther than the top level are cascaded early and put
+  // back.
+  void Place(const Timer& timer, int64_t next_tick){
+    const int64_t fire_tick = timer.tick > next_tick ? timer.tick : next_tick;
+    const int64_t delta = fire_tick - next_tick;
+    int level = 0;
+    while (level < kLevelNum - 1 && delta >= (int64_t{1} << (kSlotBits * (level + 1)))){
+      ++level;
+    }
+    slots_[level][(fire_tick >> (kSlotBits * level)) & kSlotMask].push_back(timer);
+    ++size_;
+  }
+
+  enum { kSlotBits = 8, kSlotNum = 1 << kSlotBits, kSlotMask = kSlotNum - 1, kLevelNum = 3 };
+  std::vector<Timer> slots_[kLevelNum][kSlotNum];
+  int64_t cur_tick_;
+  size_t size_ = 0;
+};
+
+}  // namespace tinyim
+
+#endif  // TINYIM_UTIL_TIMING_WHEEL_H_